@@ -16,10 +16,6 @@
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/GenericValue.h>
-#include <llvm/ExecutionEngine/Interpreter.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Passes/PassBuilder.h>
@@ -39,8 +35,12 @@
 #include <remill/OS/OS.h>
 #include <test_runner/TestRunner.h>
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <mutex>
 #include <random>
+#include <thread>
 
 #include "Whitelist.h"
 #include "gtest/gtest.h"
@@ -52,6 +52,14 @@ DEFINE_string(repro_file, "", "File to output failing test cases");
 DEFINE_string(whitelist, "", "File listing instruction states not to check");
 DEFINE_bool(should_dump_functions, false, "Dump each function version");
 DEFINE_bool(stop_on_fail, false, "Stop on first failure");
+DEFINE_uint64(batch_size, 64,
+              "Number of random states to run through each function at once");
+DEFINE_bool(trace_memory, false,
+            "Record memory accesses, and log them when memory states differ");
+DEFINE_uint64(jobs, 1, "Number of worker threads to shard test cases across");
+DEFINE_bool(clone_full_semantics, false,
+            "Clone and optimize the whole semantics module for each test case, "
+            "instead of only what the lifted functions reference");
 
 
 struct InstructionFunction {
@@ -147,7 +155,11 @@ class DifferentialModuleBuilder {
 
     CHECK(remill::VerifyModule(tst));
 
-    auto cloned = llvm::CloneModule(*tst);
+    // Optimizing only what the two functions reference keeps the cost of each
+    // test case proportional to the instruction, not to the semantics module.
+    auto cloned = FLAGS_clone_full_semantics
+                      ? llvm::CloneModule(*tst)
+                      : remill::CloneFunctionsWithDependencies({f1, f2});
 
     if (auto maybe_message = remill::VerifyModuleMsg(cloned.get())) {
       LOG(FATAL) << *maybe_message;
@@ -233,69 +245,133 @@ class ComparisonRunner {
   }
 
  public:
-  DiffTestResult
-  SingleCmpRun(size_t insn_length, llvm::Function *f1, llvm::Function *f2,
-               const std::vector<WhiteListInstruction> &whitelist,
-               std::string_view isel_name) {
-
-    X86State func1_state{};
-    test_runner::RandomizeState(func1_state, this->rbe);
-    func1_state.addr.ds_base.dword = 0;
-    func1_state.addr.ss_base.dword = 0;
-    func1_state.addr.es_base.dword = 0;
-    func1_state.addr.cs_base.dword = 0;
-    func1_state.aflag.af = test_runner::random_boolean_flag(this->rbe);
-    func1_state.aflag.cf = test_runner::random_boolean_flag(this->rbe);
-    func1_state.aflag.df = test_runner::random_boolean_flag(this->rbe);
-    func1_state.aflag.of = test_runner::random_boolean_flag(this->rbe);
-    func1_state.aflag.pf = test_runner::random_boolean_flag(this->rbe);
-    func1_state.aflag.sf = test_runner::random_boolean_flag(this->rbe);
-    func1_state.aflag.zf = test_runner::random_boolean_flag(this->rbe);
-
-    if (isel_name.rfind("REP_") != std::string::npos) {
-      LOG(INFO) << "setting ecx to 1";
-      func1_state.gpr.rcx.dword = 1;
+  // Returns a byte mask over `X86State` that is zero wherever the whitelist
+  // says to ignore differences for `isel_name`.
+  static X86State
+  WhitelistMask(const std::vector<WhiteListInstruction> &whitelist,
+                std::string_view isel_name) {
+    X86State mask{};
+    std::memset(&mask, 0xff, sizeof(X86State));
+    for (const auto &it : whitelist) {
+      it.ApplyToInsn(isel_name, &mask);
     }
+    return mask;
+  }
+
+  // Compares two states under `mask`. This deliberately has no early exit, so
+  // that it vectorizes.
+  static bool StatesEqual(const X86State &a, const X86State &b,
+                          const X86State &mask) {
+    auto a_bytes = reinterpret_cast<const uint8_t *>(&a);
+    auto b_bytes = reinterpret_cast<const uint8_t *>(&b);
+    auto mask_bytes = reinterpret_cast<const uint8_t *>(&mask);
+    uint8_t diff = 0;
+    for (size_t i = 0; i < sizeof(X86State); ++i) {
+      diff |= (a_bytes[i] ^ b_bytes[i]) & mask_bytes[i];
+    }
+    return !diff;
+  }
 
-    X86State func2_state{};
+  // Returns a copy of `state` with the bytes outside of `mask` zeroed, like
+  // applying the whitelist to `state` would.
+  static X86State MaskedState(const X86State &state, const X86State &mask) {
+    X86State masked = state;
+    auto masked_bytes = reinterpret_cast<uint8_t *>(&masked);
+    auto mask_bytes = reinterpret_cast<const uint8_t *>(&mask);
+    for (size_t i = 0; i < sizeof(X86State); ++i) {
+      masked_bytes[i] &= mask_bytes[i];
+    }
+    return masked;
+  }
 
-    auto init_state = this->DumpState(&func1_state);
+  // Runs `f1` and `f2` over `num_states` random states, and returns the
+  // results of only those runs where the two disagree.
+  std::vector<DiffTestResult>
+  BatchCmpRun(size_t insn_length, test_runner::LiftedFunction<X86State> f1,
+              test_runner::LiftedFunction<X86State> f2, const X86State &mask,
+              std::string_view isel_name, size_t num_states) {
+
+    std::vector<X86State> init_states(num_states, X86State{});
+    test_runner::RandomizeStates(init_states.data(), num_states, this->rbe);
+    for (auto &state : init_states) {
+      state.addr.ds_base.dword = 0;
+      state.addr.ss_base.dword = 0;
+      state.addr.es_base.dword = 0;
+      state.addr.cs_base.dword = 0;
+      state.aflag.af = test_runner::random_boolean_flag(this->rbe);
+      state.aflag.cf = test_runner::random_boolean_flag(this->rbe);
+      state.aflag.df = test_runner::random_boolean_flag(this->rbe);
+      state.aflag.of = test_runner::random_boolean_flag(this->rbe);
+      state.aflag.pf = test_runner::random_boolean_flag(this->rbe);
+      state.aflag.sf = test_runner::random_boolean_flag(this->rbe);
+      state.aflag.zf = test_runner::random_boolean_flag(this->rbe);
+
+      if (isel_name.rfind("REP_") != std::string::npos) {
+        state.gpr.rcx.dword = 1;
+      }
+    }
 
-    std::memcpy(&func2_state, &func1_state, sizeof(X86State));
+    std::vector<X86State> func1_states(init_states);
+    std::vector<X86State> func2_states(init_states);
+    std::vector<std::unique_ptr<test_runner::MemoryHandler>> mem_handlers;
+    std::vector<std::unique_ptr<test_runner::MemoryHandler>> second_handlers;
+    mem_handlers.reserve(num_states);
+    second_handlers.reserve(num_states);
 
-    auto mem_handler =
-        std::make_unique<test_runner::MemoryHandler>(this->endian);
     auto pc_fetch = [](X86State *st) { return st->gpr.rip.qword; };
-    test_runner::ExecuteLiftedFunction<X86State, uint64_t>(
-        f1, insn_length, &func1_state, mem_handler.get(), pc_fetch);
-    auto second_handler = std::make_unique<test_runner::MemoryHandler>(
-        this->endian, mem_handler->GetUninitializedReads());
-    test_runner::ExecuteLiftedFunction<X86State, uint64_t>(
-        f2, insn_length, &func2_state, second_handler.get(), pc_fetch);
-
-
-    auto memory_state_eq =
-        mem_handler->GetMemory() == second_handler->GetMemory();
-
-    // NOTE(Ian): Here we log differences in instructions that arise from a different memory interaction.
-    if (!memory_state_eq) {
-      LOG(ERROR) << "Memory state differs";
-      LOG(ERROR) << mem_handler->DumpState();
-      LOG(ERROR) << second_handler->DumpState();
+    for (size_t i = 0; i < num_states; ++i) {
+      auto &mem_handler = mem_handlers.emplace_back(
+          std::make_unique<test_runner::MemoryHandler>(this->endian));
+      mem_handler->EnableTracing(FLAGS_trace_memory);
+      test_runner::ExecuteLiftedFunction<X86State, uint64_t>(
+          f1, insn_length, &func1_states[i], mem_handler.get(), pc_fetch);
     }
 
-    for (const auto &it : whitelist) {
-      it.ApplyToInsn(isel_name, &func1_state);
-      it.ApplyToInsn(isel_name, &func2_state);
+    for (size_t i = 0; i < num_states; ++i) {
+      auto &second_handler = second_handlers.emplace_back(
+          std::make_unique<test_runner::MemoryHandler>(
+              this->endian, mem_handlers[i]->GetUninitializedReads()));
+      second_handler->EnableTracing(FLAGS_trace_memory);
+      test_runner::ExecuteLiftedFunction<X86State, uint64_t>(
+          f2, insn_length, &func2_states[i], second_handler.get(), pc_fetch);
     }
 
-    auto are_equal =
-        std::memcmp(&func1_state, &func2_state, sizeof(X86State)) == 0 &&
-        memory_state_eq;
+    std::vector<DiffTestResult> mismatches;
+    for (size_t i = 0; i < num_states; ++i) {
+      const auto &mem_handler = mem_handlers[i];
+      const auto &second_handler = second_handlers[i];
+      auto memory_state_eq =
+          mem_handler->GetMemory() == second_handler->GetMemory();
+      auto are_equal =
+          StatesEqual(func1_states[i], func2_states[i], mask) &&
+          memory_state_eq;
+      if (are_equal) {
+        continue;
+      }
 
+      // NOTE(Ian): Here we log differences in instructions that arise from a different memory interaction.
+      if (!memory_state_eq) {
+        LOG(ERROR) << "Memory state differs";
+        LOG(ERROR) << mem_handler->DumpState();
+        LOG(ERROR) << second_handler->DumpState();
+        if (FLAGS_trace_memory) {
+          LOG(ERROR) << "Memory accesses of f1:\n"
+                     << mem_handler->DumpTrace();
+          LOG(ERROR) << "Memory accesses of f2:\n"
+                     << second_handler->DumpTrace();
+        }
+      }
 
-    return {init_state, this->DumpState(&func1_state),
-            this->DumpState(&func2_state), are_equal};
+      // Dump the states as they were compared, so that differences in
+      // whitelisted fields don't show up in the report.
+      auto func1_state = MaskedState(func1_states[i], mask);
+      auto func2_state = MaskedState(func2_states[i], mask);
+      mismatches.push_back({this->DumpState(&init_states[i]),
+                            this->DumpState(&func1_state),
+                            this->DumpState(&func2_state), are_equal});
+    }
+
+    return mismatches;
   }
 };
 
@@ -330,6 +406,7 @@ std::string test_case_name(std::string_view prefix, uint64_t test_cast_ctr) {
 
 // Returns true when test case succeeds
 bool runTestCase(const TestCase &tc, DifferentialModuleBuilder &diffbuilder,
+                 test_runner::JITSession &session,
                  const std::vector<WhiteListInstruction> &whitelist,
                  uint64_t ctr) {
   LOG(INFO) << "Starting testcase: " << llvm::toHex(tc.bytes);
@@ -356,18 +433,29 @@ bool runTestCase(const TestCase &tc, DifferentialModuleBuilder &diffbuilder,
     LOG(INFO) << remill::LLVMThingToString(diff_mod->GetF<1>().llvm_function);
   }
 
-  for (uint64_t i = 0; i < FLAGS_num_iterations; i++) {
-    auto tc_result = comp_runner.SingleCmpRun(
-        tc.bytes.size(), diff_mod->GetF<0>().llvm_function,
-        diff_mod->GetF<1>().llvm_function, whitelist,
-        diff_mod->GetF<0>().isel_name);
-
-    if (!tc_result.are_equal) {
+  // Compile both functions once, and run every iteration on the same code.
+  session.AddModule(*diff_mod->GetModule());
+  auto f1 = session.GetLiftedFunction<X86State>(
+      diff_mod->GetF<0>().llvm_function);
+  auto f2 = session.GetLiftedFunction<X86State>(
+      diff_mod->GetF<1>().llvm_function);
+
+  const auto mask = ComparisonRunner::WhitelistMask(
+      whitelist, diff_mod->GetF<0>().isel_name);
+  const auto batch_size = std::max<uint64_t>(1u, FLAGS_batch_size);
+  for (uint64_t i = 0; i < FLAGS_num_iterations; i += batch_size) {
+    auto mismatches = comp_runner.BatchCmpRun(
+        tc.bytes.size(), f1, f2, mask, diff_mod->GetF<0>().isel_name,
+        std::min<uint64_t>(batch_size, FLAGS_num_iterations - i));
+
+    if (!mismatches.empty()) {
       LOG(ERROR) << "Difference in instruction" << std::hex << tc.addr << ": "
                  << llvm::toHex(tc.bytes);
-      LOG(INFO) << "Init state: " << tc_result.init_state_dump << std::endl;
-      LOG(INFO) << tc_result.struct_dump1 << std::endl;
-      LOG(INFO) << tc_result.struct_dump2 << std::endl;
+      for (const auto &tc_result : mismatches) {
+        LOG(INFO) << "Init state: " << tc_result.init_state_dump << std::endl;
+        LOG(INFO) << tc_result.struct_dump1 << std::endl;
+        LOG(INFO) << tc_result.struct_dump2 << std::endl;
+      }
       return false;
     }
   }
@@ -376,6 +464,44 @@ bool runTestCase(const TestCase &tc, DifferentialModuleBuilder &diffbuilder,
 }
 
 
+enum class TestCaseResult : uint8_t { kNotRun, kPassed, kFailed };
+
+// Everything one worker needs to run test cases independently of the others.
+struct TestWorker {
+  TestWorker(void)
+      : diffbuilder(DifferentialModuleBuilder::Create(
+            remill::OSName::kOSLinux, remill::ArchName::kArchX86,
+            remill::OSName::kOSLinux, remill::ArchName::kArchX86_SLEIGH)) {}
+
+  DifferentialModuleBuilder diffbuilder;
+  test_runner::JITSession session;
+};
+
+// Write the bytes of every failed test case to the repro file, in the same
+// order as the input, so that the output doesn't depend on scheduling.
+void WriteReproFile(const std::vector<TestCase> &testcases,
+                    const std::vector<TestCaseResult> &results) {
+  if (FLAGS_repro_file.empty()) {
+    return;
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream o(FLAGS_repro_file, ec);
+  if (ec) {
+    LOG(FATAL) << ec.message();
+  }
+
+  llvm::json::Array arr;
+  for (size_t i = 0; i < testcases.size(); ++i) {
+    if (results[i] == TestCaseResult::kFailed) {
+      arr.push_back(llvm::toHex(testcases[i].bytes));
+    }
+  }
+
+  llvm::json::operator<<(o, llvm::json::Value(std::move(arr)));
+}
+
+
 int main(int argc, char **argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
@@ -430,40 +556,69 @@ int main(int argc, char **argv) {
     LOG(ERROR) << "Not using a whitelist";
   }
 
-  DifferentialModuleBuilder diffbuilder = DifferentialModuleBuilder::Create(
-      remill::OSName::kOSLinux, remill::ArchName::kArchX86,
-      remill::OSName::kOSLinux, remill::ArchName::kArchX86_SLEIGH);
-  uint64_t ctr = 0;
-
-  std::vector<TestCase> failed_testcases;
-  auto succeeded_tot = true;
-  for (auto tc : testcases) {
-    auto tc_succeeded = runTestCase(tc, diffbuilder, whitelist, ++ctr);
-    if (!tc_succeeded) {
-      succeeded_tot = false;
-      failed_testcases.push_back(tc);
-    }
+  const auto num_jobs = std::max<uint64_t>(
+      1u, std::min<uint64_t>(FLAGS_jobs, testcases.size()));
 
-    if (!FLAGS_repro_file.empty() && !tc_succeeded) {
-      std::error_code ec;
-      llvm::raw_fd_ostream o(FLAGS_repro_file, ec);
-      if (ec) {
-        LOG(FATAL) << ec.message();
-      }
+  // Each worker gets its own context, lifters and JIT. They are created up
+  // front, one at a time, because building an arch isn't thread-safe.
+  std::vector<std::unique_ptr<TestWorker>> workers;
+  for (uint64_t i = 0; i < num_jobs; ++i) {
+    workers.emplace_back(std::make_unique<TestWorker>());
+  }
 
-      llvm::json::Array arr;
-      for (auto tc : failed_testcases) {
-        arr.push_back(llvm::toHex(tc.bytes));
+  std::vector<TestCaseResult> results(testcases.size(),
+                                      TestCaseResult::kNotRun);
+  std::mutex results_lock;
+  std::atomic<size_t> next_tc{0};
+  std::atomic<bool> stop{false};
+
+  auto run_worker = [&](TestWorker *worker) {
+    while (!stop.load()) {
+      const size_t i = next_tc.fetch_add(1);
+      if (i >= testcases.size()) {
+        break;
       }
 
-      llvm::json::operator<<(o, llvm::json::Value(std::move(arr)));
+      auto tc_succeeded = runTestCase(testcases[i], worker->diffbuilder,
+                                      worker->session, whitelist, i + 1);
+      worker->session.EndTestCase();
+
+      std::lock_guard<std::mutex> locker(results_lock);
+      results[i] =
+          tc_succeeded ? TestCaseResult::kPassed : TestCaseResult::kFailed;
+      if (!tc_succeeded) {
+
+        // Keep the repro file up to date, in case a later test case crashes.
+        WriteReproFile(testcases, results);
+        if (FLAGS_stop_on_fail) {
+          stop.store(true);
+        }
+      }
     }
+  };
 
-    if (!succeeded_tot && FLAGS_stop_on_fail) {
-      return 2;
+  if (num_jobs == 1) {
+    run_worker(workers.front().get());
+  } else {
+    std::vector<std::thread> threads;
+    for (auto &worker : workers) {
+      threads.emplace_back(run_worker, worker.get());
+    }
+    for (auto &thread : threads) {
+      thread.join();
     }
   }
 
+  size_t num_run = 0;
+  size_t num_failed = 0;
+  for (auto result : results) {
+    num_run += result != TestCaseResult::kNotRun;
+    num_failed += result == TestCaseResult::kFailed;
+  }
+
+  LOG(INFO) << "Passed " << (num_run - num_failed) << " of " << num_run
+            << " test cases run (" << testcases.size() << " total)";
 
+  auto succeeded_tot = !num_failed;
   return succeeded_tot ? 0 : 2;
 }
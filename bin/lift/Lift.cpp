@@ -29,6 +29,7 @@
 #include <remill/Arch/Instruction.h>
 #include <remill/Arch/Name.h>
 #include <remill/BC/ABI.h>
+#include <remill/BC/ImageTraceManager.h>
 #include <remill/BC/IntrinsicTable.h>
 #include <remill/BC/Lifter.h>
 #include <remill/BC/Optimizer.h>
@@ -41,7 +42,6 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
-#include <map>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -66,6 +66,24 @@ DEFINE_uint64(entry_address, 0,
 
 DEFINE_string(bytes, "", "Hex-encoded byte string to lift.");
 
+DEFINE_string(binary, "",
+              "Path to a raw binary or ELF file containing the code to lift. "
+              "The file is memory-mapped rather than copied. The PT_LOAD "
+              "segments of ELF files are mapped at their virtual addresses; "
+              "other files are mapped whole at --address, unless --segment "
+              "is specified.");
+
+DEFINE_string(segment, "",
+              "Comma-separated list of <address>:<offset>:<size> hex "
+              "triples. Each maps <size> bytes of --binary, starting at file "
+              "offset <offset>, to virtual address <address>. A <size> of "
+              "zero maps everything up to the end of the file.");
+
+DEFINE_bool(lift_directly, false,
+            "Emit the semantics of instructions straight into the lifted "
+            "traces, rather than through one function per instruction, where "
+            "the architecture supports it.");
+
 DEFINE_string(ir_out, "", "Path to file where the LLVM IR should be saved.");
 DEFINE_string(bc_out, "",
               "Path to file where the LLVM bitcode should be "
@@ -76,12 +94,10 @@ DEFINE_string(slice_inputs, "",
 DEFINE_string(slice_outputs, "",
               "Comma-separated list of registers to treat as outputs.");
 
-using Memory = std::map<uint64_t, uint8_t>;
-
-// Unhexlify the data passed to `--bytes`, and fill in `memory` with each
-// such byte.
-static Memory UnhexlifyInputBytes(uint64_t addr_mask) {
-  Memory memory;
+// Unhexlify the data passed to `--bytes`.
+static std::string UnhexlifyInputBytes(uint64_t addr_mask) {
+  std::string memory;
+  memory.reserve(FLAGS_bytes.size() / 2);
 
   for (size_t i = 0; i < FLAGS_bytes.size(); i += 2) {
     char nibbles[] = {FLAGS_bytes[i], FLAGS_bytes[i + 1], '\0'};
@@ -111,66 +127,52 @@ static Memory UnhexlifyInputBytes(uint64_t addr_mask) {
       exit(EXIT_FAILURE);
     }
 
-    memory[byte_addr] = static_cast<uint8_t>(byte_val);
+    memory.push_back(static_cast<char>(byte_val));
   }
 
   return memory;
 }
 
-class SimpleTraceManager : public remill::TraceManager {
- public:
-  virtual ~SimpleTraceManager(void) = default;
+// Map the segments of the file passed to `--binary` into `manager`.
+static bool MapInputBinary(remill::ImageTraceManager &manager) {
+  if (FLAGS_segment.empty()) {
+    if (remill::ImageTraceManager::IsELFFile(FLAGS_binary)) {
+      return manager.AddELFSegments(FLAGS_binary);
+    } else {
+      return manager.AddFileSegment(FLAGS_binary, FLAGS_address);
+    }
+  }
 
-  explicit SimpleTraceManager(Memory &memory_) : memory(memory_) {}
+  llvm::SmallVector<llvm::StringRef, 4> segments;
+  llvm::StringRef(FLAGS_segment)
+      .split(segments, ',', -1, false /* KeepEmpty */);
 
- protected:
-  // Called when we have lifted, i.e. defined the contents, of a new trace.
-  // The derived class is expected to do something useful with this.
-  void SetLiftedTraceDefinition(uint64_t addr,
-                                llvm::Function *lifted_func) override {
-    traces[addr] = lifted_func;
-  }
+  for (auto segment : segments) {
+    llvm::SmallVector<llvm::StringRef, 3> parts;
+    segment.split(parts, ':');
 
-  // Get a declaration for a lifted trace. The idea here is that a derived
-  // class might have additional global info available to them that lets
-  // them declare traces ahead of time. In order to distinguish between
-  // stuff we've lifted, and stuff we haven't lifted, we allow the lifter
-  // to access "defined" vs. "declared" traces.
-  //
-  // NOTE: This is permitted to return a function from an arbitrary module.
-  llvm::Function *GetLiftedTraceDeclaration(uint64_t addr) override {
-    auto trace_it = traces.find(addr);
-    if (trace_it != traces.end()) {
-      return trace_it->second;
-    } else {
-      return nullptr;
+    uint64_t nums[3] = {};
+    auto ok = parts.size() == 3u;
+    for (auto i = 0u; ok && i < 3u; ++i) {
+      auto part = parts[i].trim();
+      part.consume_front("0x");
+      ok = !part.getAsInteger(16, nums[i]);
     }
-  }
 
-  // Get a definition for a lifted trace.
-  //
-  // NOTE: This is permitted to return a function from an arbitrary module.
-  llvm::Function *GetLiftedTraceDefinition(uint64_t addr) override {
-    return GetLiftedTraceDeclaration(addr);
-  }
+    if (!ok) {
+      std::cerr << "Invalid segment '" << segment.str()
+                << "' specified in --segment. Expected "
+                << "<address>:<offset>:<size>." << std::endl;
+      return false;
+    }
 
-  // Try to read an executable byte of memory. Returns `true` of the byte
-  // at address `addr` is executable and readable, and updates the byte
-  // pointed to by `byte` with the read value.
-  bool TryReadExecutableByte(uint64_t addr, uint8_t *byte) override {
-    auto byte_it = memory.find(addr);
-    if (byte_it != memory.end()) {
-      *byte = byte_it->second;
-      return true;
-    } else {
+    if (!manager.AddFileSegment(FLAGS_binary, nums[0], nums[1], nums[2])) {
       return false;
     }
   }
 
- public:
-  Memory &memory;
-  std::unordered_map<uint64_t, llvm::Function *> traces;
-};
+  return true;
+}
 
 // Looks for calls to a function like `__remill_function_return`, and
 // replace its state pointer with a null pointer so that the state
@@ -221,9 +223,15 @@ int main(int argc, char *argv[]) {
   google::InitGoogleLogging(argv[0]);
 
 
-  if (FLAGS_bytes.empty()) {
-    std::cerr << "Please specify a sequence of hex bytes to --bytes."
-              << std::endl;
+  if (FLAGS_bytes.empty() == FLAGS_binary.empty()) {
+    std::cerr << "Please specify either a sequence of hex bytes to --bytes, "
+              << "or a file to --binary." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (!FLAGS_segment.empty() && FLAGS_binary.empty()) {
+    std::cerr << "Please specify the file to which --segment refers with "
+              << "--binary." << std::endl;
     return EXIT_FAILURE;
   }
 
@@ -258,23 +266,39 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  std::unique_ptr<llvm::Module> module(remill::LoadArchSemantics(arch.get()));
+  // Only the semantics of the instructions that we lift are read in.
+  std::unique_ptr<llvm::Module> module(
+      remill::LoadArchSemanticsLazily(arch.get()));
 
   const auto mem_ptr_type = arch->MemoryPointerType();
 
-  Memory memory = UnhexlifyInputBytes(addr_mask);
-  SimpleTraceManager manager(memory);
+  remill::ImageTraceManager manager;
+  if (!FLAGS_binary.empty()) {
+    if (!MapInputBinary(manager)) {
+      std::cerr << "Could not map --binary file " << FLAGS_binary << std::endl;
+      return EXIT_FAILURE;
+    }
+  } else {
+    CHECK(manager.AddMemorySegment(UnhexlifyInputBytes(addr_mask),
+                                   FLAGS_address));
+  }
+
   remill::IntrinsicTable intrinsics(module.get());
 
 
   auto inst_lifter = arch->DefaultLifter(intrinsics);
 
   remill::TraceLifter trace_lifter(arch.get(), manager);
+  trace_lifter.SetLiftDirectly(FLAGS_lift_directly);
 
   // Lift all discoverable traces starting from `--entry_address` into
   // `module`.
   trace_lifter.Lift(FLAGS_entry_address);
 
+  // Nothing else will be lifted into `module`, so the semantics functions that
+  // were never needed can become declarations.
+  remill::DeclareUnmaterializedFunctions(module.get());
+
   // Optimize the module, but with a particular focus on only the functions
   // that we actually lifted.
   remill::OptimizationGuide guide = {};
@@ -20,7 +20,9 @@
 #include <remill/Arch/Context.h>
 
 #include <memory>
-#include <unordered_map>
+#include <mutex>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace llvm {
@@ -30,6 +32,7 @@ class StructType;
 }  // namespace llvm
 namespace remill {
 
+class InstructionLifter;
 struct Register;
 
 
@@ -101,7 +104,19 @@ class ArchBase : public remill::Arch {
 
   mutable std::vector<std::unique_ptr<Register>> registers;
   mutable std::vector<const Register *> reg_by_offset;
-  mutable std::unordered_map<std::string, const Register *> reg_by_name;
+
+  // Registers sorted by name. The keys view the `name` of the `Register`s
+  // owned by `registers`. This is only ever appended to by `AddRegister`
+  // (i.e. within `PopulateRegisterTable`); afterward, register lookups are
+  // read-only and may happen concurrently.
+  //
+  // NOTE: This does not make an `Arch` safe to share between lifting threads.
+  //       Decoding and lifting go through the shared instruction lifter,
+  //       whose register pointer cache is written on every lifted
+  //       instruction, so each lifting thread needs its own `Arch`, as in
+  //       `ParallelTraceLifter`.
+  mutable std::vector<std::pair<std::string_view, const Register *>>
+      reg_by_name;
   mutable std::unique_ptr<IntrinsicTable> instrinsics{nullptr};
 };
 
@@ -125,6 +140,15 @@ class DefaultContextAndLifter : virtual public remill::ArchBase {
   virtual bool ArchDecodeInstruction(uint64_t address,
                                      std::string_view instr_bytes,
                                      Instruction &inst) const = 0;
+
+ private:
+  // Returns the lifter shared by every instruction decoded by this arch, so
+  // that its register pointer cache survives across the instructions of a
+  // lifted function. It is built once, for this arch's own intrinsic table.
+  const std::shared_ptr<InstructionLifter> &SharedLifter(void) const;
+
+  mutable std::once_flag shared_lifter_once;
+  mutable std::shared_ptr<InstructionLifter> shared_lifter;
 };
 
 
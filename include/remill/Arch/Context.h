@@ -19,6 +19,7 @@
 
 
 #include <functional>
+#include <string>
 #include <string_view>
 #include <unordered_map>
 
@@ -46,6 +47,13 @@ class DecodingContext {
   uint64_t GetContextValue(const std::string &context_reg) const;
   DecodingContext PutContextReg(std::string creg, uint64_t value) const;
 
+  // Two contexts are equal if they hold the same values for the same context
+  // registers.
+  bool operator==(const DecodingContext &that) const;
+
+  // Hash of the context register values, consistent with `operator==`.
+  size_t Hash(void) const;
+
   static ContextMap UniformContextMapping(DecodingContext cst);
 };
 
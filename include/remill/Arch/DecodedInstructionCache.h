@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Context.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace remill {
+
+class Instruction;
+
+// A bounded cache of decoded instructions, keyed by the decoding arch, the
+// decoding context, the address, and the instruction bytes. Once the cache
+// holds `max_num_entries` decodings, the least recently used ones are evicted.
+//
+// Lifting overlapping traces, or re-lifting the same code, decodes the same
+// instructions over and over again; with a cache, each one is decoded once,
+// and later decodings are copied out of the cache.
+//
+// NOTE: A cache can be shared by several `TraceLifter`s, and is safe to use
+//       from several threads at once. Entries refer to their `Arch` by
+//       address, so a cache must be `Clear`ed before any of the `Arch`es
+//       that it has seen is destroyed.
+class DecodedInstructionCache {
+ public:
+  static constexpr size_t kDefaultMaxNumEntries = 1u << 16;
+
+  ~DecodedInstructionCache(void);
+
+  explicit DecodedInstructionCache(
+      size_t max_num_entries = kDefaultMaxNumEntries);
+
+  // Decode an instruction with `arch`, or copy a previous decoding of the
+  // same bytes at the same address into `inst`.
+  Arch::DecodingResult DecodeInstruction(const Arch *arch, uint64_t address,
+                                         std::string_view instr_bytes,
+                                         Instruction &inst,
+                                         DecodingContext context);
+
+  // Decode an instruction that is within a delay slot with `arch`, or copy a
+  // previous decoding of the same bytes at the same address into `inst`.
+  Arch::DecodingResult
+  DecodeDelayedInstruction(const Arch *arch, uint64_t address,
+                           std::string_view instr_bytes, Instruction &inst,
+                           DecodingContext context);
+
+  // Remove all cached decodings.
+  void Clear(void);
+
+  // Number of cached decodings.
+  size_t Size(void) const;
+
+  // Number of decodings that were, or were not, served out of the cache.
+  uint64_t NumHits(void) const;
+  uint64_t NumMisses(void) const;
+
+ private:
+  DecodedInstructionCache(const DecodedInstructionCache &) = delete;
+  DecodedInstructionCache &operator=(const DecodedInstructionCache &) = delete;
+
+  class Impl;
+
+  std::unique_ptr<Impl> impl;
+};
+
+}  // namespace remill
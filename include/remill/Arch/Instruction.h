@@ -16,8 +16,10 @@
 
 #pragma once
 
+#include <llvm/ADT/SmallVector.h>
 #include <remill/BC/InstructionLifter.h>
 
+#include <memory>
 #include <string>
 #include <variant>
 #include <vector>
@@ -33,6 +35,10 @@ class Arch;
 struct Register;
 class OperandExpression;
 
+namespace sleigh {
+class PcodeBuffer;
+}  // namespace sleigh
+
 enum ArchName : unsigned;
 
 struct LLVMOpExpr {
@@ -185,6 +191,14 @@ class Instruction {
   // Name of semantics function that implements this instruction.
   std::string function;
 
+  // Id of the semantics of `function` in the intrinsic table `isel_table`.
+  // Decoders resolve it once, so that lifting indexes the table instead of
+  // looking up `function` by name. Lifters using another table resolve
+  // `function` again, and cache the result here. Code that changes `function`
+  // after decoding must reset `isel_table` to `nullptr`.
+  unsigned isel_id;
+  const IntrinsicTable *isel_table;
+
   // The decoded bytes of the instruction.
   std::string bytes;
 
@@ -235,6 +249,11 @@ class Instruction {
   // but it can be used in different applications.
   const Register *segment_override = nullptr;
 
+  // The p-code of an instruction decoded by a SLEIGH-based arch, recorded at
+  // decode time so that lifting doesn't need to run SLEIGH again. Copies of
+  // this instruction share it.
+  std::shared_ptr<const sleigh::PcodeBuffer> pcode;
+
   enum Category {
     kCategoryInvalid,
     kCategoryNormal,
@@ -254,7 +273,8 @@ class Instruction {
     kCategoryConditionalAsyncHyperCall,
   } category;
 
-  std::vector<Operand> operands;
+  // Most instructions have only a few operands, so keep those inline.
+  llvm::SmallVector<Operand, 4> operands;
 
   std::string Serialize(void) const;
 
@@ -358,8 +378,14 @@ class Instruction {
 
  private:
   InstructionLifter::LifterPtr lifter;
-  static constexpr auto kMaxNumExpr = 64u;
-  OperandExpression exprs[kMaxNumExpr];
+
+  // Expressions are allocated on demand, in fixed-size blocks. Copies of an
+  // instruction share its blocks, so the expressions that their operands
+  // point to stay alive as long as any copy does.
+  struct ExpressionBlock;
+  std::vector<std::shared_ptr<ExpressionBlock>> expr_blocks;
+
+  // Index of the next free expression in the last block of `expr_blocks`.
   unsigned next_expr_index{0};
 };
 
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <remill/BC/TraceLifter.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llvm {
+class MemoryBuffer;
+}  // namespace llvm
+namespace remill {
+
+// A trace manager that serves executable bytes out of a sorted table of
+// segments. Segments backed by files are memory-mapped read-only, so lifting
+// large images doesn't copy them, nor build any per-byte structures.
+class ImageTraceManager : public TraceManager {
+ public:
+  virtual ~ImageTraceManager(void);
+
+  ImageTraceManager(void);
+
+  // Map `size` bytes of the file at `path`, starting at file offset `offset`,
+  // to the address `addr`. A `size` of zero maps everything up to the end of
+  // the file. Returns `false` if the file can't be mapped, or if the segment
+  // overlaps an existing one.
+  bool AddFileSegment(const std::string &path, uint64_t addr,
+                      uint64_t offset = 0, uint64_t size = 0,
+                      bool is_executable = true);
+
+  // Map a copy of `data` to the address `addr`.
+  bool AddMemorySegment(std::string_view data, uint64_t addr,
+                        bool is_executable = true);
+
+  // Map the `PT_LOAD` segments of the ELF file at `path` to their virtual
+  // addresses. Returns `false` if `path` is not an ELF file, or if any of its
+  // segments can't be mapped.
+  bool AddELFSegments(const std::string &path);
+
+  // Returns `true` if the file at `path` looks like an ELF file.
+  static bool IsELFFile(const std::string &path);
+
+  // Called when we have lifted, i.e. defined the contents, of a new trace.
+  void SetLiftedTraceDefinition(uint64_t addr,
+                                llvm::Function *lifted_func) override;
+
+  // Get a declaration for a lifted trace.
+  llvm::Function *GetLiftedTraceDeclaration(uint64_t addr) override;
+
+  // Get a definition for a lifted trace.
+  llvm::Function *GetLiftedTraceDefinition(uint64_t addr) override;
+
+  // Try to read an executable byte of memory.
+  bool TryReadExecutableByte(uint64_t addr, uint8_t *byte) override;
+
+  // Get a view of up to `max_size` contiguous executable bytes starting at
+  // `addr`. The view points directly into the mapped segment.
+  std::string_view TryReadExecutableBytes(uint64_t addr,
+                                          size_t max_size) override;
+
+  TraceMap traces;
+
+ private:
+  ImageTraceManager(const ImageTraceManager &) = delete;
+  ImageTraceManager &operator=(const ImageTraceManager &) = delete;
+
+  struct Segment {
+    uint64_t addr;
+    std::string_view data;
+    bool is_executable;
+  };
+
+  // Memory-map the file at `path`. The mapping lives as long as this manager.
+  const llvm::MemoryBuffer *MapFile(const std::string &path);
+
+  // Add `data` to the segment table, keeping it sorted.
+  bool AddSegment(std::string_view data, uint64_t addr, bool is_executable);
+
+  // Find the segment containing `addr`, or `nullptr`.
+  const Segment *FindSegment(uint64_t addr) const;
+
+  // Sorted by `Segment::addr`; segments never overlap.
+  std::vector<Segment> segments;
+
+  // Backing storage of the segments.
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+};
+
+}  // namespace remill
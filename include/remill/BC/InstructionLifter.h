@@ -100,6 +100,18 @@ class InstructionLifter : public OperandLifter {
   LiftStatus LiftIntoBlock(Instruction &inst, llvm::BasicBlock *block,
                            bool is_delayed = false);
 
+  // Like `LiftIntoBlock`, but lifters that would otherwise lift `inst` into a
+  // function of its own, and then call that function from `block`, instead
+  // emit the semantics of `inst` straight into `block`. By default, this is
+  // `LiftIntoBlock`.
+  virtual LiftStatus LiftIntoBlockDirectly(Instruction &inst,
+                                           llvm::BasicBlock *block,
+                                           llvm::Value *state_ptr,
+                                           bool is_delayed = false);
+
+  LiftStatus LiftIntoBlockDirectly(Instruction &inst, llvm::BasicBlock *block,
+                                   bool is_delayed = false);
+
   // Load the address of a register.
   std::pair<llvm::Value *, llvm::Type *>
   LoadRegAddress(llvm::BasicBlock *block, llvm::Value *state_ptr,
@@ -17,11 +17,13 @@
 #pragma once
 
 #include <memory>
+#include <string_view>
 
 namespace llvm {
 class ConstantArray;
 class Function;
 class FunctionType;
+class GlobalVariable;
 class IntegerType;
 class Module;
 class PointerType;
@@ -103,8 +105,28 @@ class IntrinsicTable {
   llvm::IntegerType *const pc_type;
   llvm::PointerType *const mem_ptr_type;
 
+  // Dense identifier of an instruction's semantics, i.e. of one of the
+  // `ISEL_*` variables in the semantics module.
+  using ISelId = unsigned;
+  static constexpr ISelId kInvalidISelId = ~0u;
+
+  // Returns the id of the semantics named by the ISEL name `name`, which
+  // doesn't include the `ISEL_` prefix, or `kInvalidISelId`. ISEL variables
+  // that were added to the module after this table was created are found
+  // too, just less quickly.
+  ISelId ISelIdForName(std::string_view name) const;
+
+  // Returns the semantics function with the id `id`, or `nullptr` if there
+  // isn't one.
+  llvm::Function *ISelFunction(ISelId id) const;
+
  private:
   IntrinsicTable(void) = delete;
+
+  // Built once, when the table is created, so that resolving the semantics of
+  // an instruction is usually a single hash lookup and an array index.
+  struct ISelTable;
+  std::shared_ptr<const ISelTable> isels;
 };
 
 }  // namespace remill
@@ -23,6 +23,7 @@
 #pragma clang diagnostic ignored "-Wdocumentation"
 #pragma clang diagnostic ignored "-Wswitch-enum"
 #include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
 #pragma clang diagnostic pop
 
 #include <functional>
@@ -41,11 +42,73 @@ namespace remill {
 
 class Arch;
 
+// Which optimization pipeline to run over lifted code.
+enum class OptimizationPipeline {
+
+  // Only inline semantics functions into the lifted code.
+  kInlineOnly,
+
+  // The standard LLVM `-O1`, `-O2`, and `-O3` function simplification
+  // pipelines, run after inlining semantics.
+  kO1,
+  kO2,
+  kO3,
+
+  // A pipeline tuned for lifted code: inline semantics, scalarize `State`
+  // allocas, promote `State` fields to SSA values with `StatePromotionPass`,
+  // eliminate redundant loads and stores of registers with GVN and EarlyCSE,
+  // then forward and eliminate dead writes of the `__remill_write_memory_*`
+  // intrinsics.
+  kRemill
+};
+
+// Caches the fields of `State` that a lifted function accesses in SSA values
+// for the duration of the function. Fields are only written back to `State`
+// before calls that are passed a pointer into `State`, and thus can observe
+// it, e.g. `__remill_function_call`, `__remill_async_hyper_call`,
+// `__remill_jump`, or other lifted functions, and before returns. Fields are
+// re-read after such calls.
+//
+// Only fields that are always accessed at the same offset and with the same
+// type are promoted. Nothing is promoted if a pointer into `State` escapes
+// other than as a call argument, e.g. if it is stored to memory, so this
+// should run after semantics are inlined and after SROA.
+class StatePromotionPass : public llvm::PassInfoMixin<StatePromotionPass> {
+ public:
+  llvm::PreservedAnalyses run(llvm::Function &func,
+                              llvm::FunctionAnalysisManager &fam);
+};
+
+// Forwards values written by `__remill_write_memory_*` to reads of the same
+// address out of the resulting memory pointer, and removes writes that are
+// immediately overwritten at the same address. The memory intrinsics are
+// `readnone` and thread an explicit memory pointer, so LLVM's own DSE can't
+// see through them.
+//
+// Only writes and reads that are directly chained through the memory pointer
+// are considered, so anything else that takes the memory pointer in between,
+// e.g. a barrier or a write to another address, keeps them as they are.
+class MemoryIntrinsicDSEPass
+    : public llvm::PassInfoMixin<MemoryIntrinsicDSEPass> {
+ public:
+  llvm::PreservedAnalyses run(llvm::Function &func,
+                              llvm::FunctionAnalysisManager &fam);
+};
+
 struct OptimizationGuide {
   bool slp_vectorize;
   bool loop_vectorize;
   bool verify_input;
   bool verify_output;
+  OptimizationPipeline pipeline{OptimizationPipeline::kInlineOnly};
+
+  // Number of threads on which to optimize lifted functions. A value of zero
+  // uses one thread per hardware thread. With more than one thread, each
+  // thread optimizes its share of the lifted functions within its own
+  // `llvm::LLVMContext`, in a copy of just those functions and of everything
+  // that they transitively reference. The optimized functions are then cloned
+  // back into the original module.
+  unsigned num_threads{1};
 };
 
 template <typename T>
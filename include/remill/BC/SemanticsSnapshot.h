@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <remill/Arch/Name.h>
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llvm {
+class Module;
+}  // namespace llvm
+namespace remill {
+
+class Arch;
+
+// An immutable, in-memory snapshot of the semantics bitcode of an
+// architecture. The bitcode file is memory-mapped once, and the semantics
+// function of every ISEL is indexed up front. A snapshot is not tied to any
+// `llvm::LLVMContext`, so it can be shared by many threads, each of which
+// cheaply instantiates its own semantics module from it.
+//
+// NOTE: The index maps ISELs to the *names* of their semantics functions, not
+//       to the offsets of their bodies within the bitcode, as LLVM's bitcode
+//       reader doesn't expose those offsets. Each `Instantiate` therefore
+//       re-parses the module-level records of the bitcode, i.e. the types,
+//       globals and function declarations, with `llvm::getLazyBitcodeModule`,
+//       and then looks functions up by name. Function bodies are still only
+//       read in when they are materialized. The memory-mapped bitcode is what
+//       is shared, not the parse of it.
+class SemanticsSnapshot {
+ public:
+  ~SemanticsSnapshot(void);
+
+  // Load a snapshot of the semantics bitcode file of `arch_name`.
+  // `sem_dirs` is forwarded to `FindSemanticsBitcodeFile`. Returns `nullptr`
+  // if the file can't be found or parsed.
+  static std::shared_ptr<const SemanticsSnapshot>
+  Load(ArchName arch_name,
+       const std::vector<std::filesystem::path> &sem_dirs = {});
+
+  // Load a snapshot of the semantics bitcode file at `path`.
+  static std::shared_ptr<const SemanticsSnapshot>
+  LoadFromFile(const std::filesystem::path &path);
+
+  // Instantiate a semantics module for `arch` within `arch->context`. Like
+  // `LoadArchSemanticsLazily`, function bodies are only read in when first
+  // needed, but the module-level records are parsed again for each call. The
+  // module reads from this snapshot's memory, and so must not outlive it.
+  std::unique_ptr<llvm::Module> Instantiate(const Arch *arch) const;
+
+  // Instantiate a semantics module for `arch` that only defines the semantics
+  // functions of the ISELs named in `isel_names`, the functions that they use,
+  // and the semantics of invalid and unsupported instructions. Every other
+  // function is declared. ISEL names don't have the `ISEL_` prefix, i.e. they
+  // are like `Instruction::function`.
+  //
+  // The `ISEL_*` variables of every other ISEL point at the semantics of
+  // unsupported instructions, so instructions that weren't anticipated by
+  // `isel_names` lift as unsupported instructions rather than as calls to
+  // undefined semantics functions.
+  std::unique_ptr<llvm::Module>
+  Instantiate(const Arch *arch,
+              const std::vector<std::string> &isel_names) const;
+
+  // Returns the name of the semantics function of the ISEL `isel_name`.
+  std::optional<std::string_view>
+  SemanticsFunctionName(std::string_view isel_name) const;
+
+  // The number of indexed ISELs.
+  size_t NumISels(void) const;
+
+  // The path of the semantics bitcode file.
+  const std::filesystem::path &Path(void) const;
+
+ private:
+  SemanticsSnapshot(void) = delete;
+  SemanticsSnapshot(const SemanticsSnapshot &) = delete;
+  SemanticsSnapshot &operator=(const SemanticsSnapshot &) = delete;
+
+  class Impl;
+
+  explicit SemanticsSnapshot(std::unique_ptr<Impl> impl_);
+
+  const std::unique_ptr<Impl> impl;
+};
+
+}  // namespace remill
@@ -21,6 +21,8 @@
 
 #include <mutex>
 #include <sleigh/libsleigh.hh>
+#include <string>
+#include <vector>
 
 #include "remill/Arch/Instruction.h"
 #include "remill/BC/InstructionLifter.h"
@@ -37,7 +39,22 @@ class SleighLifter : public InstructionLifter {
  private:
   class PcodeToLLVMEmitIntoBlock;
 
-  std::unique_ptr<sleigh::SingleInstructionSleighContext> sleigh_context;
+  // Built on first use, so that instructions which are decoded but never
+  // lifted don't pay for initializing a SLEIGH engine. The lifter is shared
+  // by all users of an architecture, so this is only ever built once, under
+  // `sleigh_context_once`.
+  mutable std::once_flag sleigh_context_once;
+  mutable std::unique_ptr<sleigh::SingleInstructionSleighContext>
+      sleigh_context;
+
+  // Names of the SLEIGH user-defined ops, indexed by `CALLOTHER`'s first
+  // input. Filled in along with `sleigh_context`.
+  mutable std::vector<std::string> user_op_names;
+
+  // Serializes re-decoding instructions with `sleigh_context`, which resets
+  // and updates its state.
+  std::mutex sleigh_context_lock;
+
   // Architecture being used for lifting.
   const sleigh::SleighArch *const arch;
 
@@ -53,6 +70,16 @@ class SleighLifter : public InstructionLifter {
   LiftStatus LiftIntoBlock(Instruction &inst, llvm::BasicBlock *block,
                            llvm::Value *state_ptr, bool is_delayed) override;
 
+  // `LiftIntoBlock` lifts the p-code of each instruction into its own
+  // always-inline function, which it then calls from `block`. This instead
+  // lifts the p-code of instructions with straight-line p-code directly into
+  // `block`, using the register pointers of `block`'s function. This avoids
+  // creating, and later inlining, one function per lifted instruction. Other
+  // instructions are lifted like by `LiftIntoBlock`.
+  LiftStatus LiftIntoBlockDirectly(Instruction &inst, llvm::BasicBlock *block,
+                                   llvm::Value *state_ptr,
+                                   bool is_delayed) override;
+
  private:
   static void SetISelAttributes(llvm::Function *);
 
@@ -60,6 +87,14 @@ class SleighLifter : public InstructionLifter {
   LiftIntoInternalBlock(Instruction &inst, llvm::Module *target_mod,
                         bool is_delayed);
 
+  // Lift the recorded, straight-line p-code of `inst` directly into `block`.
+  LiftStatus LiftPcodeIntoBlock(Instruction &inst, llvm::BasicBlock *block,
+                                llvm::Value *state_ptr);
+
+  const std::vector<std::string> &GetUserOpNames(void) const;
+
+  sleigh::SingleInstructionSleighContext &GetSleighContext(void) const;
+
   ::Sleigh &GetEngine(void) const;
 };
 
@@ -16,13 +16,22 @@
 
 #pragma once
 
+#include <remill/Arch/Name.h>
 #include <remill/BC/Lifter.h>
+#include <remill/OS/OS.h>
 
 #include <functional>
+#include <memory>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace remill {
 
+class DecodedInstructionCache;
+class SemanticsSnapshot;
+
 using TraceMap = std::unordered_map<uint64_t, llvm::Function *>;
 
 enum class DevirtualizedTargetKind { kTraceLocal, kTraceHead };
@@ -79,6 +88,16 @@ class TraceManager {
   // at address `addr` is executable and readable, and updates the byte
   // pointed to by `byte` with the read value.
   virtual bool TryReadExecutableByte(uint64_t addr, uint8_t *byte) = 0;
+
+  // Try to get a view of up to `max_size` contiguous executable bytes starting
+  // at address `addr`. The view may be shorter than `max_size` if the
+  // executable region ends earlier, and must remain valid until the trace
+  // lifter returns. An empty view means that the lifter should fall back on
+  // reading one byte at a time with `TryReadExecutableByte`.
+  //
+  // By default, this returns an empty view.
+  virtual std::string_view TryReadExecutableBytes(uint64_t addr,
+                                                  size_t max_size);
 };
 
 // Implements a recursive decoder that lifts a trace of instructions to bitcode.
@@ -86,10 +105,15 @@ class TraceLifter {
  public:
   ~TraceLifter(void);
 
-  inline TraceLifter(const Arch *arch_, TraceManager &manager_)
-      : TraceLifter(arch_, &manager_) {}
+  inline TraceLifter(const Arch *arch_, TraceManager &manager_,
+                     DecodedInstructionCache *decode_cache_ = nullptr)
+      : TraceLifter(arch_, &manager_, decode_cache_) {}
 
-  TraceLifter(const Arch *arch_, TraceManager *manager_);
+  // If `decode_cache_` is non-`nullptr`, then instructions are decoded through
+  // it, so that re-decoding the same instructions, e.g. when traces overlap,
+  // or across several lifters sharing the cache, is cheap.
+  TraceLifter(const Arch *arch_, TraceManager *manager_,
+              DecodedInstructionCache *decode_cache_ = nullptr);
 
   static void NullCallback(uint64_t, llvm::Function *);
 
@@ -99,6 +123,31 @@ class TraceLifter {
   Lift(uint64_t addr,
        std::function<void(uint64_t, llvm::Function *)> callback = NullCallback);
 
+  // Enable or disable incremental lifting. When enabled, the lifter keeps the
+  // blocks and indirect jumps of each trace that it lifts, so that `Relift`
+  // can later extend the trace in place. Indirect jumps are always lifted as
+  // `switch`es over their devirtualized targets, even if there are none yet.
+  void SetIncremental(bool incremental);
+
+  // Lift instructions with `InstructionLifter::LiftIntoBlockDirectly` rather
+  // than with `LiftIntoBlock`. E.g. the SLEIGH lifter then emits the p-code of
+  // most instructions straight into the trace, instead of creating a function
+  // per instruction that has to be inlined later. Disabled by default.
+  void SetLiftDirectly(bool lift_directly);
+
+  // Re-lift the trace starting at `addr`, after the manager has learned of
+  // new devirtualized targets of its indirect jumps. Adds cases for the new
+  // targets to the existing `switch`es, and lifts only the newly reachable
+  // blocks, and any new traces that they reach. Calls `callback` with each
+  // extended or lifted trace. If the trace wasn't lifted incrementally by
+  // this lifter, or its function was since deleted, then this is `Lift`.
+  //
+  // NOTE: The trace function must not have been changed since it was last
+  //       lifted, e.g. by optimizing it.
+  bool Relift(uint64_t addr,
+              std::function<void(uint64_t, llvm::Function *)> callback =
+                  NullCallback);
+
  private:
   TraceLifter(void) = delete;
 
@@ -107,4 +156,69 @@ class TraceLifter {
   std::unique_ptr<Impl> impl;
 };
 
+// Lifts many traces in parallel. Each worker thread owns its own
+// `llvm::LLVMContext`, `Arch`, semantics module, and `TraceLifter`, and pulls
+// trace heads from a shared work queue. Newly discovered trace heads (e.g.
+// direct call targets) are pushed back onto the shared queue so that any
+// worker can lift them. Traces refer to each other through declarations, and
+// are resolved by name when the lifted traces are cloned into the destination
+// module at the end. The workers instantiate their semantics modules from a
+// `SemanticsSnapshot`, so the semantics bitcode file is only read once.
+//
+// NOTE: `TraceName`, `TryReadExecutableByte`, `TryReadExecutableBytes`,
+//       `ForEachDevirtualizedTarget`, `GetLiftedTraceDeclaration`, and
+//       `GetLiftedTraceDefinition` of `manager` are called concurrently from
+//       the worker threads, and so must be safe to call concurrently.
+//       Only the non-`nullptr`-ness of `GetLiftedTraceDeclaration` and
+//       `GetLiftedTraceDefinition` is used by the workers.
+//       `SetLiftedTraceDefinition` is only called from the thread invoking
+//       `Lift`, once all workers have finished, and is passed the trace's
+//       function in the destination module.
+class ParallelTraceLifter {
+ public:
+  // Called on a worker thread once that worker has lifted all of its traces,
+  // and before those traces are cloned into the destination module, e.g. to
+  // optimize the worker's module in parallel. The callback must not erase
+  // the lifted traces.
+  using WorkerModuleCallback =
+      std::function<void(const Arch *, llvm::Module *, const TraceMap &)>;
+
+  ~ParallelTraceLifter(void);
+
+  inline ParallelTraceLifter(
+      OSName os_name_, ArchName arch_name_, TraceManager &manager_,
+      unsigned num_workers_ = 0,
+      std::shared_ptr<const SemanticsSnapshot> semantics_ = nullptr)
+      : ParallelTraceLifter(os_name_, arch_name_, &manager_, num_workers_,
+                            std::move(semantics_)) {}
+
+  // If `num_workers_` is zero, then one worker per hardware thread is used.
+  // If `semantics_` is `nullptr`, then a snapshot of the semantics of
+  // `arch_name_` is loaded.
+  ParallelTraceLifter(
+      OSName os_name_, ArchName arch_name_, TraceManager *manager_,
+      unsigned num_workers_ = 0,
+      std::shared_ptr<const SemanticsSnapshot> semantics_ = nullptr);
+
+  static void NullCallback(const Arch *, llvm::Module *, const TraceMap &);
+
+  // Lift the traces starting at `addrs`, along with any traces they reach,
+  // then clone each lifted trace into `dest_module`. Returns `false` if any
+  // of the workers failed to lift a trace.
+  //
+  // Only the traces are cloned: the semantics functions and intrinsics that
+  // they call are merely declared in `dest_module`, unless `dest_module`
+  // already defines them. Use `callback` to e.g. inline semantics into the
+  // traces within the workers' modules beforehand.
+  bool Lift(const std::vector<uint64_t> &addrs, llvm::Module *dest_module,
+            WorkerModuleCallback callback = NullCallback);
+
+ private:
+  ParallelTraceLifter(void) = delete;
+
+  class Impl;
+
+  std::unique_ptr<Impl> impl;
+};
+
 }  // namespace remill
@@ -166,6 +166,45 @@ std::unique_ptr<llvm::Module>
 LoadArchSemantics(const Arch *arch,
                   const std::vector<std::filesystem::path> &sem_dirs);
 
+// Like `LoadModuleFromFile`, but only reads the bodies of functions on demand,
+// e.g. via `MaterializeSemantics`. The file is memory-mapped for as long as the
+// module lives. Falls back to `LoadModuleFromFile` for textual IR files.
+std::unique_ptr<llvm::Module>
+LoadModuleFromFileLazily(llvm::LLVMContext *context,
+                         std::filesystem::path file_name);
+
+// Like `LoadArchSemantics`, but the bodies of semantics functions are only
+// read in from the bitcode file when `IntrinsicTable::ISelFunction` first
+// resolves an ISEL that uses them. This keeps start-up cheap when only a
+// handful of instructions are lifted.
+//
+// NOTE: Functions whose bodies were never read in have no body, yet are not
+//       declarations either, so most LLVM passes and the bitcode writer can't
+//       handle them. Once done lifting into the module, and before saving it
+//       or running passes over all of it, call
+//       `DeclareUnmaterializedFunctions`. `OptimizeModule` doesn't need this,
+//       and leaves such functions be, so that more code can be lifted into the
+//       module afterwards.
+std::unique_ptr<llvm::Module>
+LoadArchSemanticsLazily(
+    const Arch *arch, const std::vector<std::filesystem::path> &sem_dirs = {});
+
+// Prepare the lazily loaded semantics module `module` for lifting code of
+// `arch`, e.g. after loading it with `LoadModuleFromFileLazily`.
+void PrepareLazySemanticsModule(const Arch *arch, llvm::Module *module);
+
+// Read in the body of the lazily loaded semantics function `func`, as well as
+// the bodies of the lazily loaded functions that it transitively references,
+// annotating each as `Semantics`. This is a no-op for functions that already
+// have bodies. Returns `false` if a body can't be read.
+bool MaterializeSemantics(llvm::Function *func);
+
+// Turn every function in `module` whose body was never read in from bitcode
+// into an external declaration. Their bodies can't be read in afterwards, so
+// this is meant to be the final step for a lazily loaded module, once nothing
+// else will be lifted into it.
+void DeclareUnmaterializedFunctions(llvm::Module *module);
+
 // Store an LLVM module into a file.
 bool StoreModuleToFile(llvm::Module *module, std::string_view file_name,
                        bool allow_failure = false);
@@ -238,6 +277,14 @@ unsigned ReplaceAllUsesOfConstant(llvm::Constant *old_c, llvm::Constant *new_c,
 // Move a function from one module into another module.
 void MoveFunctionIntoModule(llvm::Function *func, llvm::Module *dest_module);
 
+// Clone `funcs`, along with every function and variable that they
+// transitively reference, into a new module in the same context. Everything
+// else in the source module is left out, so the clone stays small even when
+// the source is a whole semantics module. All of `funcs` must belong to the
+// same module.
+std::unique_ptr<llvm::Module>
+CloneFunctionsWithDependencies(const std::vector<llvm::Function *> &funcs);
+
 // Get an instance of `type` that belongs to `context`.
 llvm::Type *RecontextualizeType(llvm::Type *type, llvm::LLVMContext &context);
 
@@ -35,6 +35,7 @@
 
 #include "remill/Arch/Name.h"
 #include "remill/BC/ABI.h"
+#include "remill/BC/InstructionLifter.h"
 #include "remill/BC/Util.h"
 #include "remill/BC/Version.h"
 #include "remill/OS/OS.h"
@@ -309,14 +310,14 @@ void ArchBase::ForEachRegister(std::function<void(const Register *)> cb) const {
 }
 
 // Return information about a register, given its name.
-const Register *ArchBase::RegisterByName(std::string_view name_) const {
-  std::string name(name_.data(), name_.size());
-
-  auto [curr_val_it, added] = reg_by_name.emplace(std::move(name), nullptr);
-  if (added) {
-    return nullptr;
+const Register *ArchBase::RegisterByName(std::string_view name) const {
+  auto it = std::lower_bound(
+      reg_by_name.begin(), reg_by_name.end(), name,
+      [](const auto &entry, std::string_view key) { return entry.first < key; });
+  if (it != reg_by_name.end() && it->first == name) {
+    return it->second;
   }
-  return curr_val_it->second;
+  return nullptr;
 }
 
 namespace {
@@ -756,8 +757,8 @@ const Register *ArchBase::AddRegister(const char *reg_name_,
   CHECK_NOTNULL(val_type);
 
   const std::string reg_name(reg_name_);
-  if (auto reg = reg_by_name.find(reg_name); reg != reg_by_name.end()) {
-    return reg->second;
+  if (auto reg = RegisterByName(reg_name)) {
+    return reg;
   }
 
   const auto dl = this->DataLayout();
@@ -765,15 +766,20 @@ const Register *ArchBase::AddRegister(const char *reg_name_,
   // If this is a sub-register, then link it in.
   const Register *parent_reg = nullptr;
   if (parent_reg_name) {
-    parent_reg = reg_by_name[parent_reg_name];
+    parent_reg = RegisterByName(parent_reg_name);
   }
 
   auto reg_impl = new Register(reg_name, offset, val_type, parent_reg, this);
 
   //reg_impl->ComputeGEPAccessors(dl, this->state_type);
 
-
-  reg_by_name.emplace(reg_name, reg_impl);
+  std::string_view reg_key(reg_impl->name);
+  reg_by_name.emplace(
+      std::upper_bound(reg_by_name.begin(), reg_by_name.end(), reg_key,
+                       [](std::string_view key, const auto &entry) {
+                         return key < entry.first;
+                       }),
+      reg_key, reg_impl);
   registers.emplace_back(reg_impl);
 
   auto maybe_get_reg_name = [](auto reg_ptr) -> std::string {
@@ -859,9 +865,16 @@ DecodingContext DefaultContextAndLifter::CreateInitialContext(void) const {
 Arch::DecodingResult DefaultContextAndLifter::DecodeInstruction(
     uint64_t address, std::string_view instr_bytes, Instruction &inst,
     DecodingContext context) const {
-  inst.SetLifter(std::make_unique<remill::InstructionLifter>(
-      this, this->GetInstrinsicTable()));
+  inst.SetLifter(this->SharedLifter());
+  inst.isel_table = nullptr;
   if (this->ArchDecodeInstruction(address, instr_bytes, inst)) {
+
+    // Resolve the semantics once here, rather than every time that `inst`, or
+    // a cached copy of it, is lifted.
+    if (auto intrinsics = this->GetInstrinsicTable()) {
+      inst.isel_id = intrinsics->ISelIdForName(inst.function);
+      inst.isel_table = intrinsics;
+    }
     return [](uint64_t) -> DecodingContext { return DecodingContext(); };
   }
 
@@ -871,9 +884,21 @@ Arch::DecodingResult DefaultContextAndLifter::DecodeInstruction(
 
 OperandLifter::OpLifterPtr DefaultContextAndLifter::DefaultLifter(
     const remill::IntrinsicTable &intrinsics) const {
+  if (&intrinsics == this->GetInstrinsicTable()) {
+    return this->SharedLifter();
+  }
   return std::make_shared<InstructionLifter>(this, intrinsics);
 }
 
+const std::shared_ptr<InstructionLifter> &
+DefaultContextAndLifter::SharedLifter(void) const {
+  std::call_once(shared_lifter_once, [this] {
+    shared_lifter =
+        std::make_shared<InstructionLifter>(this, this->GetInstrinsicTable());
+  });
+  return shared_lifter;
+}
+
 
 DefaultContextAndLifter::DefaultContextAndLifter(llvm::LLVMContext *context_,
                                                  OSName os_name_,
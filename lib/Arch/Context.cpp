@@ -27,6 +27,21 @@ DecodingContext DecodingContext::PutContextReg(std::string creg,
   return DecodingContext(std::move(new_value));
 }
 
+bool DecodingContext::operator==(const DecodingContext &that) const {
+  return this->context_value == that.context_value;
+}
+
+size_t DecodingContext::Hash(void) const {
+
+  // Combine the register hashes in an order-independent way, as the
+  // iteration order of two equal maps may differ.
+  size_t hash = this->context_value.size();
+  for (const auto &[reg, val] : this->context_value) {
+    hash += std::hash<std::string>{}(reg) ^ (std::hash<uint64_t>{}(val) * 31u);
+  }
+  return hash;
+}
+
 DecodingContext::ContextMap
 DecodingContext::UniformContextMapping(DecodingContext cst) {
   return [cst = std::move(cst)](uint64_t) -> DecodingContext { return cst; };
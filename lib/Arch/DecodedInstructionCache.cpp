@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "remill/Arch/DecodedInstructionCache.h"
+
+#include <remill/Arch/Instruction.h>
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace remill {
+namespace {
+
+// Identifies one decoding. The decoders only look at `bytes`, so two
+// decodings with equal keys produce the same instruction.
+struct DecodingKey {
+  const Arch *arch;
+  uint64_t address;
+  bool is_delayed;
+  DecodingContext context;
+  std::string bytes;
+  size_t hash;
+
+  bool operator==(const DecodingKey &that) const {
+    return hash == that.hash && arch == that.arch &&
+           address == that.address && is_delayed == that.is_delayed &&
+           bytes == that.bytes && context == that.context;
+  }
+};
+
+struct DecodingKeyPtrHash {
+  size_t operator()(const DecodingKey *key) const {
+    return key->hash;
+  }
+};
+
+struct DecodingKeyPtrEqual {
+  bool operator()(const DecodingKey *a, const DecodingKey *b) const {
+    return *a == *b;
+  }
+};
+
+static DecodingKey MakeKey(const Arch *arch, uint64_t address,
+                           std::string_view instr_bytes, bool is_delayed,
+                           DecodingContext context) {
+  auto hash = std::hash<std::string_view>{}(instr_bytes);
+  hash ^= std::hash<uint64_t>{}(address) + 0x9e3779b97f4a7c15ull +
+          (hash << 6) + (hash >> 2);
+  hash ^= std::hash<const Arch *>{}(arch) + (hash << 6) + (hash >> 2);
+  hash ^= context.Hash() + (hash << 6) + (hash >> 2);
+  hash += is_delayed;
+  return DecodingKey{arch,
+                     address,
+                     is_delayed,
+                     std::move(context),
+                     std::string(instr_bytes),
+                     hash};
+}
+
+}  // namespace
+
+class DecodedInstructionCache::Impl {
+ public:
+  explicit Impl(size_t max_num_entries_) : max_num_entries(max_num_entries_) {}
+
+  Arch::DecodingResult Decode(const Arch *arch, uint64_t address,
+                              std::string_view instr_bytes, Instruction &inst,
+                              DecodingContext context, bool is_delayed);
+
+  struct Entry {
+    DecodingKey key;
+    Instruction inst;
+    Arch::DecodingResult result;
+  };
+
+  using EntryList = std::list<Entry>;
+
+  // Copy out the decoding for `key`, if any. Marks the entry as most
+  // recently used.
+  bool Lookup(const DecodingKey &key, Instruction &inst,
+              Arch::DecodingResult &result);
+
+  // Add a decoding, evicting the least recently used entries if the cache is
+  // full.
+  void Insert(DecodingKey key, const Instruction &inst,
+              const Arch::DecodingResult &result);
+
+  const size_t max_num_entries;
+
+  mutable std::mutex lock;
+
+  // Entries ordered from most to least recently used.
+  EntryList entries;
+
+  // Index into `entries`. The keys are owned by the entries.
+  std::unordered_map<const DecodingKey *, EntryList::iterator,
+                     DecodingKeyPtrHash, DecodingKeyPtrEqual>
+      index;
+
+  uint64_t num_hits{0};
+  uint64_t num_misses{0};
+};
+
+bool DecodedInstructionCache::Impl::Lookup(const DecodingKey &key,
+                                           Instruction &inst,
+                                           Arch::DecodingResult &result) {
+  std::lock_guard<std::mutex> locker(lock);
+  auto it = index.find(&key);
+  if (it == index.end()) {
+    ++num_misses;
+    return false;
+  }
+
+  ++num_hits;
+  entries.splice(entries.begin(), entries, it->second);
+  inst = it->second->inst;
+  result = it->second->result;
+  return true;
+}
+
+void DecodedInstructionCache::Impl::Insert(DecodingKey key,
+                                           const Instruction &inst,
+                                           const Arch::DecodingResult &result) {
+  std::lock_guard<std::mutex> locker(lock);
+
+  // Another thread decoded the same instruction in the meantime.
+  if (index.count(&key)) {
+    return;
+  }
+
+  entries.push_front(Entry{std::move(key), inst, result});
+  index.emplace(&(entries.front().key), entries.begin());
+
+  while (entries.size() > max_num_entries) {
+    index.erase(&(entries.back().key));
+    entries.pop_back();
+  }
+}
+
+Arch::DecodingResult DecodedInstructionCache::Impl::Decode(
+    const Arch *arch, uint64_t address, std::string_view instr_bytes,
+    Instruction &inst, DecodingContext context, bool is_delayed) {
+
+  auto key = MakeKey(arch, address, instr_bytes, is_delayed, context);
+  Arch::DecodingResult result;
+  if (Lookup(key, inst, result)) {
+    return result;
+  }
+
+  // Decode outside of the lock, so that threads decoding different
+  // instructions don't wait on each other.
+  if (is_delayed) {
+    result = arch->DecodeDelayedInstruction(address, instr_bytes, inst,
+                                            std::move(context));
+  } else {
+    result = arch->DecodeInstruction(address, instr_bytes, inst,
+                                     std::move(context));
+  }
+
+  Insert(std::move(key), inst, result);
+  return result;
+}
+
+DecodedInstructionCache::~DecodedInstructionCache(void) {}
+
+DecodedInstructionCache::DecodedInstructionCache(size_t max_num_entries)
+    : impl(new Impl(max_num_entries)) {}
+
+Arch::DecodingResult DecodedInstructionCache::DecodeInstruction(
+    const Arch *arch, uint64_t address, std::string_view instr_bytes,
+    Instruction &inst, DecodingContext context) {
+  return impl->Decode(arch, address, instr_bytes, inst, std::move(context),
+                      false /* is_delayed */);
+}
+
+Arch::DecodingResult DecodedInstructionCache::DecodeDelayedInstruction(
+    const Arch *arch, uint64_t address, std::string_view instr_bytes,
+    Instruction &inst, DecodingContext context) {
+  return impl->Decode(arch, address, instr_bytes, inst, std::move(context),
+                      true /* is_delayed */);
+}
+
+void DecodedInstructionCache::Clear(void) {
+  std::lock_guard<std::mutex> locker(impl->lock);
+  impl->index.clear();
+  impl->entries.clear();
+}
+
+size_t DecodedInstructionCache::Size(void) const {
+  std::lock_guard<std::mutex> locker(impl->lock);
+  return impl->entries.size();
+}
+
+uint64_t DecodedInstructionCache::NumHits(void) const {
+  std::lock_guard<std::mutex> locker(impl->lock);
+  return impl->num_hits;
+}
+
+uint64_t DecodedInstructionCache::NumMisses(void) const {
+  std::lock_guard<std::mutex> locker(impl->lock);
+  return impl->num_misses;
+}
+
+}  // namespace remill
@@ -25,6 +25,7 @@
 
 #include "remill/Arch/Arch.h"
 #include "remill/Arch/Name.h"
+#include "remill/BC/IntrinsicTable.h"
 #include "remill/BC/Util.h"
 
 namespace remill {
@@ -303,7 +304,9 @@ std::string Condition::Serialize(void) const {
 
 
 Instruction::Instruction(void)
-    : pc(0),
+    : isel_id(IntrinsicTable::kInvalidISelId),
+      isel_table(nullptr),
+      pc(0),
       next_pc(0),
       delayed_pc(0),
       branch_taken_pc(0),
@@ -335,13 +338,37 @@ void Instruction::Reset(void) {
   arch = nullptr;
   operands.clear();
   function.clear();
+  isel_id = IntrinsicTable::kInvalidISelId;
+  isel_table = nullptr;
   bytes.clear();
+  pcode.reset();
+
+  // Hold on to one block, unless a copy of this instruction still uses it, so
+  // that decoding into a reused instruction doesn't allocate.
+  if (!expr_blocks.empty() && expr_blocks.front().use_count() == 1) {
+    expr_blocks.resize(1);
+  } else {
+    expr_blocks.clear();
+  }
   next_expr_index = 0;
 }
 
+struct Instruction::ExpressionBlock {
+  static constexpr unsigned kNumExprs = 16u;
+  OperandExpression exprs[kNumExprs];
+};
+
 OperandExpression *Instruction::AllocateExpression(void) {
-  CHECK_LT(next_expr_index, kMaxNumExpr);
-  return &(exprs[next_expr_index++]);
+  if (expr_blocks.empty() ||
+      next_expr_index == ExpressionBlock::kNumExprs ||
+      expr_blocks.back().use_count() > 1) {
+    expr_blocks.push_back(std::make_shared<ExpressionBlock>());
+    next_expr_index = 0;
+  }
+
+  auto expr = &(expr_blocks.back()->exprs[next_expr_index++]);
+  *expr = OperandExpression();
+  return expr;
 }
 
 OperandExpression *Instruction::EmplaceRegister(const Register *reg) {
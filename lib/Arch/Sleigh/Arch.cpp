@@ -21,6 +21,10 @@
 #include <remill/Arch/Name.h>
 #include <remill/BC/SleighLifter.h>
 
+#include <algorithm>
+#include <map>
+#include <utility>
+
 namespace remill::sleigh {
 
 namespace {
@@ -45,9 +49,75 @@ class AssemblyLogger : public AssemblyEmit {
 };
 }  // namespace
 
-PcodeDecoder::PcodeDecoder(::Sleigh &engine_, Instruction &inst_)
+void PcodeBuffer::Record(OpCode op, const VarnodeData *outvar,
+                         const VarnodeData *vars, int32_t isize) {
+  auto &rec = ops.emplace_back();
+  rec.opcode = op;
+  rec.first_varnode = static_cast<uint32_t>(varnodes.size());
+  rec.num_inputs = static_cast<uint16_t>(isize);
+  rec.has_output = outvar != nullptr;
+
+  auto add_varnode = [this](const VarnodeData &var) {
+    varnodes.push_back(Varnode{var.space->getIndex(),
+                               static_cast<uint32_t>(var.size), var.offset});
+  };
+
+  if (outvar) {
+    add_varnode(*outvar);
+  }
+  for (int32_t i = 0; i < isize; ++i) {
+    add_varnode(vars[i]);
+  }
+}
+
+void PcodeBuffer::Replay(::Sleigh &engine, uint64_t address,
+                         PcodeEmit &emitter) const {
+  const Address addr(engine.getDefaultCodeSpace(), address);
+  std::vector<VarnodeData> vars;
+  for (const auto &op : ops) {
+    const auto num_varnodes = op.num_inputs + (op.has_output ? 1u : 0u);
+    vars.resize(num_varnodes);
+    for (auto i = 0u; i < num_varnodes; ++i) {
+      const auto &var = varnodes[op.first_varnode + i];
+      vars[i].space = engine.getSpace(var.space_index);
+      vars[i].offset = var.offset;
+      vars[i].size = var.size;
+    }
+
+    if (op.has_output) {
+      // `vars[1]` would be out of bounds for an op without inputs.
+      emitter.dump(addr, op.opcode, vars.data(), vars.data() + 1,
+                   op.num_inputs);
+    } else {
+      emitter.dump(addr, op.opcode, nullptr, vars.data(), op.num_inputs);
+    }
+  }
+}
+
+bool PcodeBuffer::IsStraightLine(void) const {
+  for (size_t i = 0; i < ops.size(); ++i) {
+    switch (ops[i].opcode) {
+      case CPUI_CBRANCH: return false;
+      case CPUI_BRANCH:
+      case CPUI_BRANCHIND:
+      case CPUI_CALL:
+      case CPUI_CALLIND:
+      case CPUI_RETURN:
+        if ((i + 1u) != ops.size()) {
+          return false;
+        }
+        break;
+      default: break;
+    }
+  }
+  return true;
+}
+
+PcodeDecoder::PcodeDecoder(::Sleigh &engine_, Instruction &inst_,
+                           PcodeBuffer &pcode_)
     : engine(engine_),
-      inst(inst_) {}
+      inst(inst_),
+      pcode(pcode_) {}
 
 
 void PcodeDecoder::print_vardata(std::stringstream &s, VarnodeData &data) {
@@ -64,6 +134,8 @@ void PcodeDecoder::print_vardata(std::stringstream &s, VarnodeData &data) {
 
 void PcodeDecoder::dump(const Address &, OpCode op, VarnodeData *outvar,
                         VarnodeData *vars, int32_t isize) {
+  pcode.Record(op, outvar, vars, isize);
+
   std::stringstream ss;
 
   ss << get_opname(op);
@@ -285,12 +357,8 @@ std::vector<std::string> SingleInstructionSleighContext::getUserOpNames() {
   return res;
 }
 
-SingleInstructionSleighContext::SingleInstructionSleighContext(
-    std::string sla_name, std::string pspec_name)
-    : engine(&image, &ctx) {
-
-  auto guard = Arch::Lock(ArchName::kArchX86_SLEIGH);
-
+SleighSpec::SleighSpec(const std::string &sla_name,
+                       const std::string &pspec_name) {
   const std::optional<std::filesystem::path> sla_path =
       ::sleigh::FindSpecFile(sla_name.c_str());
   if (!sla_path) {
@@ -301,7 +369,7 @@ SingleInstructionSleighContext::SingleInstructionSleighContext(
   auto pspec_path = ::sleigh::FindSpecFile(pspec_name.c_str());
 
   if (!pspec_path) {
-    LOG(FATAL) << "Couldn't find required spec file: " << sla_name << '\n';
+    LOG(FATAL) << "Couldn't find required spec file: " << pspec_name << '\n';
   }
   LOG(INFO) << "Using pspec at: " << pspec_path->string();
 
@@ -310,9 +378,37 @@ SingleInstructionSleighContext::SingleInstructionSleighContext(
 
   auto pspec = storage.openDocument(pspec_path->string());
   storage.registerTag(pspec->getRoot());
+}
+
+std::shared_ptr<SleighSpec> SleighSpec::Get(const std::string &sla_name,
+                                            const std::string &pspec_name) {
+  static std::mutex specs_lock;
+  static std::map<std::pair<std::string, std::string>,
+                  std::shared_ptr<SleighSpec>>
+      specs;
+
+  std::lock_guard<std::mutex> locker(specs_lock);
+  auto &spec = specs[{sla_name, pspec_name}];
+  if (!spec) {
+    spec = std::make_shared<SleighSpec>(sla_name, pspec_name);
+  }
+  return spec;
+}
+
+DocumentStorage &SleighSpec::GetStorage(void) {
+  return storage;
+}
+
+SingleInstructionSleighContext::SingleInstructionSleighContext(
+    std::string sla_name, std::string pspec_name)
+    : engine(&image, &ctx) {
+
+  auto guard = Arch::Lock(ArchName::kArchX86_SLEIGH);
+  spec = SleighSpec::Get(sla_name, pspec_name);
   this->restoreEngineFromStorage();
 }
 void SingleInstructionSleighContext::restoreEngineFromStorage() {
+  auto &storage = spec->GetStorage();
   this->ctx = ContextInternal();
   engine.initialize(storage);
   if (const Element *spec_xml = storage.getTag("processor_spec")) {
@@ -370,8 +466,7 @@ SleighArch::DecodingResult
 SleighArch::DecodeInstruction(uint64_t address, std::string_view instr_bytes,
                               Instruction &inst,
                               DecodingContext context) const {
-  inst.SetLifter(
-      std::make_shared<SleighLifter>(this, *this->GetInstrinsicTable()));
+  inst.SetLifter(this->SharedLifter());
   assert(inst.GetLifter() != nullptr);
 
   if (const_cast<SleighArch *>(this)->DecodeInstructionImpl(
@@ -398,6 +493,36 @@ SleighArch::SleighArch(llvm::LLVMContext *context_, OSName os_name_,
       sla_name(sla_name),
       pspec_name(pspec_name) {}
 
+namespace {
+
+// Upper bound on the number of decoded instructions that we remember before
+// resetting the SLEIGH context. This bounds `SleighArch::decoded_bytes`.
+static constexpr size_t kMaxTrackedDecodes = 1u << 16;
+
+}  // namespace
+
+void SleighArch::PrepareSleighContext(uint64_t address,
+                                      std::string_view instr_bytes) {
+  auto needs_reset = !sleigh_ctx_ready ||
+                     decoded_bytes.size() >= kMaxTrackedDecodes ||
+                     !sleigh_ctx.ContextMatches(context_snapshot);
+
+  // SLEIGH may have cached the parse of a different instruction at `address`.
+  if (!needs_reset) {
+    if (auto it = decoded_bytes.find(address); it != decoded_bytes.end()) {
+      needs_reset = instr_bytes.substr(0, it->second.size()) != it->second;
+    }
+  }
+
+  if (needs_reset) {
+    sleigh_ctx.resetContext();
+    InitializeSleighContext(sleigh_ctx);
+    context_snapshot = sleigh_ctx.SnapshotContext();
+    decoded_bytes.clear();
+    sleigh_ctx_ready = true;
+  }
+}
+
 bool SleighArch::DecodeInstructionImpl(uint64_t address,
                                        std::string_view instr_bytes,
                                        Instruction &inst) {
@@ -406,9 +531,10 @@ bool SleighArch::DecodeInstructionImpl(uint64_t address,
 
 
   // Now decode the instruction.
-  this->sleigh_ctx.resetContext();
-  this->InitializeSleighContext(this->sleigh_ctx);
-  PcodeDecoder pcode_handler(this->sleigh_ctx.GetEngine(), inst);
+  this->PrepareSleighContext(address, instr_bytes);
+  auto pcode = std::make_shared<PcodeBuffer>();
+  PcodeDecoder pcode_handler(this->sleigh_ctx.GetEngine(), inst, *pcode);
+  InstructionFunctionSetter setter(inst);
 
   LOG(INFO) << "Provided insn size: " << instr_bytes.size();
 
@@ -421,18 +547,21 @@ bool SleighArch::DecodeInstructionImpl(uint64_t address,
   inst.pc = address;
   inst.category = Instruction::kCategoryInvalid;
 
-  auto instr_len =
-      this->sleigh_ctx.oneInstruction(address, pcode_handler, instr_bytes);
+  auto instr_len = this->sleigh_ctx.oneInstruction(address, pcode_handler,
+                                                   setter, instr_bytes);
 
   if (!instr_len || instr_len > instr_bytes.size()) {
+
+    // A failed parse may be left behind in SLEIGH's disassembly cache.
+    sleigh_ctx_ready = false;
     return false;
   }
   // communicate the size back to the caller
   inst.bytes = instr_bytes.substr(0, *instr_len);
   assert(inst.bytes.size() == instr_len);
+  decoded_bytes[address] = inst.bytes;
+  inst.pcode = std::move(pcode);
 
-  InstructionFunctionSetter setter(inst);
-  this->sleigh_ctx.oneInstruction(address, setter, inst.bytes);
   LOG(INFO) << "Instr len:" << *instr_len;
   LOG(INFO) << "Addr: " << address;
   auto fallthrough = address + *instr_len;
@@ -465,6 +594,22 @@ void SingleInstructionSleighContext::resetContext() {
   this->restoreEngineFromStorage();
 }
 
+SingleInstructionSleighContext::ContextSnapshot
+SingleInstructionSleighContext::SnapshotContext(void) {
+  const auto words = this->ctx.getContext(this->GetAddressFromOffset(0));
+  return ContextSnapshot(words, words + this->ctx.getContextSize());
+}
+
+bool SingleInstructionSleighContext::ContextMatches(
+    const ContextSnapshot &snap) {
+  const auto num_words = static_cast<size_t>(this->ctx.getContextSize());
+  if (snap.size() != num_words) {
+    return false;
+  }
+  const auto words = this->ctx.getContext(this->GetAddressFromOffset(0));
+  return std::equal(snap.begin(), snap.end(), words);
+}
+
 std::optional<int32_t> SingleInstructionSleighContext::oneInstruction(
     uint64_t address, const std::function<int32_t(Address addr)> &decode_func,
     std::string_view instr_bytes) {
@@ -518,10 +663,34 @@ std::optional<int32_t> SingleInstructionSleighContext::oneInstruction(
       instr_bytes);
 }
 
+std::optional<int32_t> SingleInstructionSleighContext::oneInstruction(
+    uint64_t address, PcodeEmit &pcode_handler, AssemblyEmit &asm_handler,
+    std::string_view instr_bytes) {
+  return this->oneInstruction(
+      address,
+      [this, &pcode_handler, &asm_handler](Address addr) {
+        const auto instr_len = this->engine.oneInstruction(pcode_handler, addr);
+        this->engine.printAssembly(asm_handler, addr);
+        return instr_len;
+      },
+      instr_bytes);
+}
+
 
 OperandLifter::OpLifterPtr
 SleighArch::DefaultLifter(const remill::IntrinsicTable &intrinsics) const {
-  return std::make_unique<SleighLifter>(this, intrinsics);
+  if (&intrinsics == this->GetInstrinsicTable()) {
+    return this->SharedLifter();
+  }
+  return std::make_shared<SleighLifter>(this, intrinsics);
+}
+
+const InstructionLifter::LifterPtr &SleighArch::SharedLifter(void) const {
+  std::call_once(shared_lifter_once, [this] {
+    shared_lifter =
+        std::make_shared<SleighLifter>(this, *this->GetInstrinsicTable());
+  });
+  return shared_lifter;
 }
 
 }  // namespace remill::sleigh
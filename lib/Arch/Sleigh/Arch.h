@@ -19,6 +19,10 @@
 #include <remill/Arch/ArchBase.h>
 
 #include <sleigh/libsleigh.hh>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 // Unifies shared functionality between sleigh architectures
 
@@ -102,9 +106,48 @@ class IndirectBranch : public InstructionFlowResolver {
                           remill::Instruction &insn) override;
 };
 
+// The p-code ops of one decoded instruction. Varnodes refer to their address
+// space by index rather than by pointer, so that the buffer outlives the
+// engine that decoded it, and can be replayed into any engine initialized
+// from the same spec.
+class PcodeBuffer {
+ public:
+  // Append an op, as passed to `PcodeEmit::dump`.
+  void Record(OpCode op, const VarnodeData *outvar, const VarnodeData *vars,
+              int32_t isize);
+
+  // Pass each recorded op, in order, to `emitter`, with varnodes whose spaces
+  // belong to `engine`.
+  void Replay(::Sleigh &engine, uint64_t address, PcodeEmit &emitter) const;
+
+  // Returns `true` if the p-code has no conditional branches, and if only its
+  // last op, if any, transfers control elsewhere. Such p-code can be lifted
+  // without splitting the block that it is lifted into.
+  bool IsStraightLine(void) const;
+
+ private:
+  struct Varnode {
+    int32_t space_index;
+    uint32_t size;
+    uint64_t offset;
+  };
+
+  struct Op {
+    OpCode opcode;
+    uint32_t first_varnode;
+    uint16_t num_inputs;
+    bool has_output;
+  };
+
+  std::vector<Op> ops;
+
+  // Varnodes of all ops. Each op's output, if any, comes before its inputs.
+  std::vector<Varnode> varnodes;
+};
+
 class PcodeDecoder final : public PcodeEmit {
  public:
-  PcodeDecoder(::Sleigh &engine_, Instruction &inst_);
+  PcodeDecoder(::Sleigh &engine_, Instruction &inst_, PcodeBuffer &pcode_);
 
   void dump(const Address &, OpCode op, VarnodeData *outvar, VarnodeData *vars,
             int32_t isize) override;
@@ -129,6 +172,7 @@ class PcodeDecoder final : public PcodeEmit {
 
   Sleigh &engine;
   Instruction &inst;
+  PcodeBuffer &pcode;
 
   std::optional<InstructionFlowResolver::IFRPtr> current_resolver;
 };
@@ -150,6 +194,27 @@ class CustomLoadImage final : public LoadImage {
   uint64_t current_offset{0};
 };
 
+// The parsed `.sla` and `.pspec` documents of a SLEIGH architecture. Specs are
+// parsed once per process, and are then shared by every context built from
+// them. After construction the documents are only ever read.
+class SleighSpec {
+ public:
+  // Get the shared spec for `sla_name` and `pspec_name`, parsing it if this is
+  // the first request for this pair of files.
+  static std::shared_ptr<SleighSpec> Get(const std::string &sla_name,
+                                         const std::string &pspec_name);
+
+  SleighSpec(const std::string &sla_name, const std::string &pspec_name);
+
+  DocumentStorage &GetStorage(void);
+
+ private:
+  SleighSpec(const SleighSpec &) = delete;
+  SleighSpec &operator=(const SleighSpec &) = delete;
+
+  DocumentStorage storage;
+};
+
 class SleighArch;
 // Holds onto contextual sleigh information in order to provide an interface with which you can decode single instructions
 // Give me bytes and i give you pcode (maybe)
@@ -159,7 +224,7 @@ class SingleInstructionSleighContext {
   CustomLoadImage image;
   ContextInternal ctx;
   ::Sleigh engine;
-  DocumentStorage storage;
+  std::shared_ptr<SleighSpec> spec;
 
   std::optional<int32_t>
   oneInstruction(uint64_t address,
@@ -176,6 +241,21 @@ class SingleInstructionSleighContext {
   std::optional<int32_t> oneInstruction(uint64_t address, AssemblyEmit &emitter,
                                         std::string_view instr_bytes);
 
+  // Decode the instruction once, emitting both its p-code and its assembly.
+  // The assembly is printed from SLEIGH's cached parse of the instruction.
+  std::optional<int32_t> oneInstruction(uint64_t address,
+                                        PcodeEmit &pcode_emitter,
+                                        AssemblyEmit &asm_emitter,
+                                        std::string_view instr_bytes);
+
+  // The context register words that apply to every address.
+  using ContextSnapshot = std::vector<uintm>;
+
+  ContextSnapshot SnapshotContext(void);
+
+  // Returns `true` if the context registers still hold the values in `snap`.
+  bool ContextMatches(const ContextSnapshot &snap);
+
   ::Sleigh &GetEngine(void);
 
   ContextDatabase &GetContext(void);
@@ -219,7 +299,30 @@ class SleighArch : virtual public ArchBase {
   bool DecodeInstructionImpl(uint64_t address, std::string_view instr_bytes,
                              Instruction &inst);
 
+  // Get `sleigh_ctx` ready to decode `instr_bytes` at `address`. The engine
+  // and context database are kept across instructions, and are only reset
+  // when SLEIGH's disassembly cache, which is keyed on address alone, could
+  // hold a parse of different bytes, or when the context registers no longer
+  // match what `InitializeSleighContext` set up.
+  void PrepareSleighContext(uint64_t address, std::string_view instr_bytes);
+
+  // Returns the lifter shared by every instruction decoded by this arch. It is
+  // built once, for this arch's own intrinsic table.
+  const InstructionLifter::LifterPtr &SharedLifter(void) const;
+
+  mutable std::once_flag shared_lifter_once;
+  mutable InstructionLifter::LifterPtr shared_lifter;
+
   SingleInstructionSleighContext sleigh_ctx;
+
+  // Is `sleigh_ctx` initialized for this architecture?
+  bool sleigh_ctx_ready{false};
+
+  // Context register state right after `InitializeSleighContext`.
+  SingleInstructionSleighContext::ContextSnapshot context_snapshot;
+
+  // Bytes of the instructions decoded since `sleigh_ctx` was last reset.
+  std::unordered_map<uint64_t, std::string> decoded_bytes;
   std::string sla_name;
   std::string pspec_name;
 };
@@ -314,8 +314,10 @@ std::map<xed_iform_enum_t, xed_iform_enum_t> kUnlockedIform = {
     {XED_IFORM_XCHG_MEMb_GPR8, XED_IFORM_XCHG_MEMb_GPR8},
 };
 
-// Name of this instruction function.
-static std::string InstructionFunctionName(const xed_decoded_inst_t *xedd) {
+// Name of this instruction function. This is built in place in `name`, so that
+// decoding into a reused instruction doesn't allocate.
+static void InstructionFunctionName(const xed_decoded_inst_t *xedd,
+                                    std::string &name) {
 
   // If this instuction is marked as atomic via the `LOCK` prefix then we want
   // to remove it because we will already be surrounding the call to the
@@ -327,17 +329,15 @@ static std::string InstructionFunctionName(const xed_decoded_inst_t *xedd) {
     iform = kUnlockedIform[iform];
   }
 
-  std::stringstream ss;
-  std::string iform_name = xed_iform_enum_t2str(iform);
-  ss << iform_name;
+  name.assign(xed_iform_enum_t2str(iform));
 
   // Some instructions are "scalable", i.e. there are variants of the
   // instruction for each effective operand size. We represent these in
   // the semantics files with `_<size>`, so we need to look up the correct
   // selection.
   if (xed_decoded_inst_get_attribute(xedd, XED_ATTRIBUTE_SCALABLE)) {
-    ss << "_";
-    ss << xed_decoded_inst_get_operand_width(xedd);
+    name += '_';
+    name += std::to_string(xed_decoded_inst_get_operand_width(xedd));
   }
 
   // Suffix the ISEL function name with the segment or control register names,
@@ -346,11 +346,10 @@ static std::string InstructionFunctionName(const xed_decoded_inst_t *xedd) {
   if (XED_IFORM_MOV_SEG_MEMw == iform || XED_IFORM_MOV_SEG_GPR16 == iform ||
       XED_IFORM_MOV_CR_CR_GPR32 == iform ||
       XED_IFORM_MOV_CR_CR_GPR64 == iform) {
-    ss << "_";
-    ss << xed_reg_enum_t2str(xed_decoded_inst_get_reg(xedd, XED_OPERAND_REG0));
+    name += '_';
+    name +=
+        xed_reg_enum_t2str(xed_decoded_inst_get_reg(xedd, XED_OPERAND_REG0));
   }
-
-  return ss.str();
 }
 
 // Decode an instruction into the XED instuction format.
@@ -1109,7 +1108,7 @@ bool X86Arch::ArchDecodeInstruction(uint64_t address,
     FillFusedCallPopRegOperands(inst, address_size, is_fused_call_pop, len);
 
   } else {
-    inst.function = InstructionFunctionName(xedd);
+    InstructionFunctionName(xedd, inst.function);
     for (auto i = 0U; i < num_operands; ++i) {
       auto xedo = xed_inst_operand(xedi, i);
       if (XED_OPVIS_SUPPRESSED != xed_operand_operand_visibility(xedo)) {
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <remill/BC/ImageTraceManager.h>
+
+#include <glog/logging.h>
+#include <llvm/BinaryFormat/ELF.h>
+#include <llvm/BinaryFormat/Magic.h>
+#include <llvm/Object/ELF.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace remill {
+namespace {
+
+// Add the `PT_LOAD` segments of the ELF file in `data` to `add_segment`.
+template <typename ELFT, typename AddSegment>
+bool ForEachLoadSegment(std::string_view data, const std::string &path,
+                        AddSegment add_segment) {
+  auto elf = llvm::object::ELFFile<ELFT>::create(
+      llvm::StringRef(data.data(), data.size()));
+  if (!elf) {
+    LOG(ERROR) << "Could not parse ELF file " << path << ": "
+               << llvm::toString(elf.takeError());
+    return false;
+  }
+
+  auto phdrs = elf->program_headers();
+  if (!phdrs) {
+    LOG(ERROR) << "Could not read program headers of ELF file " << path << ": "
+               << llvm::toString(phdrs.takeError());
+    return false;
+  }
+
+  for (const auto &phdr : *phdrs) {
+    if (phdr.p_type != llvm::ELF::PT_LOAD || !phdr.p_filesz) {
+      continue;
+    }
+
+    const uint64_t offset = phdr.p_offset;
+    const uint64_t size = phdr.p_filesz;
+    if (offset > data.size() || size > (data.size() - offset)) {
+      LOG(ERROR) << "Segment at " << std::hex << phdr.p_vaddr << std::dec
+                 << " extends past the end of ELF file " << path;
+      return false;
+    }
+
+    if (!add_segment(data.substr(offset, size), phdr.p_vaddr,
+                     0 != (phdr.p_flags & llvm::ELF::PF_X))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace
+
+ImageTraceManager::~ImageTraceManager(void) {}
+
+ImageTraceManager::ImageTraceManager(void) {}
+
+// Memory-map the file at `path`.
+const llvm::MemoryBuffer *ImageTraceManager::MapFile(const std::string &path) {
+  auto maybe_buffer = llvm::MemoryBuffer::getFile(
+      path, false /* IsText */, false /* RequiresNullTerminator */);
+  if (!maybe_buffer) {
+    LOG(ERROR) << "Could not open " << path << ": "
+               << maybe_buffer.getError().message();
+    return nullptr;
+  }
+  return buffers.emplace_back(std::move(*maybe_buffer)).get();
+}
+
+// Add `data` to the segment table, keeping it sorted.
+bool ImageTraceManager::AddSegment(std::string_view data, uint64_t addr,
+                                   bool is_executable) {
+  if (data.empty()) {
+    return true;
+  }
+
+  if ((addr + (data.size() - 1u)) < addr) {
+    LOG(ERROR) << "Segment at " << std::hex << addr << std::dec
+               << " wraps around the address space";
+    return false;
+  }
+
+  auto it = std::upper_bound(
+      segments.begin(), segments.end(), addr,
+      [](uint64_t a, const Segment &seg) { return a < seg.addr; });
+
+  // Check for overlap with the segments before and after this one.
+  if (it != segments.begin()) {
+    const auto &prev = *std::prev(it);
+    if ((addr - prev.addr) < prev.data.size()) {
+      LOG(ERROR) << "Segment at " << std::hex << addr
+                 << " overlaps segment at " << prev.addr << std::dec;
+      return false;
+    }
+  }
+  if (it != segments.end() && (it->addr - addr) < data.size()) {
+    LOG(ERROR) << "Segment at " << std::hex << addr << " overlaps segment at "
+               << it->addr << std::dec;
+    return false;
+  }
+
+  segments.insert(it, Segment{addr, data, is_executable});
+  return true;
+}
+
+bool ImageTraceManager::AddFileSegment(const std::string &path, uint64_t addr,
+                                       uint64_t offset, uint64_t size,
+                                       bool is_executable) {
+  auto buffer = MapFile(path);
+  if (!buffer) {
+    return false;
+  }
+
+  std::string_view data(buffer->getBufferStart(), buffer->getBufferSize());
+  if (offset > data.size()) {
+    LOG(ERROR) << "Offset " << std::hex << offset << std::dec
+               << " is past the end of " << path;
+    buffers.pop_back();
+    return false;
+  }
+
+  data = data.substr(offset);
+  if (size) {
+    if (size > data.size()) {
+      LOG(ERROR) << "Segment of size " << std::hex << size << " at offset "
+                 << offset << std::dec << " extends past the end of " << path;
+      buffers.pop_back();
+      return false;
+    }
+    data = data.substr(0, size);
+  }
+
+  if (!AddSegment(data, addr, is_executable)) {
+    buffers.pop_back();
+    return false;
+  }
+  return true;
+}
+
+bool ImageTraceManager::AddMemorySegment(std::string_view data, uint64_t addr,
+                                         bool is_executable) {
+  auto &buffer = buffers.emplace_back(llvm::MemoryBuffer::getMemBufferCopy(
+      llvm::StringRef(data.data(), data.size())));
+  if (!AddSegment(
+          std::string_view(buffer->getBufferStart(), buffer->getBufferSize()),
+          addr, is_executable)) {
+    buffers.pop_back();
+    return false;
+  }
+  return true;
+}
+
+bool ImageTraceManager::AddELFSegments(const std::string &path) {
+  auto buffer = MapFile(path);
+  if (!buffer) {
+    return false;
+  }
+
+  std::string_view data(buffer->getBufferStart(), buffer->getBufferSize());
+  if (data.size() <= llvm::ELF::EI_DATA ||
+      data.substr(0, 4) != std::string_view(llvm::ELF::ElfMagic, 4)) {
+    LOG(ERROR) << path << " is not an ELF file";
+    buffers.pop_back();
+    return false;
+  }
+
+  // Restored if any of the segments can't be added, so that either all or
+  // none of them are.
+  auto old_segments = segments;
+  auto add_segment = [this](std::string_view seg_data, uint64_t addr,
+                            bool is_executable) {
+    return AddSegment(seg_data, addr, is_executable);
+  };
+
+  auto ok = false;
+  const auto is_64 = data[llvm::ELF::EI_CLASS] == llvm::ELF::ELFCLASS64;
+  const auto is_le = data[llvm::ELF::EI_DATA] == llvm::ELF::ELFDATA2LSB;
+  if (is_64 && is_le) {
+    ok = ForEachLoadSegment<llvm::object::ELF64LE>(data, path, add_segment);
+  } else if (is_64) {
+    ok = ForEachLoadSegment<llvm::object::ELF64BE>(data, path, add_segment);
+  } else if (is_le) {
+    ok = ForEachLoadSegment<llvm::object::ELF32LE>(data, path, add_segment);
+  } else {
+    ok = ForEachLoadSegment<llvm::object::ELF32BE>(data, path, add_segment);
+  }
+
+  if (!ok) {
+    segments = std::move(old_segments);
+    buffers.pop_back();
+  }
+  return ok;
+}
+
+// Returns `true` if the file at `path` looks like an ELF file.
+bool ImageTraceManager::IsELFFile(const std::string &path) {
+  llvm::file_magic magic;
+  if (llvm::identify_magic(path, magic)) {
+    return false;
+  }
+  switch (magic) {
+    case llvm::file_magic::elf:
+    case llvm::file_magic::elf_relocatable:
+    case llvm::file_magic::elf_executable:
+    case llvm::file_magic::elf_shared_object:
+    case llvm::file_magic::elf_core: return true;
+    default: return false;
+  }
+}
+
+// Find the segment containing `addr`, or `nullptr`.
+const ImageTraceManager::Segment *
+ImageTraceManager::FindSegment(uint64_t addr) const {
+  auto it = std::upper_bound(
+      segments.begin(), segments.end(), addr,
+      [](uint64_t a, const Segment &seg) { return a < seg.addr; });
+  if (it == segments.begin()) {
+    return nullptr;
+  }
+  const auto &seg = *std::prev(it);
+  if ((addr - seg.addr) < seg.data.size()) {
+    return &seg;
+  }
+  return nullptr;
+}
+
+void ImageTraceManager::SetLiftedTraceDefinition(uint64_t addr,
+                                                 llvm::Function *lifted_func) {
+  traces[addr] = lifted_func;
+}
+
+llvm::Function *ImageTraceManager::GetLiftedTraceDeclaration(uint64_t addr) {
+  auto trace_it = traces.find(addr);
+  if (trace_it != traces.end()) {
+    return trace_it->second;
+  } else {
+    return nullptr;
+  }
+}
+
+llvm::Function *ImageTraceManager::GetLiftedTraceDefinition(uint64_t addr) {
+  return GetLiftedTraceDeclaration(addr);
+}
+
+bool ImageTraceManager::TryReadExecutableByte(uint64_t addr, uint8_t *byte) {
+  auto seg = FindSegment(addr);
+  if (!seg || !seg->is_executable) {
+    return false;
+  }
+  *byte = static_cast<uint8_t>(seg->data[addr - seg->addr]);
+  return true;
+}
+
+std::string_view ImageTraceManager::TryReadExecutableBytes(uint64_t addr,
+                                                           size_t max_size) {
+  auto seg = FindSegment(addr);
+  if (!seg || !seg->is_executable) {
+    return {};
+  }
+  return seg->data.substr(addr - seg->addr, max_size);
+}
+
+}  // namespace remill
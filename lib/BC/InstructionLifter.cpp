@@ -17,31 +17,6 @@
 #include "InstructionLifter.h"
 
 namespace remill {
-namespace {
-
-// Try to find the function that implements this semantics.
-llvm::Function *GetInstructionFunction(llvm::Module *module,
-                                       std::string_view function) {
-  std::stringstream ss;
-  ss << "ISEL_" << function;
-  auto isel_name = ss.str();
-
-  auto isel = FindGlobaVariable(module, isel_name);
-  if (!isel) {
-    return nullptr;  // Falls back on `UNIMPLEMENTED_INSTRUCTION`.
-  }
-
-  if (!isel->isConstant() || !isel->hasInitializer()) {
-    LOG(FATAL) << "Expected a `constexpr` variable as the function pointer for "
-               << "instruction semantic function " << function << ": "
-               << LLVMThingToString(isel);
-  }
-
-  auto sem = isel->getInitializer()->stripPointerCasts();
-  return llvm::dyn_cast_or_null<llvm::Function>(sem);
-}
-
-}  // namespace
 
 InstructionLifter::Impl::Impl(const Arch *arch_,
                               const IntrinsicTable *intrinsics_)
@@ -54,10 +29,10 @@ InstructionLifter::Impl::Impl(const Arch *arch_,
                                           remill::kMemoryPointerArgNum)
                           ->getType()),
       module(intrinsics->async_hyper_call->getParent()),
-      invalid_instruction(
-          GetInstructionFunction(module, kInvalidInstructionISelName)),
-      unsupported_instruction(
-          GetInstructionFunction(module, kUnsupportedInstructionISelName)) {
+      invalid_instruction(intrinsics->ISelFunction(
+          intrinsics->ISelIdForName(kInvalidInstructionISelName))),
+      unsupported_instruction(intrinsics->ISelFunction(
+          intrinsics->ISelIdForName(kUnsupportedInstructionISelName))) {
 
   CHECK(invalid_instruction != nullptr)
       << kInvalidInstructionISelName << " doesn't exist";
@@ -82,6 +57,21 @@ LiftStatus InstructionLifter::LiftIntoBlock(Instruction &inst,
                        is_delayed);
 }
 
+LiftStatus InstructionLifter::LiftIntoBlockDirectly(Instruction &inst,
+                                                    llvm::BasicBlock *block,
+                                                    llvm::Value *state_ptr,
+                                                    bool is_delayed) {
+  return LiftIntoBlock(inst, block, state_ptr, is_delayed);
+}
+
+LiftStatus InstructionLifter::LiftIntoBlockDirectly(Instruction &inst,
+                                                    llvm::BasicBlock *block,
+                                                    bool is_delayed) {
+  return LiftIntoBlockDirectly(
+      inst, block, NthArgument(block->getParent(), kStatePointerArgNum),
+      is_delayed);
+}
+
 // Lift a single instruction into a basic block.
 LiftStatus InstructionLifter::LiftIntoBlock(Instruction &arch_inst,
                                             llvm::BasicBlock *block,
@@ -93,7 +83,7 @@ LiftStatus InstructionLifter::LiftIntoBlock(Instruction &arch_inst,
   auto status = kLiftedInstruction;
 
   // Cache invalidation.
-  if (func != impl->last_func) {
+  if (func != static_cast<llvm::Value *>(impl->last_func)) {
     impl->reg_ptr_cache.clear();
     impl->last_func = func;
 
@@ -102,7 +92,16 @@ LiftStatus InstructionLifter::LiftIntoBlock(Instruction &arch_inst,
   }
 
   if (arch_inst.IsValid()) {
-    isel_func = GetInstructionFunction(module, arch_inst.function);
+
+    // The decoder usually resolved the semantics already. Unsupported
+    // instructions are looked up again, in case their semantics were added to
+    // the module since.
+    if (arch_inst.isel_table != impl->intrinsics ||
+        arch_inst.isel_id == IntrinsicTable::kInvalidISelId) {
+      arch_inst.isel_id = impl->intrinsics->ISelIdForName(arch_inst.function);
+      arch_inst.isel_table = impl->intrinsics;
+    }
+    isel_func = impl->intrinsics->ISelFunction(arch_inst.isel_id);
   } else {
     isel_func = impl->invalid_instruction;
     arch_inst.operands.clear();
@@ -233,7 +232,7 @@ InstructionLifter::LoadRegAddress(llvm::BasicBlock *block,
   const auto module = func->getParent();
 
   // Invalidate the cache.
-  if (func != impl->last_func) {
+  if (func != static_cast<llvm::Value *>(impl->last_func)) {
     impl->reg_ptr_cache.clear();
     impl->last_func = func;
 
@@ -28,6 +28,7 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Operator.h>
 #include <llvm/IR/Type.h>
+#include <llvm/IR/ValueHandle.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils/Cloning.h>
@@ -74,8 +75,9 @@ class InstructionLifter::Impl {
       reg_ptr_cache;
 
   // The function into which we're lifting. If This gets out of date, we
-  // clear out `reg_ptr_cache`.
-  llvm::Function *last_func{nullptr};
+  // clear out `reg_ptr_cache`. This is a value handle so that a new function
+  // allocated where a deleted `last_func` used to be is not mistaken for it.
+  llvm::WeakVH last_func;
 
   llvm::Module *const module;
   llvm::Function *const invalid_instruction;
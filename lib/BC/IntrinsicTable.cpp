@@ -20,8 +20,12 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/ValueHandle.h>
 
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "remill/BC/Util.h"
@@ -69,6 +73,119 @@ static llvm::Function *SetMemoryReadNone(llvm::Function *func) {
 
 }  // namespace
 
+struct IntrinsicTable::ISelTable {
+  explicit ISelTable(llvm::Module *module_);
+
+  // Look up the ISEL variable `ISEL_<name>` that was added to `module` after
+  // this table was built, and give it an id.
+  ISelId LateISelIdForName(std::string_view name) const;
+
+  // Returns the ISEL variable with the id `id`, which was returned by
+  // `LateISelIdForName`.
+  llvm::Value *LateISel(ISelId id) const;
+
+  llvm::Module *const module;
+
+  // Maps ISEL names, without the `ISEL_` prefix, to indexes into `vars`.
+  llvm::StringMap<ISelId> ids;
+
+  // Weak handles, so that an ISEL variable that is later deleted from the
+  // module resolves to no semantics, rather than to a dangling pointer.
+  std::vector<llvm::WeakVH> vars;
+
+  // Like `ids` and `vars`, but for the ISEL variables added to `module` after
+  // this table was built. Their ids follow those of `vars`.
+  mutable std::mutex late_lock;
+  mutable llvm::StringMap<ISelId> late_ids;
+  mutable std::vector<llvm::WeakVH> late_vars;
+};
+
+IntrinsicTable::ISelTable::ISelTable(llvm::Module *module_) : module(module_) {
+  ForEachISel(module, [this](llvm::GlobalVariable *var, llvm::Function *) {
+    auto name = var->getName();
+    if (name.consume_front("ISEL_")) {
+      const auto id = static_cast<ISelId>(vars.size());
+      if (ids.try_emplace(name, id).second) {
+        vars.push_back(var);
+      }
+    }
+  });
+}
+
+IntrinsicTable::ISelId
+IntrinsicTable::ISelTable::LateISelIdForName(std::string_view name) const {
+  auto var = FindGlobaVariable(module, "ISEL_" + std::string(name));
+  if (!var) {
+    return kInvalidISelId;
+  }
+
+  std::lock_guard<std::mutex> locker(late_lock);
+  auto [it, added] = late_ids.try_emplace(
+      llvm::StringRef(name.data(), name.size()),
+      static_cast<ISelId>(vars.size() + late_vars.size()));
+  if (added) {
+    late_vars.push_back(var);
+  }
+  return it->second;
+}
+
+llvm::Value *IntrinsicTable::ISelTable::LateISel(ISelId id) const {
+  std::lock_guard<std::mutex> locker(late_lock);
+  const auto index = id - vars.size();
+  if (index >= late_vars.size()) {
+    return nullptr;
+  }
+  return late_vars[index];
+}
+
+IntrinsicTable::ISelId
+IntrinsicTable::ISelIdForName(std::string_view name) const {
+  auto it = isels->ids.find(llvm::StringRef(name.data(), name.size()));
+  if (it == isels->ids.end()) {
+    return isels->LateISelIdForName(name);
+  }
+  return it->second;
+}
+
+llvm::Function *IntrinsicTable::ISelFunction(ISelId id) const {
+  llvm::Value *isel_val = nullptr;
+  if (id < isels->vars.size()) {
+    isel_val = isels->vars[id];
+  } else if (id != kInvalidISelId) {
+    isel_val = isels->LateISel(id);
+  }
+
+  // A `nullptr` falls back on `UNIMPLEMENTED_INSTRUCTION`.
+  auto isel = llvm::cast_or_null<llvm::GlobalVariable>(isel_val);
+  if (!isel) {
+    return nullptr;
+  }
+
+  if (!isel->isConstant() || !isel->hasInitializer()) {
+    LOG(FATAL) << "Expected a `constexpr` variable as the function pointer for "
+               << "instruction semantic function " << isel->getName().str()
+               << ": " << LLVMThingToString(isel);
+  }
+
+  auto sem = llvm::dyn_cast_or_null<llvm::Function>(
+      isel->getInitializer()->stripPointerCasts());
+
+  // Read in the body of `sem` if the semantics were loaded lazily.
+  if (sem && !MaterializeSemantics(sem)) {
+    LOG(FATAL) << "Unable to read in instruction semantic function "
+               << sem->getName().str() << " of " << isel->getName().str();
+  }
+
+  // E.g. `DeclareUnmaterializedFunctions` already ran on a lazily loaded
+  // module. Calling `sem` would leave the lifted code undefined.
+  if (sem && sem->isDeclaration()) {
+    LOG(FATAL) << "Instruction semantic function " << sem->getName().str()
+               << " of " << isel->getName().str() << " has no body";
+  }
+
+  return sem;
+}
+
 IntrinsicTable::IntrinsicTable(llvm::Module *module)
     : error(FindIntrinsic(module, "__remill_error")),
 
@@ -153,7 +270,8 @@ IntrinsicTable::IntrinsicTable(llvm::Module *module)
       pc_type(llvm::dyn_cast<llvm::IntegerType>(
           lifted_function_type->getParamType(kPCArgNum))),
       mem_ptr_type(llvm::dyn_cast<llvm::PointerType>(
-          lifted_function_type->getParamType(kMemoryPointerArgNum))) {
+          lifted_function_type->getParamType(kMemoryPointerArgNum))),
+      isels(std::make_shared<ISelTable>(module)) {
 
 
   // Make sure to set the correct attributes on this to make sure that
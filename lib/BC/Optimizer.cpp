@@ -17,105 +17,719 @@
 #include "remill/BC/Optimizer.h"
 
 #include <glog/logging.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/InlineCost.h>
 #include <llvm/Analysis/TargetLibraryInfo.h>
-#include <llvm/IR/Constants.h>
-#include <llvm/IR/DataLayout.h>
-#include <llvm/IR/DebugInfo.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/LegacyPassManager.h>
-#include <llvm/IR/MDBuilder.h>
-#include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
-#include <llvm/IR/Type.h>
-#include <llvm/Transforms/IPO.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Utils/Cloning.h>
-#include <llvm/Transforms/Utils/Local.h>
-#include <llvm/Transforms/Utils/ValueMapper.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/ValueHandle.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/AlwaysInliner.h>
+#include <llvm/Transforms/IPO/Inliner.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/ADCE.h>
+#include <llvm/Transforms/Scalar/DeadStoreElimination.h>
+#include <llvm/Transforms/Scalar/EarlyCSE.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Scalar/SROA.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+#include <llvm/Transforms/Vectorize/LoopVectorize.h>
+#include <llvm/Transforms/Vectorize/SLPVectorizer.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include "remill/Arch/Arch.h"
+#include "remill/BC/ABI.h"
 #include "remill/BC/Util.h"
 
 namespace remill {
+namespace {
+
+// Inlining threshold used when inlining semantics into lifted code.
+static constexpr int kInlineThreshold = 250;
+
+static constexpr llvm::StringLiteral kReadMemoryPrefix("__remill_read_memory_");
+static constexpr llvm::StringLiteral kWriteMemoryPrefix(
+    "__remill_write_memory_");
+
+// Returns `val` as a call to a function whose name begins with `prefix`, or
+// `nullptr`.
+static llvm::CallInst *CallToIntrinsic(llvm::Value *val,
+                                       llvm::StringRef prefix) {
+  auto call = llvm::dyn_cast<llvm::CallInst>(val);
+  if (!call) {
+    return nullptr;
+  }
+  auto callee = call->getCalledFunction();
+  if (!callee || !callee->getName().startswith(prefix)) {
+    return nullptr;
+  }
+  return call;
+}
+
+// Returns `true` if `read` reads back the value written by `write`, i.e. it
+// reads from the memory pointer produced by `write`, at the same address, and
+// with the same size and type.
+static bool ReadsBackWrite(llvm::CallInst *read, llvm::CallInst *write) {
+  auto read_name = read->getCalledFunction()->getName();
+  auto write_name = write->getCalledFunction()->getName();
+  return read->arg_size() == 2u && read->getArgOperand(0) == write &&
+         read->getArgOperand(1) == write->getArgOperand(1) &&
+         read->getType() == write->getArgOperand(2)->getType() &&
+         read_name.drop_front(kReadMemoryPrefix.size()) ==
+             write_name.drop_front(kWriteMemoryPrefix.size());
+}
+
+// A range of `State` bytes that is accessed by loads and stores of one type.
+struct StateSlot {
+  int64_t offset;
+  uint64_t size;
+  llvm::Type *type;
+  llvm::Align align;
+  std::vector<llvm::Instruction *> accesses;
+  bool has_store{false};
+  bool is_promotable{true};
+
+  // Pointer to the slot within `State`, and the local caching its value.
+  llvm::Value *addr{nullptr};
+  llvm::AllocaInst *local{nullptr};
+};
+
+// Finds the `State` slots accessed by a lifted function, and the calls that
+// can observe `State`.
+class StateAccessCollector {
+ public:
+  explicit StateAccessCollector(const llvm::DataLayout &dl_) : dl(dl_) {}
+
+  // Returns `false` if `state` escapes in a way that we can't reason about,
+  // e.g. by being stored to memory, or through a non-constant offset.
+  bool Collect(llvm::Argument *state);
+
+  std::vector<StateSlot> slots;
+  std::vector<llvm::CallInst *> observers;
+
+  // Instructions computing pointers into `State`, in def-before-use order.
+  std::vector<llvm::Instruction *> derived_ptrs;
+
+ private:
+  void AddAccess(llvm::Instruction *inst, llvm::Type *type, int64_t offset,
+                 llvm::Align align, bool is_simple, bool is_store);
+
+  // Mark slots that overlap other slots as not promotable.
+  void FindOverlaps(void);
+
+  const llvm::DataLayout &dl;
+  std::map<std::pair<int64_t, llvm::Type *>, size_t> slot_index;
+  llvm::SmallPtrSet<llvm::CallInst *, 16> seen_observers;
+};
+
+void StateAccessCollector::AddAccess(llvm::Instruction *inst,
+                                     llvm::Type *type, int64_t offset,
+                                     llvm::Align align, bool is_simple,
+                                     bool is_store) {
+  auto [it, added] = slot_index.emplace(std::make_pair(offset, type),
+                                        slots.size());
+  if (added) {
+    auto size = dl.getTypeStoreSize(type);
+    auto &slot = slots.emplace_back();
+    slot.offset = offset;
+    slot.size = size.getKnownMinSize();
+    slot.type = type;
+    slot.align = align;
+    slot.is_promotable = !size.isScalable() && 0 <= offset &&
+                         type->isSingleValueType();
+  }
+
+  auto &slot = slots[it->second];
+  slot.accesses.push_back(inst);
+  slot.align = std::min(slot.align, align);
+  slot.has_store = slot.has_store || is_store;
+  slot.is_promotable = slot.is_promotable && is_simple;
+}
+
+bool StateAccessCollector::Collect(llvm::Argument *state) {
+  std::vector<std::pair<llvm::Value *, int64_t>> work_list;
+  work_list.emplace_back(state, 0);
+
+  while (!work_list.empty()) {
+    auto [ptr, offset] = work_list.back();
+    work_list.pop_back();
+
+    for (auto &use : ptr->uses()) {
+      auto user = use.getUser();
+      if (auto gep = llvm::dyn_cast<llvm::GetElementPtrInst>(user)) {
+        llvm::APInt gep_offset(
+            dl.getIndexSizeInBits(gep->getPointerAddressSpace()), 0);
+        if (gep->getPointerOperand() != ptr ||
+            !gep->accumulateConstantOffset(dl, gep_offset)) {
+          return false;
+        }
+        derived_ptrs.push_back(gep);
+        work_list.emplace_back(gep, offset + gep_offset.getSExtValue());
+
+      } else if (auto cast = llvm::dyn_cast<llvm::BitCastInst>(user)) {
+        derived_ptrs.push_back(cast);
+        work_list.emplace_back(cast, offset);
+
+      } else if (auto load = llvm::dyn_cast<llvm::LoadInst>(user)) {
+        AddAccess(load, load->getType(), offset, load->getAlign(),
+                  load->isSimple(), false);
+
+      } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+        if (store->getValueOperand() == ptr) {
+          return false;  // Stores a pointer into `State`.
+        }
+        AddAccess(store, store->getValueOperand()->getType(), offset,
+                  store->getAlign(), store->isSimple(), true);
+
+      } else if (auto call = llvm::dyn_cast<llvm::CallInst>(user)) {
+        if (!call->isArgOperand(&use)) {
+          return false;
+        }
+        if (seen_observers.insert(call).second) {
+          observers.push_back(call);
+        }
+
+      } else {
+        return false;
+      }
+    }
+  }
+
+  FindOverlaps();
+  return true;
+}
+
+void StateAccessCollector::FindOverlaps(void) {
+  std::vector<StateSlot *> sorted;
+  for (auto &slot : slots) {
+    sorted.push_back(&slot);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const StateSlot *a, const StateSlot *b) {
+              return a->offset < b->offset;
+            });
+
+  for (auto i = 0u; i < sorted.size(); ++i) {
+    const auto end = sorted[i]->offset + static_cast<int64_t>(sorted[i]->size);
+    for (auto j = i + 1u; j < sorted.size() && sorted[j]->offset < end; ++j) {
+      sorted[i]->is_promotable = false;
+      sorted[j]->is_promotable = false;
+    }
+  }
+}
+
+// Returns `true` if `call` must be followed by a `ret`.
+static bool IsMustTailCall(llvm::Instruction *inst) {
+  auto call = llvm::dyn_cast_or_null<llvm::CallInst>(inst);
+  return call && call->isMustTailCall();
+}
+
+}  // namespace
+
+llvm::PreservedAnalyses
+MemoryIntrinsicDSEPass::run(llvm::Function &func,
+                            llvm::FunctionAnalysisManager &) {
+  std::vector<llvm::CallInst *> writes;
+  for (auto &inst : llvm::instructions(func)) {
+    if (auto write = CallToIntrinsic(&inst, kWriteMemoryPrefix);
+        write && write->arg_size() == 3u &&
+        write->getType() == write->getArgOperand(0)->getType()) {
+      writes.push_back(write);
+    }
+  }
+
+  llvm::SmallPtrSet<llvm::Instruction *, 16> dead;
+  std::vector<llvm::CallInst *> reads;
+  for (auto write : writes) {
+    if (dead.count(write)) {
+      continue;
+    }
+
+    // Forward the written value to reads of it.
+    reads.clear();
+    for (auto user : write->users()) {
+      if (auto read = CallToIntrinsic(user, kReadMemoryPrefix);
+          read && ReadsBackWrite(read, write)) {
+        reads.push_back(read);
+      }
+    }
+    for (auto read : reads) {
+      read->replaceAllUsesWith(write->getArgOperand(2));
+      dead.insert(read);
+    }
+
+    // Remove a prior write to the same address that nothing else observes.
+    auto prev = llvm::dyn_cast<llvm::CallInst>(write->getArgOperand(0));
+    if (prev && prev->hasOneUse() && !dead.count(prev) &&
+        prev->getCalledOperand() == write->getCalledOperand() &&
+        prev->getArgOperand(1) == write->getArgOperand(1)) {
+      write->setArgOperand(0, prev->getArgOperand(0));
+      dead.insert(prev);
+    }
+  }
+
+  if (dead.empty()) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  for (auto inst : dead) {
+    inst->eraseFromParent();
+  }
+
+  llvm::PreservedAnalyses pa;
+  pa.preserveSet<llvm::CFGAnalyses>();
+  return pa;
+}
+
+llvm::PreservedAnalyses
+StatePromotionPass::run(llvm::Function &func,
+                        llvm::FunctionAnalysisManager &fam) {
+  if (func.isDeclaration() || func.arg_size() != kNumBlockArgs) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  auto state = NthArgument(&func, kStatePointerArgNum);
+  auto state_type = llvm::dyn_cast<llvm::PointerType>(state->getType());
+  const auto &dl = func.getParent()->getDataLayout();
+  if (!state_type ||
+      state_type->getAddressSpace() != dl.getAllocaAddrSpace()) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  StateAccessCollector collector(dl);
+  if (!collector.Collect(state)) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  std::vector<StateSlot *> slots;
+  for (auto &slot : collector.slots) {
+    if (slot.is_promotable) {
+      slots.push_back(&slot);
+    }
+  }
+  if (slots.empty()) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  // Cache each slot in a local, loaded from `State` on entry.
+  auto &context = func.getContext();
+  auto &entry = func.getEntryBlock();
+  auto i8_type = llvm::Type::getInt8Ty(context);
+  llvm::IRBuilder<> ir(&entry, entry.getFirstInsertionPt());
+  auto state_bytes = ir.CreateBitCast(
+      state, i8_type->getPointerTo(state_type->getAddressSpace()));
+  std::vector<llvm::AllocaInst *> locals;
+  for (auto slot : slots) {
+    slot->local = ir.CreateAlloca(slot->type);
+    locals.push_back(slot->local);
+  }
+  for (auto slot : slots) {
+    slot->addr = ir.CreateBitCast(
+        ir.CreateConstInBoundsGEP1_64(i8_type, state_bytes,
+                                      static_cast<uint64_t>(slot->offset)),
+        slot->type->getPointerTo(state_type->getAddressSpace()));
+    ir.CreateAlignedStore(
+        ir.CreateAlignedLoad(slot->type, slot->addr, slot->align),
+        slot->local, slot->local->getAlign());
+  }
+
+  // Redirect the accesses to the locals.
+  for (auto slot : slots) {
+    for (auto inst : slot->accesses) {
+      if (auto load = llvm::dyn_cast<llvm::LoadInst>(inst)) {
+        load->setOperand(llvm::LoadInst::getPointerOperandIndex(), slot->local);
+        load->setAlignment(slot->local->getAlign());
+      } else {
+        auto store = llvm::cast<llvm::StoreInst>(inst);
+        store->setOperand(llvm::StoreInst::getPointerOperandIndex(),
+                          slot->local);
+        store->setAlignment(slot->local->getAlign());
+      }
+    }
+  }
+
+  // Write the modified slots back to `State` before anything that can observe
+  // `State`, and re-read all slots afterwards.
+  auto spill = [&](llvm::Instruction *before) {
+    ir.SetInsertPoint(before);
+    for (auto slot : slots) {
+      if (slot->has_store) {
+        ir.CreateAlignedStore(
+            ir.CreateAlignedLoad(slot->type, slot->local,
+                                 slot->local->getAlign()),
+            slot->addr, slot->align);
+      }
+    }
+  };
+
+  for (auto call : collector.observers) {
+    spill(call);
+    if (!call->isMustTailCall()) {
+      ir.SetInsertPoint(call->getNextNode());
+      for (auto slot : slots) {
+        ir.CreateAlignedStore(
+            ir.CreateAlignedLoad(slot->type, slot->addr, slot->align),
+            slot->local, slot->local->getAlign());
+      }
+    }
+  }
+
+  // Nothing may come between a `musttail` call and its `ret`, so write back
+  // before the call instead, unless it observes `State` and was handled above.
+  for (auto &block : func) {
+    auto ret = llvm::dyn_cast<llvm::ReturnInst>(block.getTerminator());
+    if (!ret) {
+      continue;
+    }
+    auto prev = ret->getPrevNode();
+    if (!IsMustTailCall(prev)) {
+      spill(ret);
+    } else if (!llvm::is_contained(collector.observers, prev)) {
+      spill(prev);
+    }
+  }
+
+  for (auto it = collector.derived_ptrs.rbegin();
+       it != collector.derived_ptrs.rend(); ++it) {
+    if ((*it)->use_empty()) {
+      (*it)->eraseFromParent();
+    }
+  }
+
+  auto &dt = fam.getResult<llvm::DominatorTreeAnalysis>(func);
+  llvm::PromoteMemToReg(locals, dt);
+
+  llvm::PreservedAnalyses pa;
+  pa.preserveSet<llvm::CFGAnalyses>();
+  return pa;
+}
+
+namespace {
+
+// Pass builder and analysis managers. Setting these up registers a large
+// number of analyses, so they are kept per-thread and reused by successive
+// calls, with their cached results cleared after each use.
+class PassManagers {
+ public:
+  static PassManagers &Get(const llvm::Triple &triple) {
+    thread_local std::unique_ptr<PassManagers> managers;
+    if (!managers || managers->triple != triple) {
+      managers.reset(new PassManagers(triple));
+    }
+    return *managers;
+  }
+
+  // Forget all cached analysis results.
+  void Clear(void) {
+    lam.clear();
+    fam.clear();
+    cgam.clear();
+    mam.clear();
+  }
+
+  const llvm::Triple triple;
+  llvm::TargetLibraryInfoImpl tlii;
+  llvm::PassBuilder pb;
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+ private:
+  explicit PassManagers(const llvm::Triple &triple_)
+      : triple(triple_),
+        tlii(triple_) {
+    tlii.disableAllFunctions();  // `-fno-builtin`.
+
+    // Must be registered before the default analyses.
+    fam.registerPass([this] { return llvm::TargetLibraryAnalysis(tlii); });
+
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+  }
+};
+
+// Build the pipeline that is run over each lifted function once semantics
+// have been inlined into it.
+static llvm::FunctionPassManager
+BuildFunctionPipeline(llvm::PassBuilder &pb, OptimizationGuide guide) {
+  llvm::FunctionPassManager fpm;
+  switch (guide.pipeline) {
+    case OptimizationPipeline::kInlineOnly: break;
+    case OptimizationPipeline::kO1:
+      fpm = pb.buildFunctionSimplificationPipeline(
+          llvm::OptimizationLevel::O1, llvm::ThinOrFullLTOPhase::None);
+      break;
+    case OptimizationPipeline::kO2:
+      fpm = pb.buildFunctionSimplificationPipeline(
+          llvm::OptimizationLevel::O2, llvm::ThinOrFullLTOPhase::None);
+      break;
+    case OptimizationPipeline::kO3:
+      fpm = pb.buildFunctionSimplificationPipeline(
+          llvm::OptimizationLevel::O3, llvm::ThinOrFullLTOPhase::None);
+      break;
+    case OptimizationPipeline::kRemill:
+      fpm.addPass(llvm::SROAPass());
+      fpm.addPass(StatePromotionPass());
+      fpm.addPass(llvm::EarlyCSEPass(true /* UseMemorySSA */));
+      fpm.addPass(llvm::InstCombinePass());
+      fpm.addPass(llvm::SimplifyCFGPass());
+      fpm.addPass(llvm::GVNPass());
+      fpm.addPass(MemoryIntrinsicDSEPass());
+      fpm.addPass(llvm::DSEPass());
+      fpm.addPass(llvm::InstCombinePass());
+      fpm.addPass(llvm::ADCEPass());
+      fpm.addPass(llvm::SimplifyCFGPass());
+      break;
+  }
+
+  if (guide.loop_vectorize) {
+    fpm.addPass(llvm::LoopVectorizePass());
+  }
+  if (guide.slp_vectorize) {
+    fpm.addPass(llvm::SLPVectorizerPass());
+  }
+  return fpm;
+}
+
+// Inline semantics into `module`, then run the function pipeline selected by
+// `guide` over `funcs`.
+static void RunPipelines(llvm::Module *module,
+                         const std::vector<llvm::Function *> &funcs,
+                         OptimizationGuide guide) {
+  auto &managers = PassManagers::Get(llvm::Triple(module->getTargetTriple()));
+
+  // The inliners delete internal functions that they inlined everywhere.
+  std::vector<llvm::WeakVH> func_handles(funcs.begin(), funcs.end());
+
+  llvm::ModulePassManager inline_mpm;
+  if (guide.verify_input) {
+    inline_mpm.addPass(llvm::VerifierPass());
+  }
+  inline_mpm.addPass(llvm::AlwaysInlinerPass());
+  inline_mpm.addPass(
+      llvm::ModuleInlinerWrapperPass(llvm::getInlineParams(kInlineThreshold)));
+  inline_mpm.run(*module, managers.mam);
+
+  auto fpm = BuildFunctionPipeline(managers.pb, guide);
+  for (auto &func_handle : func_handles) {
+    auto func = llvm::cast_or_null<llvm::Function>(
+        static_cast<llvm::Value *>(func_handle));
+    if (func && !func->isDeclaration()) {
+      fpm.run(*func, managers.fam);
+    }
+  }
+
+  if (guide.verify_output) {
+    llvm::ModulePassManager verify_mpm;
+    verify_mpm.addPass(llvm::VerifierPass());
+    verify_mpm.run(*module, managers.mam);
+  }
+
+  managers.Clear();
+}
+
+// A share of the functions to optimize, optimized on its own thread, in a
+// module that lives in its own context.
+struct OptimizationPartition {
+  llvm::LLVMContext context;
+  std::unique_ptr<llvm::Module> module;
+  std::vector<std::string> func_names;
+
+  // The bitcode of the functions in `func_names`, along with everything that
+  // they transitively reference.
+  std::string bitcode;
+};
+
+// Optimize `funcs` on `num_threads` threads, then clone the optimized
+// functions back into `module`.
+//
+// Only the functions to optimize are partitioned. Each partition gets its own
+// copy of everything that its functions transitively reference, so that the
+// semantics and helpers that they call are still defined there and can be
+// inlined, just as they would be when optimizing `module` directly.
+static void RunPipelinesInParallel(llvm::Module *module,
+                                   const std::vector<llvm::Function *> &funcs,
+                                   OptimizationGuide guide,
+                                   unsigned num_threads) {
+  std::vector<std::vector<llvm::Function *>> part_funcs(num_threads);
+  for (auto i = 0u; i < funcs.size(); ++i) {
+    part_funcs[i % num_threads].push_back(funcs[i]);
+  }
+
+  // The functions that the inliners would delete once they are inlined into
+  // all of their callers. No partition sees all of those callers.
+  std::vector<llvm::Function *> discardable_funcs;
+  for (auto func : funcs) {
+    if (func->isDiscardableIfUnused() && !func->use_empty()) {
+      discardable_funcs.push_back(func);
+    }
+  }
+
+  // Cloning needs to happen in `module`'s context, so do it up front.
+  std::vector<std::unique_ptr<OptimizationPartition>> parts;
+  for (const auto &these_funcs : part_funcs) {
+    auto &part = parts.emplace_back(new OptimizationPartition);
+    // Bitcode with opaque pointers can only be read into a context that
+    // expects them.
+    if (!module->getContext().supportsTypedPointers()) {
+      part->context.enableOpaquePointers();
+    }
+    for (auto func : these_funcs) {
+      part->func_names.emplace_back(func->getName().str());
+    }
+
+    auto clone = CloneFunctionsWithDependencies(these_funcs);
+    llvm::raw_string_ostream os(part->bitcode);
+    llvm::WriteBitcodeToFile(*clone, os);
+    os.flush();
+  }
+
+  std::vector<std::thread> threads;
+  for (auto &part_ptr : parts) {
+    threads.emplace_back([&module, guide, part = part_ptr.get()](void) {
+      auto maybe_module = llvm::parseBitcodeFile(
+          llvm::MemoryBufferRef(part->bitcode, module->getName()),
+          part->context);
+      CHECK(maybe_module) << "Could not copy module "
+                          << module->getName().str() << " for optimization: "
+                          << llvm::toString(maybe_module.takeError());
+      part->module = std::move(*maybe_module);
+      part->bitcode.clear();
+
+      std::vector<llvm::Function *> these_funcs;
+      for (const auto &name : part->func_names) {
+        these_funcs.push_back(CHECK_NOTNULL(part->module->getFunction(name)));
+      }
+
+      RunPipelines(part->module.get(), these_funcs, guide);
+    });
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  for (auto &part : parts) {
+    for (const auto &name : part->func_names) {
+      auto source_func = part->module->getFunction(name);
+      if (!source_func) {
+        continue;  // Inlined everywhere in the partition, and deleted.
+      }
+      auto dest_func = module->getFunction(name);
+      dest_func->deleteBody();
+      CloneFunctionInto(source_func, dest_func);
+    }
+    part->module.reset();
+  }
+
+  // Like `RunPipelines` would have, delete the functions that were inlined
+  // everywhere, now that their callers have been replaced. Deleting one can
+  // leave the functions that it called unused.
+  for (auto changed = true; changed;) {
+    changed = false;
+    for (auto &func : discardable_funcs) {
+      if (func && func->use_empty()) {
+        func->eraseFromParent();
+        func = nullptr;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Returns `true` if some functions of the lazily loaded `module` have bodies
+// that were never read in.
+static bool HasUnmaterializedFunctions(llvm::Module *module) {
+  return std::any_of(module->begin(), module->end(),
+                     [](llvm::Function &func) {
+                       return func.isMaterializable();
+                     });
+}
+
+// Optimize `funcs` on as many threads as `guide` asks for.
+static void OptimizeFunctions(llvm::Module *module,
+                              std::vector<llvm::Function *> funcs,
+                              OptimizationGuide guide) {
+  // Functions are matched up between copies of the module by name, so only
+  // named definitions can be optimized in parallel.
+  funcs.erase(std::remove_if(funcs.begin(), funcs.end(),
+                             [](llvm::Function *func) {
+                               return func->isDeclaration() ||
+                                      func->isMaterializable();
+                             }),
+              funcs.end());
+  auto all_named = std::all_of(funcs.begin(), funcs.end(),
+                               [](llvm::Function *func) {
+                                 return func->hasName();
+                               });
+
+  auto num_threads = guide.num_threads;
+  if (!num_threads) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min<unsigned>(num_threads, funcs.size());
+
+  // Functions with unread bodies look like empty definitions to the passes.
+  // Declaring them would stop more code from being lifted into `module`, so
+  // `funcs` are optimized in a copy of just what they reference instead.
+  const auto is_lazy = HasUnmaterializedFunctions(module);
+  CHECK(all_named || !is_lazy)
+      << "Can't optimize unnamed functions of lazily loaded module "
+      << module->getName().str();
+
+  if (!all_named || (num_threads <= 1u && !is_lazy)) {
+    RunPipelines(module, funcs, guide);
+  } else if (!funcs.empty()) {
+    RunPipelinesInParallel(module, funcs, guide, std::max(1u, num_threads));
+  }
+}
+
+}  // namespace
 
 void OptimizeModule(const remill::Arch *arch, llvm::Module *module,
                     std::function<llvm::Function *(void)> generator,
                     OptimizationGuide guide) {
-
-  llvm::legacy::FunctionPassManager func_manager(module);
-  llvm::legacy::PassManager module_manager;
-
-  auto TLI =
-      new llvm::TargetLibraryInfoImpl(llvm::Triple(module->getTargetTriple()));
-
-  TLI->disableAllFunctions();  // `-fno-builtin`.
-
-  llvm::PassManagerBuilder builder;
-  // TODO(alex): Some of the optimization passes that the builder adds still rely on typed pointers
-  // so we cannot use them. We should switch to using the new pass manager and choose which passes
-  // we want.
-  builder.OptLevel = 0;
-  builder.SizeLevel = 0;
-  builder.Inliner = llvm::createFunctionInliningPass(250);
-  builder.LibraryInfo = TLI;  // Deleted by `llvm::~PassManagerBuilder`.
-  builder.DisableUnrollLoops = false;  // Unroll loops!
-  builder.RerollLoops = false;
-  builder.SLPVectorize = guide.slp_vectorize;
-  builder.LoopVectorize = guide.loop_vectorize;
-  builder.VerifyInput = guide.verify_input;
-  builder.VerifyOutput = guide.verify_output;
-  builder.MergeFunctions = false;
-
-  builder.populateFunctionPassManager(func_manager);
-  builder.populateModulePassManager(module_manager);
-  func_manager.doInitialization();
+  std::vector<llvm::Function *> funcs;
   llvm::Function *func = nullptr;
   while (nullptr != (func = generator())) {
-    func_manager.run(*func);
+    funcs.push_back(func);
   }
-  func_manager.doFinalization();
-  module_manager.run(*module);
+  OptimizeFunctions(module, std::move(funcs), guide);
 }
 
 // Optimize a normal module. This might not contain special Remill-specific
 // intrinsics functions like `__remill_jump`, etc.
 void OptimizeBareModule(llvm::Module *module, OptimizationGuide guide) {
-  llvm::legacy::FunctionPassManager func_manager(module);
-  llvm::legacy::PassManager module_manager;
-
-  auto TLI =
-      new llvm::TargetLibraryInfoImpl(llvm::Triple(module->getTargetTriple()));
-
-  TLI->disableAllFunctions();  // `-fno-builtin`.
-
-  llvm::PassManagerBuilder builder;
-  // TODO(alex): Some of the optimization passes that the builder adds still rely on typed pointers
-  // so we cannot use them. We should switch to using the new pass manager and choose which passes
-  // we want.
-  builder.OptLevel = 0;
-  builder.SizeLevel = 0;
-  builder.Inliner = llvm::createFunctionInliningPass(250);
-  builder.LibraryInfo = TLI;  // Deleted by `llvm::~PassManagerBuilder`.
-  builder.DisableUnrollLoops = false;  // Unroll loops!
-  builder.RerollLoops = false;
-  builder.SLPVectorize = guide.slp_vectorize;
-  builder.LoopVectorize = guide.loop_vectorize;
-  builder.VerifyInput = guide.verify_input;
-  builder.VerifyOutput = guide.verify_output;
-  builder.MergeFunctions = false;
-
-  builder.populateFunctionPassManager(func_manager);
-  builder.populateModulePassManager(module_manager);
-  func_manager.doInitialization();
+  std::vector<llvm::Function *> funcs;
   for (auto &func : *module) {
-    func_manager.run(func);
+    funcs.push_back(&func);
   }
-  func_manager.doFinalization();
-  module_manager.run(*module);
+  OptimizeFunctions(module, std::move(funcs), guide);
 }
 
 }  // namespace remill
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "remill/BC/SemanticsSnapshot.h"
+
+#include <glog/logging.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <unordered_map>
+#include <unordered_set>
+
+#include "remill/Arch/Arch.h"
+#include "remill/BC/ABI.h"
+#include "remill/BC/Util.h"
+
+namespace remill {
+
+class SemanticsSnapshot::Impl {
+ public:
+  // Parse the module-level records of `bitcode` into `context`, without
+  // reading in any function bodies.
+  std::unique_ptr<llvm::Module> Parse(llvm::LLVMContext &context) const;
+
+  std::filesystem::path path;
+
+  // The memory-mapped bitcode file.
+  std::unique_ptr<llvm::MemoryBuffer> bitcode;
+
+  // Maps the names of ISELs, without the `ISEL_` prefix, to the names of their
+  // semantics functions. The names are resolved again in every instantiated
+  // module.
+  std::unordered_map<std::string, std::string> isel_to_func;
+};
+
+std::unique_ptr<llvm::Module>
+SemanticsSnapshot::Impl::Parse(llvm::LLVMContext &context) const {
+  auto maybe_module =
+      llvm::getLazyBitcodeModule(bitcode->getMemBufferRef(), context);
+  if (!maybe_module) {
+    LOG(ERROR) << "Unable to parse semantics bitcode file " << path << ": "
+               << llvm::toString(maybe_module.takeError());
+    return {};
+  }
+  return std::move(*maybe_module);
+}
+
+SemanticsSnapshot::~SemanticsSnapshot(void) {}
+
+SemanticsSnapshot::SemanticsSnapshot(std::unique_ptr<Impl> impl_)
+    : impl(std::move(impl_)) {}
+
+std::shared_ptr<const SemanticsSnapshot>
+SemanticsSnapshot::Load(ArchName arch_name,
+                        const std::vector<std::filesystem::path> &sem_dirs) {
+  auto arch_str = GetArchName(arch_name);
+  auto path = FindSemanticsBitcodeFile(arch_str, sem_dirs, true);
+  if (!path) {
+    LOG(ERROR) << "Cannot find path to " << arch_str
+               << " semantics bitcode file.";
+    return {};
+  }
+  return LoadFromFile(*path);
+}
+
+std::shared_ptr<const SemanticsSnapshot>
+SemanticsSnapshot::LoadFromFile(const std::filesystem::path &path) {
+  auto maybe_buff = llvm::MemoryBuffer::getFile(
+      path.string(), false /* IsText */, false /* RequiresNullTerminator */);
+  if (!maybe_buff) {
+    LOG(ERROR) << "Unable to open semantics bitcode file " << path << ": "
+               << maybe_buff.getError().message();
+    return {};
+  }
+
+  std::unique_ptr<Impl> impl(new Impl);
+  impl->path = path;
+  impl->bitcode = std::move(*maybe_buff);
+
+  // Index the ISELs using a throwaway context. Only the module-level records
+  // are parsed, so this is cheap.
+  llvm::LLVMContext context;
+  auto module = impl->Parse(context);
+  if (!module) {
+    return {};
+  }
+
+  ForEachISel(module.get(), [&](llvm::GlobalVariable *isel,
+                                llvm::Function *sem) {
+    auto name = isel->getName();
+    if (sem && name.consume_front("ISEL_")) {
+      impl->isel_to_func.emplace(name.str(), sem->getName().str());
+    }
+  });
+
+  return std::shared_ptr<const SemanticsSnapshot>(
+      new SemanticsSnapshot(std::move(impl)));
+}
+
+std::unique_ptr<llvm::Module>
+SemanticsSnapshot::Instantiate(const Arch *arch) const {
+  auto module = impl->Parse(*arch->context);
+  if (module) {
+    PrepareLazySemanticsModule(arch, module.get());
+  }
+  return module;
+}
+
+std::unique_ptr<llvm::Module> SemanticsSnapshot::Instantiate(
+    const Arch *arch, const std::vector<std::string> &isel_names) const {
+  auto module = Instantiate(arch);
+  if (!module) {
+    return {};
+  }
+
+  // The instruction lifters always need these.
+  std::vector<std::string> all_isel_names(isel_names);
+  all_isel_names.emplace_back(kInvalidInstructionISelName);
+  all_isel_names.emplace_back(kUnsupportedInstructionISelName);
+
+  llvm::Function *unsupported = nullptr;
+  for (const auto &isel_name : all_isel_names) {
+    auto func_it = impl->isel_to_func.find(isel_name);
+    if (func_it == impl->isel_to_func.end()) {
+      LOG(ERROR) << "No semantics function for " << isel_name << " in "
+                 << impl->path;
+      continue;
+    }
+
+    auto func = module->getFunction(func_it->second);
+    if (!func || !MaterializeSemantics(func)) {
+      LOG(ERROR) << "Unable to read in the semantics function "
+                 << func_it->second << " of " << isel_name << " from "
+                 << impl->path;
+      return {};
+    }
+
+    if (isel_name == kUnsupportedInstructionISelName) {
+      unsupported = func;
+    }
+  }
+
+  if (!unsupported) {
+    LOG(ERROR) << "No semantics function for unsupported instructions in "
+               << impl->path;
+    return {};
+  }
+
+  // Point the ISELs that weren't asked for at the semantics of unsupported
+  // instructions, so that they never resolve to the declarations made below.
+  std::unordered_set<std::string_view> wanted_isel_names(
+      all_isel_names.begin(), all_isel_names.end());
+  ForEachISel(module.get(), [&](llvm::GlobalVariable *isel, llvm::Function *) {
+    auto name = isel->getName();
+    if (name.consume_front("ISEL_") &&
+        !wanted_isel_names.count(std::string_view(name.data(), name.size()))) {
+      isel->setInitializer(llvm::ConstantExpr::getPointerBitCastOrAddrSpaceCast(
+          unsupported, isel->getValueType()));
+    }
+  });
+
+  DeclareUnmaterializedFunctions(module.get());
+  return module;
+}
+
+std::optional<std::string_view>
+SemanticsSnapshot::SemanticsFunctionName(std::string_view isel_name) const {
+  auto func_it = impl->isel_to_func.find(std::string(isel_name));
+  if (func_it == impl->isel_to_func.end()) {
+    return std::nullopt;
+  }
+  return func_it->second;
+}
+
+size_t SemanticsSnapshot::NumISels(void) const {
+  return impl->isel_to_func.size();
+}
+
+const std::filesystem::path &SemanticsSnapshot::Path(void) const {
+  return impl->path;
+}
+
+}  // namespace remill
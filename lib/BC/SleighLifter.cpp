@@ -195,7 +195,11 @@ class SleighLifter::PcodeToLLVMEmitIntoBlock : public PcodeEmit {
           this->cached_unique_ptrs.end()) {
         return this->cached_unique_ptrs.find(offset)->second;
       }
-      auto ptr = bldr.CreateAlloca(
+      // Keep the allocas in the entry block, even when lifting into a block
+      // of the caller, so that they can be promoted to registers.
+      auto &entry_block = bldr.GetInsertBlock()->getParent()->getEntryBlock();
+      llvm::IRBuilder<> alloca_ir(&entry_block, entry_block.begin());
+      auto ptr = alloca_ir.CreateAlloca(
           llvm::IntegerType::get(this->context, 8 * size), 0, nullptr);
       this->cached_unique_ptrs.insert({offset, ptr});
       return ptr;
@@ -253,8 +257,11 @@ class SleighLifter::PcodeToLLVMEmitIntoBlock : public PcodeEmit {
 
   ConstantReplacementContext replacement_cont;
   // Generic sleigh arch
-  std::vector<std::string> user_op_names;
+  const std::vector<std::string> &user_op_names;
 
+  // Block to go to when the p-code transfers control. If this is `nullptr`,
+  // then the p-code is straight-line, and is lifted into the caller's block,
+  // where control simply continues.
   llvm::BasicBlock *exit_block;
 
   void UpdateStatus(LiftStatus new_status, OpCode opc) {
@@ -268,7 +275,7 @@ class SleighLifter::PcodeToLLVMEmitIntoBlock : public PcodeEmit {
   PcodeToLLVMEmitIntoBlock(llvm::BasicBlock *target_block,
                            llvm::Value *state_pointer, const Instruction &insn,
                            SleighLifter &insn_lifter_parent,
-                           std::vector<std::string> user_op_names_,
+                           const std::vector<std::string> &user_op_names_,
                            llvm::BasicBlock *exit_block_)
       : target_block(target_block),
         state_pointer(state_pointer),
@@ -619,6 +626,7 @@ class SleighLifter::PcodeToLLVMEmitIntoBlock : public PcodeEmit {
 
 
   LiftStatus TerminateBlockWithCondition(llvm::Value *condition) {
+    CHECK_NOTNULL(this->exit_block);
     llvm::IRBuilder<> ir(this->target_block);
     this->target_block = llvm::BasicBlock::Create(
         this->context, "continuation", this->target_block->getParent());
@@ -627,7 +635,7 @@ class SleighLifter::PcodeToLLVMEmitIntoBlock : public PcodeEmit {
   }
 
   void TerminateBlock() {
-    if (this->target_block->getTerminator() == nullptr) {
+    if (this->exit_block && this->target_block->getTerminator() == nullptr) {
       llvm::IRBuilder ir(this->target_block);
       ir.CreateBr(this->exit_block);
     }
@@ -1213,11 +1221,7 @@ std::map<OpCode, SleighLifter::PcodeToLLVMEmitIntoBlock::BinaryOperator>
 SleighLifter::SleighLifter(const sleigh::SleighArch *arch_,
                            const IntrinsicTable &intrinsics_)
     : InstructionLifter(arch_, intrinsics_),
-      sleigh_context(new sleigh::SingleInstructionSleighContext(
-          arch_->GetSLAName(), arch_->GetPSpec())),
-      arch(arch_) {
-  arch_->InitializeSleighContext(*sleigh_context);
-}
+      arch(arch_) {}
 
 
 const std::string_view SleighLifter::kInstructionFunctionPrefix =
@@ -1267,12 +1271,20 @@ SleighLifter::LiftIntoInternalBlock(Instruction &inst, llvm::Module *target_mod,
 
   SleighLifter::PcodeToLLVMEmitIntoBlock lifter(
       target_block, internal_state_pointer, inst, *this,
-      this->sleigh_context->getUserOpNames(), exit_block);
-  //TODO(Ian): make a safe to use sleighinstruction context that wraps a context with an arch to preform reset reinits
-
-  this->sleigh_context->resetContext();
-  this->arch->InitializeSleighContext(*this->sleigh_context);
-  sleigh_context->oneInstruction(inst.pc, lifter, inst.bytes);
+      this->GetUserOpNames(), exit_block);
+  // Replay the p-code recorded when the instruction was decoded, and only run
+  // SLEIGH again if the instruction didn't come from a `SleighArch` decoder.
+  if (inst.pcode) {
+    inst.pcode->Replay(this->GetEngine(), inst.pc, lifter);
+
+  } else {
+    //TODO(Ian): make a safe to use sleighinstruction context that wraps a context with an arch to preform reset reinits
+    auto &context = this->GetSleighContext();
+    std::lock_guard<std::mutex> locker(this->sleigh_context_lock);
+    context.resetContext();
+    this->arch->InitializeSleighContext(context);
+    context.oneInstruction(inst.pc, lifter, inst.bytes);
+  }
 
 
   lifter.TerminateBlock();
@@ -1283,6 +1295,34 @@ SleighLifter::LiftIntoInternalBlock(Instruction &inst, llvm::Module *target_mod,
   return {lifter.GetStatus(), target_func};
 }
 
+LiftStatus SleighLifter::LiftPcodeIntoBlock(Instruction &inst,
+                                            llvm::BasicBlock *block,
+                                            llvm::Value *state_ptr) {
+  llvm::IRBuilder<> ir(block);
+  const auto next_pc_ref =
+      LoadRegAddress(block, state_ptr, kNextPCVariableName);
+  const auto pc_ref = LoadRegAddress(block, state_ptr, "PC");
+
+  // Same as the entry of an instruction function: `PC` and `NEXT_PC` point
+  // past this instruction while its p-code runs.
+  const auto pc = ir.CreateLoad(this->GetWordType(), pc_ref.first);
+  const auto fall_through = ir.CreateAdd(
+      pc, llvm::ConstantInt::get(this->GetWordType(), inst.bytes.size()));
+  ir.CreateStore(fall_through, next_pc_ref.first);
+  ir.CreateStore(fall_through, pc_ref.first);
+
+  SleighLifter::PcodeToLLVMEmitIntoBlock lifter(
+      block, state_ptr, inst, *this, this->GetUserOpNames(), nullptr);
+  inst.pcode->Replay(this->GetEngine(), inst.pc, lifter);
+
+  // Same as the exit block of an instruction function.
+  ir.SetInsertPoint(block);
+  ir.CreateStore(ir.CreateLoad(this->GetWordType(), pc_ref.first),
+                 next_pc_ref.first);
+
+  return lifter.GetStatus();
+}
+
 LiftStatus
 SleighLifter::LiftIntoBlock(Instruction &inst, llvm::BasicBlock *block,
                             llvm::Value *state_ptr, bool is_delayed) {
@@ -1316,7 +1356,36 @@ SleighLifter::LiftIntoBlock(Instruction &inst, llvm::BasicBlock *block,
   return res.first;
 }
 
+sleigh::SingleInstructionSleighContext &
+SleighLifter::GetSleighContext(void) const {
+  std::call_once(sleigh_context_once, [this](void) {
+    sleigh_context.reset(new sleigh::SingleInstructionSleighContext(
+        arch->GetSLAName(), arch->GetPSpec()));
+    arch->InitializeSleighContext(*sleigh_context);
+    user_op_names = sleigh_context->getUserOpNames();
+  });
+  return *sleigh_context;
+}
+
+const std::vector<std::string> &SleighLifter::GetUserOpNames(void) const {
+  (void) this->GetSleighContext();
+  return this->user_op_names;
+}
+
+LiftStatus SleighLifter::LiftIntoBlockDirectly(Instruction &inst,
+                                               llvm::BasicBlock *block,
+                                               llvm::Value *state_ptr,
+                                               bool is_delayed) {
+
+  // Anything that needs to split the block goes through an instruction
+  // function.
+  if (!inst.IsValid() || !inst.pcode || !inst.pcode->IsStraightLine()) {
+    return this->LiftIntoBlock(inst, block, state_ptr, is_delayed);
+  }
+  return this->LiftPcodeIntoBlock(inst, block, state_ptr);
+}
+
 Sleigh &SleighLifter::GetEngine(void) const {
-  return this->sleigh_context->GetEngine();
+  return this->GetSleighContext().GetEngine();
 }
 }  // namespace remill
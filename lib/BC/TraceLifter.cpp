@@ -16,14 +16,23 @@
 
 #include <glog/logging.h>
 #include <llvm/IR/Instructions.h>
+#include <remill/Arch/DecodedInstructionCache.h>
 #include <remill/Arch/Instruction.h>
 #include <remill/BC/IntrinsicTable.h>
+#include <remill/BC/SemanticsSnapshot.h>
 #include <remill/BC/TraceLifter.h>
 #include <remill/BC/Util.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <sstream>
+#include <thread>
+#include <unordered_set>
 
 #include "InstructionLifter.h"
 
@@ -52,6 +61,12 @@ void TraceManager::ForEachDevirtualizedTarget(
   // Must be extended.
 }
 
+// Try to get a view of up to `max_size` contiguous executable bytes starting
+// at address `addr`.
+std::string_view TraceManager::TryReadExecutableBytes(uint64_t, size_t) {
+  return {};
+}
+
 // Figure out the name for the trace starting at address `addr`.
 std::string TraceManager::TraceName(uint64_t addr) {
   std::stringstream ss;
@@ -67,16 +82,60 @@ using DecoderWorkList = std::set<uint64_t>;  // For ordering.
 
 class TraceLifter::Impl {
  public:
-  Impl(const Arch *arch_, TraceManager *manager_);
+  Impl(const Arch *arch_, TraceManager *manager_,
+       DecodedInstructionCache *decode_cache_);
+
+  using Callback = std::function<void(uint64_t, llvm::Function *)>;
 
   // Lift one or more traces starting from `addr`. Calls `callback` with each
   // lifted trace.
-  bool Lift(uint64_t addr,
-            std::function<void(uint64_t, llvm::Function *)> callback);
+  bool Lift(uint64_t addr, Callback callback);
+
+  // Extend the previously lifted trace at `addr` with the newly known
+  // devirtualized targets of its indirect jumps.
+  bool Relift(uint64_t addr, Callback callback);
+
+  // Reset the lifting state.
+  void Reset(void);
+
+  // Lift the traces in `trace_work_list`.
+  bool LiftTraces(const Callback &callback);
+
+  // Decode and lift the instructions in `inst_work_list` into `func`.
+  void LiftInstructions(uint64_t trace_addr, llvm::Value *state_ptr);
 
-  // Reads the bytes of an instruction at `addr` into `state.inst_bytes`.
+  // Lift `inst` into `block`, directly if `lift_directly` is set.
+  LiftStatus LiftInstruction(Instruction &inst, llvm::BasicBlock *block,
+                             llvm::Value *state_ptr, bool is_delayed);
+
+  // Terminate any unterminated blocks of `func`, and tell `manager` and
+  // `callback` about the lifted trace.
+  void FinishTrace(uint64_t trace_addr, const Callback &callback);
+
+  // Lift the indirect jump `jump_inst` at the end of `into_block`. If the
+  // manager knows of any targets of the jump, or if we're lifting
+  // incrementally, then this dispatches on the program counter with a
+  // `switch`, otherwise it tail-calls `__remill_jump`.
+  void LiftIndirectJump(llvm::BasicBlock *into_block,
+                        const Instruction &jump_inst);
+
+  // Add a case to `switch_inst` for each devirtualized target of `jump_inst`
+  // that it doesn't already handle.
+  void AddDevirtualizedTargets(llvm::SwitchInst *switch_inst,
+                               const Instruction &jump_inst);
+
+  // Get a trace head that the manager knows about, or that we
+  // will eventually tell the trace manager about.
+  llvm::Function *GetTraceDecl(uint64_t trace_addr);
+
+  // Reads the bytes of an instruction at `addr` into `inst_bytes`.
   bool ReadInstructionBytes(uint64_t addr);
 
+  // Decode `inst_bytes` into `into_inst`, going through `decode_cache` if
+  // there is one.
+  bool DecodeInstruction(uint64_t addr, Instruction &into_inst,
+                         bool is_delayed);
+
   // Return an already lifted trace starting with the code at address
   // `addr`.
   //
@@ -136,20 +195,49 @@ class TraceLifter::Impl {
   llvm::Module *const module;
   const uint64_t addr_mask;
   TraceManager &manager;
+  DecodedInstructionCache *const decode_cache;
 
   llvm::Function *func;
   llvm::BasicBlock *block;
   llvm::SwitchInst *switch_inst;
   const size_t max_inst_bytes;
-  std::string inst_bytes;
+
+  // The bytes of the instruction being decoded. These either view memory
+  // owned by `manager`, or `inst_bytes_buffer`.
+  std::string_view inst_bytes;
+  std::string inst_bytes_buffer;
   Instruction inst;
   Instruction delayed_inst;
   DecoderWorkList trace_work_list;
   DecoderWorkList inst_work_list;
   std::map<uint64_t, llvm::BasicBlock *> blocks;
+
+  // An indirect jump that was lifted as a `switch` over its known targets.
+  struct IndirectJump {
+    llvm::SwitchInst *switch_inst;
+    Instruction inst;
+  };
+
+  // Indirect jumps of the trace being lifted.
+  std::vector<IndirectJump> indirect_jumps;
+
+  // What `Relift` needs to extend an already lifted trace.
+  struct LiftedTrace {
+    llvm::WeakVH func;
+    std::map<uint64_t, llvm::BasicBlock *> blocks;
+    std::vector<IndirectJump> indirect_jumps;
+  };
+
+  // Should we keep the `LiftedTrace`s of lifted traces?
+  bool incremental{false};
+
+  // Should instructions be lifted with `LiftIntoBlockDirectly`?
+  bool lift_directly{false};
+  std::unordered_map<uint64_t, LiftedTrace> lifted_traces;
 };
 
-TraceLifter::Impl::Impl(const Arch *arch_, TraceManager *manager_)
+TraceLifter::Impl::Impl(const Arch *arch_, TraceManager *manager_,
+                        DecodedInstructionCache *decode_cache_)
     : arch(arch_),
       intrinsics(arch->GetInstrinsicTable()),
       word_type(arch->AddressType()),
@@ -158,12 +246,13 @@ TraceLifter::Impl::Impl(const Arch *arch_, TraceManager *manager_)
       addr_mask(arch->address_size >= 64 ? ~0ULL
                                          : (~0ULL >> arch->address_size)),
       manager(*manager_),
+      decode_cache(decode_cache_),
       func(nullptr),
       block(nullptr),
       switch_inst(nullptr),
       max_inst_bytes(arch->MaxInstructionSize()) {
 
-  inst_bytes.reserve(max_inst_bytes);
+  inst_bytes_buffer.reserve(max_inst_bytes);
 }
 
 // Return an already lifted trace starting with the code at address
@@ -207,15 +296,40 @@ llvm::Function *TraceLifter::Impl::GetLiftedTraceDefinition(uint64_t addr) {
 
 TraceLifter::~TraceLifter(void) {}
 
-TraceLifter::TraceLifter(const Arch *arch_, TraceManager *manager_)
-    : impl(new Impl(arch_, manager_)) {}
+TraceLifter::TraceLifter(const Arch *arch_, TraceManager *manager_,
+                         DecodedInstructionCache *decode_cache_)
+    : impl(new Impl(arch_, manager_, decode_cache_)) {}
 
 void TraceLifter::NullCallback(uint64_t, llvm::Function *) {}
 
 // Reads the bytes of an instruction at `addr` into `inst_bytes`.
 bool TraceLifter::Impl::ReadInstructionBytes(uint64_t addr) {
-  inst_bytes.clear();
-  for (size_t i = 0; i < max_inst_bytes; ++i) {
+
+  // Try to read all of the bytes in one go, without copying them.
+  auto view = manager.TryReadExecutableBytes(addr, max_inst_bytes);
+  if (addr > addr_mask) {
+    view = {};
+  }
+  if (view.size() > max_inst_bytes) {
+    view = view.substr(0, max_inst_bytes);
+  }
+
+  // Don't let the instruction wrap around the 32- or 64-bit address space.
+  const uint64_t max_extra_bytes = addr_mask - addr;
+  const auto reaches_end = !view.empty() && max_extra_bytes < view.size();
+  if (reaches_end) {
+    view = view.substr(0, max_extra_bytes + 1u);
+  }
+
+  if (view.size() == max_inst_bytes || reaches_end) {
+    inst_bytes = view;
+    return true;
+  }
+
+  // The view is short, e.g. because the instruction straddles the end of a
+  // segment, so read in the rest byte by byte.
+  inst_bytes_buffer.assign(view.data(), view.size());
+  for (size_t i = view.size(); i < max_inst_bytes; ++i) {
     const auto byte_addr = (addr + i) & addr_mask;
     if (byte_addr < addr) {
       break;  // 32- or 64-bit address overflow.
@@ -226,51 +340,142 @@ bool TraceLifter::Impl::ReadInstructionBytes(uint64_t addr) {
                     << byte_addr << std::dec;
       break;
     }
-    inst_bytes.push_back(static_cast<char>(byte));
+    inst_bytes_buffer.push_back(static_cast<char>(byte));
   }
+  inst_bytes = inst_bytes_buffer;
   return !inst_bytes.empty();
 }
 
+// Decode `inst_bytes` into `into_inst`, going through `decode_cache` if
+// there is one.
+bool TraceLifter::Impl::DecodeInstruction(uint64_t addr,
+                                          Instruction &into_inst,
+                                          bool is_delayed) {
+  auto context = arch->CreateInitialContext();
+  if (decode_cache && is_delayed) {
+    return decode_cache
+        ->DecodeDelayedInstruction(arch, addr, inst_bytes, into_inst,
+                                   std::move(context))
+        .has_value();
+
+  } else if (decode_cache) {
+    return decode_cache
+        ->DecodeInstruction(arch, addr, inst_bytes, into_inst,
+                            std::move(context))
+        .has_value();
+
+  } else if (is_delayed) {
+    return arch
+        ->DecodeDelayedInstruction(addr, inst_bytes, into_inst,
+                                   std::move(context))
+        .has_value();
+
+  } else {
+    return arch
+        ->DecodeInstruction(addr, inst_bytes, into_inst, std::move(context))
+        .has_value();
+  }
+}
+
 // Lift one or more traces starting from `addr`.
 bool TraceLifter::Lift(
     uint64_t addr, std::function<void(uint64_t, llvm::Function *)> callback) {
   return impl->Lift(addr, callback);
 }
 
-// Lift one or more traces starting from `addr`.
-bool TraceLifter::Impl::Lift(
-    uint64_t addr_, std::function<void(uint64_t, llvm::Function *)> callback) {
-  auto addr = addr_ & addr_mask;
-  if (addr < addr_) {  // Address is out of range.
-    LOG(ERROR) << "Trace address " << std::hex << addr_ << " is too big"
-               << std::dec;
-    return false;
+// Extend the previously lifted trace at `addr`.
+bool TraceLifter::Relift(
+    uint64_t addr, std::function<void(uint64_t, llvm::Function *)> callback) {
+  return impl->Relift(addr, callback);
+}
+
+void TraceLifter::SetIncremental(bool incremental) {
+  impl->incremental = incremental;
+  if (!incremental) {
+    impl->lifted_traces.clear();
   }
+}
 
-  // Reset the lifting state.
+void TraceLifter::SetLiftDirectly(bool lift_directly) {
+  impl->lift_directly = lift_directly;
+}
+
+// Reset the lifting state.
+void TraceLifter::Impl::Reset(void) {
   trace_work_list.clear();
   inst_work_list.clear();
   blocks.clear();
-  inst_bytes.clear();
+  indirect_jumps.clear();
+  inst_bytes = {};
+  inst_bytes_buffer.clear();
   func = nullptr;
   switch_inst = nullptr;
   block = nullptr;
   inst.Reset();
   delayed_inst.Reset();
+}
 
-  // Get a trace head that the manager knows about, or that we
-  // will eventually tell the trace manager about.
-  auto get_trace_decl = [=](uint64_t trace_addr) -> llvm::Function * {
-    if (auto trace = GetLiftedTraceDeclaration(trace_addr)) {
-      return trace;
-    } else if (trace_work_list.count(trace_addr)) {
-      return arch->DeclareLiftedFunction(manager.TraceName(trace_addr), module);
-    } else {
-      return nullptr;
-    }
-  };
+// Get a trace head that the manager knows about, or that we
+// will eventually tell the trace manager about.
+llvm::Function *TraceLifter::Impl::GetTraceDecl(uint64_t trace_addr) {
+  if (auto trace = GetLiftedTraceDeclaration(trace_addr)) {
+    return trace;
+  } else if (trace_work_list.count(trace_addr)) {
+    return arch->DeclareLiftedFunction(manager.TraceName(trace_addr), module);
+  } else {
+    return nullptr;
+  }
+}
 
+// Lift one or more traces starting from `addr`.
+bool TraceLifter::Impl::Lift(uint64_t addr_, Callback callback) {
+  auto addr = addr_ & addr_mask;
+  if (addr < addr_) {  // Address is out of range.
+    LOG(ERROR) << "Trace address " << std::hex << addr_ << " is too big"
+               << std::dec;
+    return false;
+  }
+
+  Reset();
   trace_work_list.insert(addr);
+  return LiftTraces(callback);
+}
+
+// Extend the previously lifted trace at `addr` with the newly known
+// devirtualized targets of its indirect jumps. Only the blocks that become
+// reachable through new targets are decoded and lifted.
+bool TraceLifter::Impl::Relift(uint64_t addr_, Callback callback) {
+  auto addr = addr_ & addr_mask;
+  auto trace_it = lifted_traces.find(addr);
+  if (trace_it == lifted_traces.end() || !trace_it->second.func) {
+    if (trace_it != lifted_traces.end()) {
+      lifted_traces.erase(trace_it);
+    }
+    return Lift(addr_, std::move(callback));
+  }
+
+  Reset();
+
+  auto &trace = trace_it->second;
+  func = llvm::cast<llvm::Function>(trace.func);
+  blocks.swap(trace.blocks);
+  indirect_jumps.swap(trace.indirect_jumps);
+  lifted_traces.erase(trace_it);
+
+  DLOG(INFO) << "Re-lifting trace at address " << std::hex << addr
+             << std::dec;
+
+  for (auto &jump : indirect_jumps) {
+    AddDevirtualizedTargets(jump.switch_inst, jump.inst);
+  }
+
+  LiftInstructions(addr, NthArgument(func, kStatePointerArgNum));
+  FinishTrace(addr, callback);
+  return LiftTraces(callback);
+}
+
+// Lift the traces in `trace_work_list`.
+bool TraceLifter::Impl::LiftTraces(const Callback &callback) {
   while (!trace_work_list.empty()) {
     const auto trace_addr = PopTraceAddress();
 
@@ -283,8 +488,9 @@ bool TraceLifter::Impl::Lift(
     DLOG(INFO) << "Lifting trace at address " << std::hex << trace_addr
                << std::dec;
 
-    func = get_trace_decl(trace_addr);
+    func = GetTraceDecl(trace_addr);
     blocks.clear();
+    indirect_jumps.clear();
 
     if (!func || !func->isDeclaration()) {
       func = arch->DeclareLiftedFunction(manager.TraceName(trace_addr), module);
@@ -315,361 +521,734 @@ bool TraceLifter::Impl::Lift(
     CHECK(inst_work_list.empty());
     inst_work_list.insert(trace_addr);
 
-    // Decode instructions.
-    while (!inst_work_list.empty()) {
-      const auto inst_addr = PopInstructionAddress();
+    LiftInstructions(trace_addr, state_ptr);
+    FinishTrace(trace_addr, callback);
+  }
 
-      block = GetOrCreateBlock(inst_addr);
-      switch_inst = nullptr;
+  return true;
+}
 
-      // We have already lifted this instruction block.
-      if (!block->empty()) {
-        continue;
-      }
+// Terminate any unterminated blocks of `func`, and tell `manager` and
+// `callback` about the lifted trace.
+void TraceLifter::Impl::FinishTrace(uint64_t trace_addr,
+                                    const Callback &callback) {
+  for (auto &block : *func) {
+    if (!block.getTerminator()) {
+      AddTerminatingTailCall(&block, intrinsics->missing_block, *intrinsics);
+    }
+  }
+
+  if (incremental) {
+    auto &trace = lifted_traces[trace_addr];
+    trace.func = func;
+    trace.blocks.swap(blocks);
+    trace.indirect_jumps.swap(indirect_jumps);
+  }
+
+  callback(trace_addr, func);
+  manager.SetLiftedTraceDefinition(trace_addr, func);
+}
+
+// Lift the indirect jump `jump_inst` at the end of `into_block`.
+void TraceLifter::Impl::LiftIndirectJump(llvm::BasicBlock *into_block,
+                                         const Instruction &jump_inst) {
+  bool has_targets = false;
+  manager.ForEachDevirtualizedTarget(
+      jump_inst, [&has_targets](uint64_t, DevirtualizedTargetKind) {
+        has_targets = true;
+      });
+
+  if (!has_targets && !incremental) {
+    AddTerminatingTailCall(into_block, intrinsics->jump, *intrinsics);
+    return;
+  }
+
+  // Unknown targets go to `__remill_jump`.
+  auto default_block = llvm::BasicBlock::Create(context, "", func);
+  AddTerminatingTailCall(default_block, intrinsics->jump, *intrinsics);
 
-      // Check to see if this instruction corresponds with an existing
-      // trace head, and if so, tail-call into that trace directly without
-      // decoding or lifting the instruction.
-      if (inst_addr != trace_addr) {
-        if (auto inst_as_trace = get_trace_decl(inst_addr)) {
-          AddTerminatingTailCall(block, inst_as_trace, *intrinsics);
-          continue;
+  auto pc = LoadProgramCounter(into_block, *intrinsics);
+  switch_inst = llvm::SwitchInst::Create(pc, default_block, 0, into_block);
+  AddDevirtualizedTargets(switch_inst, jump_inst);
+
+  if (incremental) {
+    indirect_jumps.push_back({switch_inst, jump_inst});
+  }
+}
+
+// Add a case to `switch_inst` for each devirtualized target of `jump_inst`
+// that it doesn't already handle. Trace-local targets are added to the
+// instruction work list, and trace heads to the trace work list.
+void TraceLifter::Impl::AddDevirtualizedTargets(llvm::SwitchInst *switch_inst,
+                                                const Instruction &jump_inst) {
+  manager.ForEachDevirtualizedTarget(
+      jump_inst, [=](uint64_t target_addr_, DevirtualizedTargetKind kind) {
+        const auto target_addr = target_addr_ & addr_mask;
+        auto target_pc =
+            llvm::ConstantInt::get(intrinsics->pc_type, target_addr);
+        if (switch_inst->findCaseValue(target_pc) !=
+            switch_inst->case_default()) {
+          return;
         }
-      }
 
-      // No executable bytes here.
-      if (!ReadInstructionBytes(inst_addr)) {
-        AddTerminatingTailCall(block, intrinsics->missing_block, *intrinsics);
+        if (kind == DevirtualizedTargetKind::kTraceLocal) {
+          inst_work_list.insert(target_addr);
+          switch_inst->addCase(target_pc, GetOrCreateBlock(target_addr));
+          return;
+        }
+
+        trace_work_list.insert(target_addr);
+        auto target_block = llvm::BasicBlock::Create(context, "", func);
+        AddTerminatingTailCall(target_block, GetTraceDecl(target_addr),
+                               *intrinsics);
+        switch_inst->addCase(target_pc, target_block);
+      });
+}
+
+LiftStatus TraceLifter::Impl::LiftInstruction(Instruction &inst,
+                                              llvm::BasicBlock *block,
+                                              llvm::Value *state_ptr,
+                                              bool is_delayed) {
+  auto lifter = inst.GetLifter();
+  if (lift_directly) {
+    return lifter->LiftIntoBlockDirectly(inst, block, state_ptr, is_delayed);
+  }
+  return lifter->LiftIntoBlock(inst, block, state_ptr, is_delayed);
+}
+
+// Decode and lift the instructions in `inst_work_list` into `func`.
+void TraceLifter::Impl::LiftInstructions(uint64_t trace_addr,
+                                         llvm::Value *state_ptr) {
+  while (!inst_work_list.empty()) {
+    const auto inst_addr = PopInstructionAddress();
+
+    block = GetOrCreateBlock(inst_addr);
+    switch_inst = nullptr;
+
+    // We have already lifted this instruction block.
+    if (!block->empty()) {
+      continue;
+    }
+
+    // Check to see if this instruction corresponds with an existing
+    // trace head, and if so, tail-call into that trace directly without
+    // decoding or lifting the instruction.
+    if (inst_addr != trace_addr) {
+      if (auto inst_as_trace = GetTraceDecl(inst_addr)) {
+        AddTerminatingTailCall(block, inst_as_trace, *intrinsics);
         continue;
       }
+    }
+
+    // No executable bytes here.
+    if (!ReadInstructionBytes(inst_addr)) {
+      AddTerminatingTailCall(block, intrinsics->missing_block, *intrinsics);
+      continue;
+    }
 
-      inst.Reset();
+    inst.Reset();
 
-      // TODO(Ian): not passing context around in trace lifter
-      std::ignore = arch->DecodeInstruction(inst_addr, inst_bytes, inst,
-                                            this->arch->CreateInitialContext());
+    // TODO(Ian): not passing context around in trace lifter
+    std::ignore = DecodeInstruction(inst_addr, inst, false /* is_delayed */);
+
+    auto lift_status =
+        LiftInstruction(inst, block, state_ptr, false /* is_delayed */);
+    if (kLiftedInstruction != lift_status) {
+      AddTerminatingTailCall(block, intrinsics->error, *intrinsics);
+      continue;
+    }
+
+    // Handle lifting a delayed instruction.
+    auto try_delay = arch->MayHaveDelaySlot(inst);
+    if (try_delay) {
+      delayed_inst.Reset();
+      if (!ReadInstructionBytes(inst.delayed_pc) ||
+          !DecodeInstruction(inst.delayed_pc, delayed_inst,
+                             true /* is_delayed */)) {
+        LOG(ERROR) << "Couldn't read delayed inst "
+                   << delayed_inst.Serialize();
+        AddTerminatingTailCall(block, intrinsics->error, *intrinsics);
+        continue;
+      }
+    }
 
-      auto lift_status =
-          inst.GetLifter()->LiftIntoBlock(inst, block, state_ptr);
+    // Functor used to add in a delayed instruction.
+    auto try_add_delay_slot = [&](bool on_branch_taken_path,
+                                  llvm::BasicBlock *into_block) -> void {
+      if (!try_delay) {
+        return;
+      }
+      if (!arch->NextInstructionIsDelayed(inst, delayed_inst,
+                                          on_branch_taken_path)) {
+        return;
+      }
+      lift_status = LiftInstruction(delayed_inst, into_block, state_ptr,
+                                    true /* is_delayed */);
       if (kLiftedInstruction != lift_status) {
         AddTerminatingTailCall(block, intrinsics->error, *intrinsics);
+      }
+    };
+
+    // Connect together the basic blocks.
+    switch (inst.category) {
+      case Instruction::kCategoryInvalid:
+      case Instruction::kCategoryError:
+        AddTerminatingTailCall(block, intrinsics->error, *intrinsics);
+        break;
+
+      case Instruction::kCategoryNormal:
+      case Instruction::kCategoryNoOp:
+        llvm::BranchInst::Create(GetOrCreateNextBlock(), block);
+        break;
+
+      // Direct jumps could either be local or could be tail-calls. In the
+      // case of a tail call, we'll assume that the trace manager contains
+      // advanced knowledge of this, and so when we go to make a block for
+      // the targeted instruction, we'll either tail call to the target
+      // trace, or we'll just extend out the current trace. Either way, no
+      // sacrifice in correctness is made.
+      case Instruction::kCategoryDirectJump:
+        try_add_delay_slot(true, block);
+        llvm::BranchInst::Create(GetOrCreateBranchTakenBlock(), block);
+        break;
+
+      case Instruction::kCategoryIndirectJump: {
+        try_add_delay_slot(true, block);
+        LiftIndirectJump(block, inst);
+        break;
+      }
+
+      case Instruction::kCategoryAsyncHyperCall:
+        AddCall(block, intrinsics->async_hyper_call, *intrinsics);
+        goto check_call_return;
+
+      case Instruction::kCategoryIndirectFunctionCall: {
+        try_add_delay_slot(true, block);
+        const auto fall_through_block =
+            llvm::BasicBlock::Create(context, "", func);
+
+        const auto ret_pc_ref =
+            LoadReturnProgramCounterRef(fall_through_block);
+        const auto next_pc_ref =
+            LoadNextProgramCounterRef(fall_through_block);
+        llvm::IRBuilder<> ir(fall_through_block);
+        ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
+        ir.CreateBr(GetOrCreateBranchNotTakenBlock());
+
+        AddCall(block, intrinsics->function_call, *intrinsics);
+        llvm::BranchInst::Create(fall_through_block, block);
+        block = fall_through_block;
         continue;
       }
 
-      // Handle lifting a delayed instruction.
-      auto try_delay = arch->MayHaveDelaySlot(inst);
-      if (try_delay) {
-        delayed_inst.Reset();
-        if (!ReadInstructionBytes(inst.delayed_pc) ||
-            !arch->DecodeDelayedInstruction(
-                inst.delayed_pc, inst_bytes, delayed_inst,
-                this->arch->CreateInitialContext())) {
-          LOG(ERROR) << "Couldn't read delayed inst "
-                     << delayed_inst.Serialize();
-          AddTerminatingTailCall(block, intrinsics->error, *intrinsics);
-          continue;
+      case Instruction::kCategoryConditionalIndirectFunctionCall: {
+        auto taken_block = llvm::BasicBlock::Create(context, "", func);
+        auto not_taken_block = GetOrCreateBranchNotTakenBlock();
+        const auto orig_not_taken_block = not_taken_block;
+
+        // If we might need to add delay slots, then try to lift the delayed
+        // instruction on each side of the conditional branch, injecting in
+        // new blocks (for the delayed instruction) between the branch
+        // and its original targets.
+        if (try_delay) {
+          not_taken_block = llvm::BasicBlock::Create(context, "", func);
+
+          try_add_delay_slot(true, taken_block);
+          try_add_delay_slot(false, not_taken_block);
+
+          llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
         }
+
+        llvm::BranchInst::Create(taken_block, not_taken_block,
+                                 LoadBranchTaken(block), block);
+
+        AddCall(taken_block, intrinsics->function_call, *intrinsics);
+
+        const auto ret_pc_ref = LoadReturnProgramCounterRef(taken_block);
+        const auto next_pc_ref = LoadNextProgramCounterRef(taken_block);
+        llvm::IRBuilder<> ir(taken_block);
+        ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
+        ir.CreateBr(orig_not_taken_block);
+        block = orig_not_taken_block;
+        continue;
       }
 
-      // Functor used to add in a delayed instruction.
-      auto try_add_delay_slot = [&](bool on_branch_taken_path,
-                                    llvm::BasicBlock *into_block) -> void {
-        if (!try_delay) {
-          return;
+      // In the case of a direct function call, we try to handle the
+      // pattern of a call to the next PC as a way of getting access to
+      // an instruction pointer. It is the case where a call to the next
+      // PC could also be something more like a call to a `noreturn` function
+      // and that is OK, because either a user of the trace manager has
+      // already told us that the next PC is a trace head (and we'll pick
+      // that up when trying to lift it), or we'll just have a really big
+      // trace for this function without sacrificing correctness.
+      case Instruction::kCategoryDirectFunctionCall: {
+      direct_func_call:
+        try_add_delay_slot(true, block);
+        if (inst.branch_not_taken_pc != inst.branch_taken_pc) {
+          trace_work_list.insert(inst.branch_taken_pc);
+          auto target_trace = GetTraceDecl(inst.branch_taken_pc);
+          AddCall(block, target_trace, *intrinsics);
         }
-        if (!arch->NextInstructionIsDelayed(inst, delayed_inst,
-                                            on_branch_taken_path)) {
-          return;
+
+        const auto ret_pc_ref = LoadReturnProgramCounterRef(block);
+        const auto next_pc_ref = LoadNextProgramCounterRef(block);
+        llvm::IRBuilder<> ir(block);
+        ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
+        ir.CreateBr(GetOrCreateBranchNotTakenBlock());
+
+        continue;
+      }
+
+      case Instruction::kCategoryConditionalDirectFunctionCall: {
+        if (inst.branch_not_taken_pc == inst.branch_taken_pc) {
+          goto direct_func_call;
         }
-        lift_status = delayed_inst.GetLifter()->LiftIntoBlock(
-            delayed_inst, into_block, state_ptr, true /* is_delayed */);
-        if (kLiftedInstruction != lift_status) {
-          AddTerminatingTailCall(block, intrinsics->error, *intrinsics);
+
+        auto taken_block = llvm::BasicBlock::Create(context, "", func);
+        auto not_taken_block = GetOrCreateBranchNotTakenBlock();
+        const auto orig_not_taken_block = not_taken_block;
+
+        // If we might need to add delay slots, then try to lift the delayed
+        // instruction on each side of the conditional branch, injecting in
+        // new blocks (for the delayed instruction) between the branch
+        // and its original targets.
+        if (try_delay) {
+          not_taken_block = llvm::BasicBlock::Create(context, "", func);
+
+          try_add_delay_slot(true, taken_block);
+          try_add_delay_slot(false, not_taken_block);
+
+          llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
         }
-      };
-
-      // Connect together the basic blocks.
-      switch (inst.category) {
-        case Instruction::kCategoryInvalid:
-        case Instruction::kCategoryError:
-          AddTerminatingTailCall(block, intrinsics->error, *intrinsics);
-          break;
-
-        case Instruction::kCategoryNormal:
-        case Instruction::kCategoryNoOp:
-          llvm::BranchInst::Create(GetOrCreateNextBlock(), block);
-          break;
-
-        // Direct jumps could either be local or could be tail-calls. In the
-        // case of a tail call, we'll assume that the trace manager contains
-        // advanced knowledge of this, and so when we go to make a block for
-        // the targeted instruction, we'll either tail call to the target
-        // trace, or we'll just extend out the current trace. Either way, no
-        // sacrifice in correctness is made.
-        case Instruction::kCategoryDirectJump:
-          try_add_delay_slot(true, block);
-          llvm::BranchInst::Create(GetOrCreateBranchTakenBlock(), block);
-          break;
-
-        case Instruction::kCategoryIndirectJump: {
-          try_add_delay_slot(true, block);
-          AddTerminatingTailCall(block, intrinsics->jump, *intrinsics);
-          break;
+
+        llvm::BranchInst::Create(taken_block, not_taken_block,
+                                 LoadBranchTaken(block), block);
+
+        trace_work_list.insert(inst.branch_taken_pc);
+        auto target_trace = GetTraceDecl(inst.branch_taken_pc);
+
+        AddCall(taken_block, intrinsics->function_call, *intrinsics);
+        AddCall(taken_block, target_trace, *intrinsics);
+
+        const auto ret_pc_ref = LoadReturnProgramCounterRef(taken_block);
+        const auto next_pc_ref = LoadNextProgramCounterRef(taken_block);
+        llvm::IRBuilder<> ir(taken_block);
+        ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
+        ir.CreateBr(orig_not_taken_block);
+        block = orig_not_taken_block;
+        continue;
+      }
+
+      // Lift an async hyper call to check if it should do the hypercall.
+      // If so, it will jump to the `do_hyper_call` block, otherwise it will
+      // jump to the block associated with the next PC. In the case of the
+      // `do_hyper_call` block, we assign it to `state.block`, then go
+      // to `check_call_return` to add the hyper call into that block,
+      // checking if the hyper call returns to the next PC or not.
+      //
+      // TODO(pag): Delay slots?
+      case Instruction::kCategoryConditionalAsyncHyperCall: {
+        auto do_hyper_call = llvm::BasicBlock::Create(context, "", func);
+        llvm::BranchInst::Create(do_hyper_call, GetOrCreateNextBlock(),
+                                 LoadBranchTaken(block), block);
+        block = do_hyper_call;
+        AddCall(block, intrinsics->async_hyper_call, *intrinsics);
+        goto check_call_return;
+      }
+
+      check_call_return:
+        do {
+          auto pc = LoadProgramCounter(block, *intrinsics);
+          auto ret_pc =
+              llvm::ConstantInt::get(intrinsics->pc_type, inst.next_pc);
+
+          llvm::IRBuilder<> ir(block);
+          auto eq = ir.CreateICmpEQ(pc, ret_pc);
+          auto unexpected_ret_pc =
+              llvm::BasicBlock::Create(context, "", func);
+          ir.CreateCondBr(eq, GetOrCreateNextBlock(), unexpected_ret_pc);
+          AddTerminatingTailCall(unexpected_ret_pc, intrinsics->missing_block,
+                                 *intrinsics);
+        } while (false);
+        break;
+
+      case Instruction::kCategoryFunctionReturn:
+        try_add_delay_slot(true, block);
+        AddTerminatingTailCall(block, intrinsics->function_return,
+                               *intrinsics);
+        break;
+
+      case Instruction::kCategoryConditionalFunctionReturn: {
+        auto taken_block = llvm::BasicBlock::Create(context, "", func);
+        auto not_taken_block = GetOrCreateBranchNotTakenBlock();
+        const auto orig_not_taken_block = not_taken_block;
+
+        // If we might need to add delay slots, then try to lift the delayed
+        // instruction on each side of the conditional branch, injecting in
+        // new blocks (for the delayed instruction) between the branch
+        // and its original targets.
+        if (try_delay) {
+          not_taken_block = llvm::BasicBlock::Create(context, "", func);
+
+          try_add_delay_slot(true, taken_block);
+          try_add_delay_slot(false, not_taken_block);
+
+          llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
         }
 
-        case Instruction::kCategoryAsyncHyperCall:
-          AddCall(block, intrinsics->async_hyper_call, *intrinsics);
-          goto check_call_return;
+        llvm::BranchInst::Create(taken_block, not_taken_block,
+                                 LoadBranchTaken(block), block);
+
+        AddTerminatingTailCall(taken_block, intrinsics->function_return,
+                               *intrinsics);
+        block = orig_not_taken_block;
+        continue;
+      }
 
-        case Instruction::kCategoryIndirectFunctionCall: {
-          try_add_delay_slot(true, block);
-          const auto fall_through_block =
+      case Instruction::kCategoryConditionalBranch: {
+        auto taken_block = GetOrCreateBranchTakenBlock();
+        auto not_taken_block = GetOrCreateBranchNotTakenBlock();
+
+        // If we might need to add delay slots, then try to lift the delayed
+        // instruction on each side of the conditional branch, injecting in
+        // new blocks (for the delayed instruction) between the branch
+        // and its original targets.
+        if (try_delay) {
+          auto new_taken_block = llvm::BasicBlock::Create(context, "", func);
+          auto new_not_taken_block =
               llvm::BasicBlock::Create(context, "", func);
 
-          const auto ret_pc_ref =
-              LoadReturnProgramCounterRef(fall_through_block);
-          const auto next_pc_ref =
-              LoadNextProgramCounterRef(fall_through_block);
-          llvm::IRBuilder<> ir(fall_through_block);
-          ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
-          ir.CreateBr(GetOrCreateBranchNotTakenBlock());
-
-          AddCall(block, intrinsics->function_call, *intrinsics);
-          llvm::BranchInst::Create(fall_through_block, block);
-          block = fall_through_block;
-          continue;
+          try_add_delay_slot(true, new_taken_block);
+          try_add_delay_slot(false, new_not_taken_block);
+
+          llvm::BranchInst::Create(taken_block, new_taken_block);
+          llvm::BranchInst::Create(not_taken_block, new_not_taken_block);
+
+          taken_block = new_taken_block;
+          not_taken_block = new_not_taken_block;
         }
 
-        case Instruction::kCategoryConditionalIndirectFunctionCall: {
-          auto taken_block = llvm::BasicBlock::Create(context, "", func);
-          auto not_taken_block = GetOrCreateBranchNotTakenBlock();
-          const auto orig_not_taken_block = not_taken_block;
+        llvm::BranchInst::Create(taken_block, not_taken_block,
+                                 LoadBranchTaken(block), block);
+        break;
+      }
+      case Instruction::kCategoryConditionalIndirectJump: {
+        auto taken_block = llvm::BasicBlock::Create(context, "", func);
+        auto not_taken_block = GetOrCreateBranchNotTakenBlock();
+        const auto orig_not_taken_block = not_taken_block;
+
+        // If we might need to add delay slots, then try to lift the delayed
+        // instruction on each side of the conditional branch, injecting in
+        // new blocks (for the delayed instruction) between the branch
+        // and its original targets.
+        if (try_delay) {
+          not_taken_block = llvm::BasicBlock::Create(context, "", func);
+
+          try_add_delay_slot(true, taken_block);
+          try_add_delay_slot(false, not_taken_block);
+
+          llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
+        }
 
-          // If we might need to add delay slots, then try to lift the delayed
-          // instruction on each side of the conditional branch, injecting in
-          // new blocks (for the delayed instruction) between the branch
-          // and its original targets.
-          if (try_delay) {
-            not_taken_block = llvm::BasicBlock::Create(context, "", func);
+        llvm::BranchInst::Create(taken_block, not_taken_block,
+                                 LoadBranchTaken(block), block);
 
-            try_add_delay_slot(true, taken_block);
-            try_add_delay_slot(false, not_taken_block);
+        LiftIndirectJump(taken_block, inst);
+        block = orig_not_taken_block;
+        continue;
+      }
+    }
+  }
+}
 
-            llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
-          }
+namespace {
 
-          llvm::BranchInst::Create(taken_block, not_taken_block,
-                                   LoadBranchTaken(block), block);
+// Work queue of trace heads shared by the workers of a `ParallelTraceLifter`.
+class TraceHeadQueue {
+ public:
+  // Add `addr` to the queue, unless it has ever been queued before.
+  void Push(uint64_t addr) {
+    std::lock_guard<std::mutex> locker(lock);
+    if (heads.insert(addr).second) {
+      pending.push_back(addr);
+      cond.notify_one();
+    }
+  }
 
-          AddCall(taken_block, intrinsics->function_call, *intrinsics);
+  // Blocks until there is a trace head to lift, or until every worker is idle
+  // and there is nothing left to lift.
+  std::optional<uint64_t> Pop(void) {
+    std::unique_lock<std::mutex> locker(lock);
+    cond.wait(locker, [this] { return !pending.empty() || !num_busy; });
+    if (pending.empty()) {
+      return std::nullopt;
+    }
+    const auto addr = pending.front();
+    pending.pop_front();
+    ++num_busy;
+    return addr;
+  }
 
-          const auto ret_pc_ref = LoadReturnProgramCounterRef(taken_block);
-          const auto next_pc_ref = LoadNextProgramCounterRef(taken_block);
-          llvm::IRBuilder<> ir(taken_block);
-          ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
-          ir.CreateBr(orig_not_taken_block);
-          block = orig_not_taken_block;
-          continue;
-        }
+  // Marks that a worker is done lifting the trace head it last popped.
+  void Done(void) {
+    std::lock_guard<std::mutex> locker(lock);
+    --num_busy;
+    if (!num_busy && pending.empty()) {
+      cond.notify_all();
+    }
+  }
 
-        // In the case of a direct function call, we try to handle the
-        // pattern of a call to the next PC as a way of getting access to
-        // an instruction pointer. It is the case where a call to the next
-        // PC could also be something more like a call to a `noreturn` function
-        // and that is OK, because either a user of the trace manager has
-        // already told us that the next PC is a trace head (and we'll pick
-        // that up when trying to lift it), or we'll just have a really big
-        // trace for this function without sacrificing correctness.
-        case Instruction::kCategoryDirectFunctionCall: {
-        direct_func_call:
-          try_add_delay_slot(true, block);
-          if (inst.branch_not_taken_pc != inst.branch_taken_pc) {
-            trace_work_list.insert(inst.branch_taken_pc);
-            auto target_trace = get_trace_decl(inst.branch_taken_pc);
-            AddCall(block, target_trace, *intrinsics);
-          }
-
-          const auto ret_pc_ref = LoadReturnProgramCounterRef(block);
-          const auto next_pc_ref = LoadNextProgramCounterRef(block);
-          llvm::IRBuilder<> ir(block);
-          ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
-          ir.CreateBr(GetOrCreateBranchNotTakenBlock());
+ private:
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<uint64_t> pending;
+  std::unordered_set<uint64_t> heads;
+  unsigned num_busy{0};
+};
 
-          continue;
-        }
+// Trace manager used by a single worker of a `ParallelTraceLifter`. Trace
+// heads other than the one being lifted are handed back to the shared queue
+// and are represented by declarations in the worker's module.
+class WorkerTraceManager final : public TraceManager {
+ public:
+  WorkerTraceManager(TraceManager &shared_, TraceHeadQueue &queue_,
+                     const Arch *arch_, llvm::Module *module_)
+      : shared(shared_),
+        queue(queue_),
+        arch(arch_),
+        module(module_) {}
+
+  std::string TraceName(uint64_t addr) final {
+    return shared.TraceName(addr);
+  }
 
-        case Instruction::kCategoryConditionalDirectFunctionCall: {
-          if (inst.branch_not_taken_pc == inst.branch_taken_pc) {
-            goto direct_func_call;
-          }
+  void SetLiftedTraceDefinition(uint64_t addr,
+                                llvm::Function *lifted_func) final {
+    traces[addr] = lifted_func;
+  }
 
-          auto taken_block = llvm::BasicBlock::Create(context, "", func);
-          auto not_taken_block = GetOrCreateBranchNotTakenBlock();
-          const auto orig_not_taken_block = not_taken_block;
+  // Only trace heads known to the shared manager up front are reported here,
+  // never ones that other workers happen to have queued already, so that
+  // whether a block is lifted inline or as a call to another trace doesn't
+  // depend on thread timing. The `TraceLifter` itself still treats the heads
+  // that it discovers while lifting the current trace as traces.
+  llvm::Function *GetLiftedTraceDeclaration(uint64_t addr) final {
+    if (shared.GetLiftedTraceDeclaration(addr)) {
+      return GetOrDeclareTrace(addr);
+    }
+    return nullptr;
+  }
 
-          // If we might need to add delay slots, then try to lift the delayed
-          // instruction on each side of the conditional branch, injecting in
-          // new blocks (for the delayed instruction) between the branch
-          // and its original targets.
-          if (try_delay) {
-            not_taken_block = llvm::BasicBlock::Create(context, "", func);
+  // Only `current_head` is lifted by this worker; everything else is queued
+  // up for some worker to lift, and looks already lifted to our `TraceLifter`.
+  llvm::Function *GetLiftedTraceDefinition(uint64_t addr) final {
+    if (addr == current_head && !shared.GetLiftedTraceDefinition(addr)) {
+      return nullptr;
+    }
+    queue.Push(addr);
+    return GetOrDeclareTrace(addr);
+  }
 
-            try_add_delay_slot(true, taken_block);
-            try_add_delay_slot(false, not_taken_block);
+  void ForEachDevirtualizedTarget(
+      const Instruction &inst,
+      std::function<void(uint64_t, DevirtualizedTargetKind)> func) final {
+    shared.ForEachDevirtualizedTarget(inst, std::move(func));
+  }
 
-            llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
-          }
+  bool TryReadExecutableByte(uint64_t addr, uint8_t *byte) final {
+    return shared.TryReadExecutableByte(addr, byte);
+  }
 
-          llvm::BranchInst::Create(taken_block, not_taken_block,
-                                   LoadBranchTaken(block), block);
+  std::string_view TryReadExecutableBytes(uint64_t addr,
+                                          size_t max_size) final {
+    return shared.TryReadExecutableBytes(addr, max_size);
+  }
 
-          trace_work_list.insert(inst.branch_taken_pc);
-          auto target_trace = get_trace_decl(inst.branch_taken_pc);
-
-          AddCall(taken_block, intrinsics->function_call, *intrinsics);
-          AddCall(taken_block, target_trace, *intrinsics);
-
-          const auto ret_pc_ref = LoadReturnProgramCounterRef(taken_block);
-          const auto next_pc_ref = LoadNextProgramCounterRef(taken_block);
-          llvm::IRBuilder<> ir(taken_block);
-          ir.CreateStore(ir.CreateLoad(word_type, ret_pc_ref), next_pc_ref);
-          ir.CreateBr(orig_not_taken_block);
-          block = orig_not_taken_block;
-          continue;
-        }
+  uint64_t current_head{0};
+  TraceMap traces;
 
-        // Lift an async hyper call to check if it should do the hypercall.
-        // If so, it will jump to the `do_hyper_call` block, otherwise it will
-        // jump to the block associated with the next PC. In the case of the
-        // `do_hyper_call` block, we assign it to `state.block`, then go
-        // to `check_call_return` to add the hyper call into that block,
-        // checking if the hyper call returns to the next PC or not.
-        //
-        // TODO(pag): Delay slots?
-        case Instruction::kCategoryConditionalAsyncHyperCall: {
-          auto do_hyper_call = llvm::BasicBlock::Create(context, "", func);
-          llvm::BranchInst::Create(do_hyper_call, GetOrCreateNextBlock(),
-                                   LoadBranchTaken(block), block);
-          block = do_hyper_call;
-          AddCall(block, intrinsics->async_hyper_call, *intrinsics);
-          goto check_call_return;
-        }
+ private:
+  llvm::Function *GetOrDeclareTrace(uint64_t addr) {
+    const auto name = TraceName(addr);
+    if (auto func = module->getFunction(name)) {
+      return func;
+    }
+    return arch->DeclareLiftedFunction(name, module);
+  }
 
-        check_call_return:
-          do {
-            auto pc = LoadProgramCounter(block, *intrinsics);
-            auto ret_pc =
-                llvm::ConstantInt::get(intrinsics->pc_type, inst.next_pc);
-
-            llvm::IRBuilder<> ir(block);
-            auto eq = ir.CreateICmpEQ(pc, ret_pc);
-            auto unexpected_ret_pc =
-                llvm::BasicBlock::Create(context, "", func);
-            ir.CreateCondBr(eq, GetOrCreateNextBlock(), unexpected_ret_pc);
-            AddTerminatingTailCall(unexpected_ret_pc, intrinsics->missing_block,
-                                   *intrinsics);
-          } while (false);
-          break;
-
-        case Instruction::kCategoryFunctionReturn:
-          try_add_delay_slot(true, block);
-          AddTerminatingTailCall(block, intrinsics->function_return,
-                                 *intrinsics);
-          break;
+  TraceManager &shared;
+  TraceHeadQueue &queue;
+  const Arch *const arch;
+  llvm::Module *const module;
+};
 
-        case Instruction::kCategoryConditionalFunctionReturn: {
-          auto taken_block = llvm::BasicBlock::Create(context, "", func);
-          auto not_taken_block = GetOrCreateBranchNotTakenBlock();
-          const auto orig_not_taken_block = not_taken_block;
+// State owned by a single worker thread.
+struct TraceLiftingWorker {
+  llvm::LLVMContext context;
+  Arch::ArchPtr arch;
+  std::unique_ptr<llvm::Module> module;
+  TraceMap traces;
+  bool ok{true};
+};
 
-          // If we might need to add delay slots, then try to lift the delayed
-          // instruction on each side of the conditional branch, injecting in
-          // new blocks (for the delayed instruction) between the branch
-          // and its original targets.
-          if (try_delay) {
-            not_taken_block = llvm::BasicBlock::Create(context, "", func);
+}  // namespace
 
-            try_add_delay_slot(true, taken_block);
-            try_add_delay_slot(false, not_taken_block);
+class ParallelTraceLifter::Impl {
+ public:
+  Impl(OSName os_name_, ArchName arch_name_, TraceManager *manager_,
+       unsigned num_workers_,
+       std::shared_ptr<const SemanticsSnapshot> semantics_);
 
-            llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
-          }
+  bool Lift(const std::vector<uint64_t> &addrs, llvm::Module *dest_module,
+            WorkerModuleCallback callback);
 
-          llvm::BranchInst::Create(taken_block, not_taken_block,
-                                   LoadBranchTaken(block), block);
+  // Lift trace heads taken from `queue` until there are none left.
+  void RunWorker(TraceLiftingWorker &worker, TraceHeadQueue &queue,
+                 const WorkerModuleCallback &callback);
 
-          AddTerminatingTailCall(taken_block, intrinsics->function_return,
-                                 *intrinsics);
-          block = orig_not_taken_block;
-          continue;
-        }
+  const OSName os_name;
+  const ArchName arch_name;
+  TraceManager &manager;
+  const unsigned num_workers;
+
+  // Shared by the workers, which each instantiate their own semantics module
+  // from it.
+  std::shared_ptr<const SemanticsSnapshot> semantics;
+};
 
-        case Instruction::kCategoryConditionalBranch: {
-          auto taken_block = GetOrCreateBranchTakenBlock();
-          auto not_taken_block = GetOrCreateBranchNotTakenBlock();
+ParallelTraceLifter::Impl::Impl(
+    OSName os_name_, ArchName arch_name_, TraceManager *manager_,
+    unsigned num_workers_, std::shared_ptr<const SemanticsSnapshot> semantics_)
+    : os_name(os_name_),
+      arch_name(arch_name_),
+      manager(*manager_),
+      num_workers(num_workers_ ? num_workers_
+                               : std::max(1u,
+                                          std::thread::hardware_concurrency())),
+      semantics(std::move(semantics_)) {
+  if (!semantics) {
+    semantics = SemanticsSnapshot::Load(arch_name);
+  }
+  CHECK(semantics) << "Unable to load the " << GetArchName(arch_name)
+                   << " semantics";
+}
 
-          // If we might need to add delay slots, then try to lift the delayed
-          // instruction on each side of the conditional branch, injecting in
-          // new blocks (for the delayed instruction) between the branch
-          // and its original targets.
-          if (try_delay) {
-            auto new_taken_block = llvm::BasicBlock::Create(context, "", func);
-            auto new_not_taken_block =
-                llvm::BasicBlock::Create(context, "", func);
+void ParallelTraceLifter::Impl::RunWorker(
+    TraceLiftingWorker &worker, TraceHeadQueue &queue,
+    const WorkerModuleCallback &callback) {
 
-            try_add_delay_slot(true, new_taken_block);
-            try_add_delay_slot(false, new_not_taken_block);
+  // Architecture construction touches process-wide decoder state, so only
+  // build one at a time. Instantiating the semantics is done in parallel.
+  {
+    static std::mutex build_lock;
+    std::lock_guard<std::mutex> locker(build_lock);
+    worker.arch = Arch::Build(&worker.context, os_name, arch_name);
+  }
 
-            llvm::BranchInst::Create(taken_block, new_taken_block);
-            llvm::BranchInst::Create(not_taken_block, new_not_taken_block);
+  if (!worker.arch) {
+    LOG(ERROR) << "Could not build architecture " << GetArchName(arch_name)
+               << " for lifting worker";
+    worker.ok = false;
+    return;
+  }
 
-            taken_block = new_taken_block;
-            not_taken_block = new_not_taken_block;
-          }
+  worker.module = semantics->Instantiate(worker.arch.get());
+  if (!worker.module) {
+    worker.ok = false;
+    return;
+  }
 
-          llvm::BranchInst::Create(taken_block, not_taken_block,
-                                   LoadBranchTaken(block), block);
-          break;
-        }
-        case Instruction::kCategoryConditionalIndirectJump: {
-          auto taken_block = llvm::BasicBlock::Create(context, "", func);
-          auto not_taken_block = GetOrCreateBranchNotTakenBlock();
-          const auto orig_not_taken_block = not_taken_block;
-
-          // If we might need to add delay slots, then try to lift the delayed
-          // instruction on each side of the conditional branch, injecting in
-          // new blocks (for the delayed instruction) between the branch
-          // and its original targets.
-          if (try_delay) {
-            not_taken_block = llvm::BasicBlock::Create(context, "", func);
-
-            try_add_delay_slot(true, taken_block);
-            try_add_delay_slot(false, not_taken_block);
-
-            llvm::BranchInst::Create(orig_not_taken_block, not_taken_block);
-          }
-
-          llvm::BranchInst::Create(taken_block, not_taken_block,
-                                   LoadBranchTaken(block), block);
-
-          AddTerminatingTailCall(taken_block, intrinsics->jump, *intrinsics);
-          block = orig_not_taken_block;
-          continue;
-        }
-      }
+  WorkerTraceManager worker_manager(manager, queue, worker.arch.get(),
+                                    worker.module.get());
+  TraceLifter lifter(worker.arch.get(), worker_manager);
+
+  while (auto addr = queue.Pop()) {
+    worker_manager.current_head = *addr;
+    if (!lifter.Lift(*addr)) {
+      worker.ok = false;
     }
+    queue.Done();
+  }
 
-    for (auto &block : *func) {
-      if (!block.getTerminator()) {
-        AddTerminatingTailCall(&block, intrinsics->missing_block, *intrinsics);
-      }
+  worker.traces = std::move(worker_manager.traces);
+  callback(worker.arch.get(), worker.module.get(), worker.traces);
+}
+
+bool ParallelTraceLifter::Impl::Lift(const std::vector<uint64_t> &addrs,
+                                     llvm::Module *dest_module,
+                                     WorkerModuleCallback callback) {
+  TraceHeadQueue queue;
+  for (auto addr : addrs) {
+    queue.Push(addr);
+  }
+
+  std::vector<std::unique_ptr<TraceLiftingWorker>> workers;
+  std::vector<std::thread> threads;
+  for (auto i = 0u; i < num_workers; ++i) {
+    auto &worker = workers.emplace_back(new TraceLiftingWorker);
+    threads.emplace_back([this, &worker, &queue, &callback] {
+      RunWorker(*worker, queue, callback);
+    });
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // Gather the traces of all workers in address order, so that the order of
+  // the functions in `dest_module` doesn't depend on which worker lifted what.
+  // Two workers can race to lift the same trace; both copies are the same, so
+  // keep either one.
+  auto ok = true;
+  std::map<uint64_t, llvm::Function *> traces;
+  for (auto &worker : workers) {
+    ok = ok && worker->ok;
+    traces.insert(worker->traces.begin(), worker->traces.end());
+  }
+
+  // Clone the lifted traces into the destination module. References between
+  // traces are declarations in the worker modules, and so resolve by name to
+  // the cloned definitions.
+  auto &dest_context = dest_module->getContext();
+  for (auto [addr, func] : traces) {
+    auto dest_func = dest_module->getFunction(func->getName());
+    if (!dest_func) {
+      auto func_type = llvm::dyn_cast<llvm::FunctionType>(
+          RecontextualizeType(func->getFunctionType(), dest_context));
+      dest_func = llvm::Function::Create(func_type,
+                                         llvm::GlobalValue::ExternalLinkage,
+                                         func->getName(), dest_module);
+
+    } else if (!dest_func->isDeclaration()) {
+      LOG(ERROR) << "Trace " << func->getName().str()
+                 << " is already defined in module "
+                 << ModuleName(dest_module);
+      continue;
     }
 
-    callback(trace_addr, func);
-    manager.SetLiftedTraceDefinition(trace_addr, func);
+    CloneFunctionInto(func, dest_func);
+    manager.SetLiftedTraceDefinition(addr, dest_func);
   }
 
-  return true;
+  return ok;
+}
+
+ParallelTraceLifter::~ParallelTraceLifter(void) {}
+
+ParallelTraceLifter::ParallelTraceLifter(
+    OSName os_name_, ArchName arch_name_, TraceManager *manager_,
+    unsigned num_workers_, std::shared_ptr<const SemanticsSnapshot> semantics_)
+    : impl(new Impl(os_name_, arch_name_, manager_, num_workers_,
+                    std::move(semantics_))) {}
+
+void ParallelTraceLifter::NullCallback(const Arch *, llvm::Module *,
+                                       const TraceMap &) {}
+
+// Lift the traces starting at `addrs`, along with any traces they reach.
+bool ParallelTraceLifter::Lift(const std::vector<uint64_t> &addrs,
+                               llvm::Module *dest_module,
+                               WorkerModuleCallback callback) {
+  return impl->Lift(addrs, dest_module, std::move(callback));
 }
 
 }  // namespace remill
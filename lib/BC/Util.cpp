@@ -21,6 +21,7 @@
 #include <sstream>
 #include <system_error>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -29,24 +30,31 @@
 #  include <unistd.h>
 #endif
 
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/ValueSymbolTable.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/Error.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 #include "remill/Arch/Arch.h"
 #include "remill/Arch/Name.h"
@@ -210,13 +218,20 @@ std::pair<llvm::Value *, llvm::Type *>
 FindVarInFunction(llvm::Function *function, std::string_view name_,
                   bool allow_failure) {
   llvm::StringRef name(name_.data(), name_.size());
+
+  // Local value names are unique within a function, so the function's symbol
+  // table is an index of the register variables in its entry block. LLVM keeps
+  // it up-to-date as values are created, renamed, and erased, so there is no
+  // need to scan the (often very large) entry block.
   if (!function->empty()) {
-    for (auto &instr : function->getEntryBlock()) {
-      if (instr.getName() == name) {
-        if (auto *alloca = llvm::dyn_cast<llvm::AllocaInst>(&instr)) {
+    if (auto symtab = function->getValueSymbolTable(); symtab) {
+      auto instr = llvm::dyn_cast_or_null<llvm::Instruction>(
+          symtab->lookup(name));
+      if (instr && instr->getParent() == &(function->getEntryBlock())) {
+        if (auto *alloca = llvm::dyn_cast<llvm::AllocaInst>(instr)) {
           return {alloca, alloca->getAllocatedType()};
         }
-        if (auto *gep = llvm::dyn_cast<llvm::GetElementPtrInst>(&instr)) {
+        if (auto *gep = llvm::dyn_cast<llvm::GetElementPtrInst>(instr)) {
           return {gep, gep->getResultElementType()};
         }
       }
@@ -371,9 +386,9 @@ std::unique_ptr<llvm::Module> LoadArchSemantics(const Arch *arch) {
   return LoadArchSemantics(arch, {});
 }
 
-std::unique_ptr<llvm::Module>
-LoadArchSemantics(const Arch *arch,
-                  const std::vector<std::filesystem::path> &sem_dirs) {
+// Find the semantics bitcode file of `arch`.
+static std::filesystem::path FindArchSemanticsBitcodeFile(
+    const Arch *arch, const std::vector<std::filesystem::path> &sem_dirs) {
   auto arch_name = GetArchName(arch->arch_name);
   // If `sem_dirs` does not contain the dir, fallback to compiled in paths.
   auto path = FindSemanticsBitcodeFile(arch_name, sem_dirs, true);
@@ -385,7 +400,14 @@ LoadArchSemantics(const Arch *arch,
                << " semantics bitcode file.";
 
   DLOG(INFO) << "Loading " << arch_name << " semantics from file " << *path;
-  auto module = LoadModuleFromFile(arch->context, *path);
+  return *path;
+}
+
+std::unique_ptr<llvm::Module>
+LoadArchSemantics(const Arch *arch,
+                  const std::vector<std::filesystem::path> &sem_dirs) {
+  auto path = FindArchSemanticsBitcodeFile(arch, sem_dirs);
+  auto module = LoadModuleFromFile(arch->context, path);
   arch->PrepareModule(module);
   arch->InitFromSemanticsModule(module.get());
   for (auto &func : *module) {
@@ -394,6 +416,119 @@ LoadArchSemantics(const Arch *arch,
   return module;
 }
 
+std::unique_ptr<llvm::Module>
+LoadArchSemanticsLazily(const Arch *arch,
+                        const std::vector<std::filesystem::path> &sem_dirs) {
+  auto path = FindArchSemanticsBitcodeFile(arch, sem_dirs);
+  auto module = LoadModuleFromFileLazily(arch->context, path);
+  CHECK(module) << "Unable to load semantics bitcode file " << path;
+  PrepareLazySemanticsModule(arch, module.get());
+  return module;
+}
+
+// Prepare the lazily loaded semantics module `module` for lifting code of
+// `arch`.
+void PrepareLazySemanticsModule(const Arch *arch, llvm::Module *module) {
+  arch->PrepareModule(module);
+  arch->InitFromSemanticsModule(module);
+
+  // Unmaterialized functions can't have metadata; they are annotated by
+  // `MaterializeSemantics` when their bodies are read in.
+  for (auto &func : *module) {
+    if (!func.isMaterializable()) {
+      Annotate<remill::Semantics>(&func);
+    }
+  }
+}
+
+// Read in the body of the lazily loaded semantics function `func`, as well as
+// the bodies of the lazily loaded functions that it transitively references.
+bool MaterializeSemantics(llvm::Function *func) {
+  if (!func->isMaterializable()) {
+    return true;
+  }
+
+  std::vector<llvm::Function *> work_list;
+  std::vector<llvm::Constant *> const_work_list;
+  std::unordered_set<llvm::Constant *> seen;
+
+  // Find the lazily loaded functions referenced by `val`, looking through
+  // constant expressions and the initializers of global variables.
+  auto find_funcs = [&](llvm::Value *val) {
+    auto c = llvm::dyn_cast<llvm::Constant>(val);
+    if (!c || !seen.insert(c).second) {
+      return;
+    }
+    const_work_list.push_back(c);
+    while (!const_work_list.empty()) {
+      c = const_work_list.back();
+      const_work_list.pop_back();
+
+      if (auto used_func = llvm::dyn_cast<llvm::Function>(c)) {
+        if (used_func->isMaterializable()) {
+          work_list.push_back(used_func);
+        }
+        continue;
+      }
+
+      if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(c)) {
+        if (var->hasInitializer() &&
+            seen.insert(var->getInitializer()).second) {
+          const_work_list.push_back(var->getInitializer());
+        }
+        continue;
+      }
+
+      for (auto &op : c->operands()) {
+        auto op_c = llvm::dyn_cast<llvm::Constant>(op.get());
+        if (op_c && seen.insert(op_c).second) {
+          const_work_list.push_back(op_c);
+        }
+      }
+    }
+  };
+
+  work_list.push_back(func);
+  while (!work_list.empty()) {
+    func = work_list.back();
+    work_list.pop_back();
+    if (!func->isMaterializable()) {
+      continue;
+    }
+
+    if (auto err = func->materialize()) {
+      LOG(ERROR) << "Unable to read in the body of " << func->getName().str()
+                 << ": " << llvm::toString(std::move(err));
+      return false;
+    }
+
+    Annotate<remill::Semantics>(func);
+
+    if (func->hasPersonalityFn()) {
+      find_funcs(func->getPersonalityFn());
+    }
+
+    for (auto &inst : llvm::instructions(func)) {
+      for (auto &op : inst.operands()) {
+        find_funcs(op.get());
+      }
+    }
+  }
+
+  return true;
+}
+
+// Turn every function in `module` whose body was never read in from bitcode
+// into an external declaration.
+void DeclareUnmaterializedFunctions(llvm::Module *module) {
+  for (auto &func : *module) {
+    if (func.isMaterializable()) {
+      func.deleteBody();  // Clears materializability, makes it external.
+      func.setComdat(nullptr);
+    }
+  }
+}
+
 std::optional<std::string> VerifyModuleMsg(llvm::Module *module) {
   std::string error;
   llvm::raw_string_ostream error_stream(error);
@@ -441,6 +576,43 @@ LoadModuleFromFile(llvm::LLVMContext *context,
   return module;
 }
 
+std::unique_ptr<llvm::Module>
+LoadModuleFromFileLazily(llvm::LLVMContext *context,
+                         std::filesystem::path file_name) {
+  auto maybe_buff = llvm::MemoryBuffer::getFile(
+      file_name.string(), false /* IsText */,
+      false /* RequiresNullTerminator */);
+  if (!maybe_buff) {
+    LOG(ERROR) << "Unable to open module file " << file_name << ": "
+               << maybe_buff.getError().message();
+    return {};
+  }
+
+  auto &buff = *maybe_buff;
+  auto buff_begin =
+      reinterpret_cast<const unsigned char *>(buff->getBufferStart());
+  auto buff_end = reinterpret_cast<const unsigned char *>(buff->getBufferEnd());
+  if (!llvm::isBitcode(buff_begin, buff_end)) {
+    return LoadModuleFromFile(context, file_name);
+  }
+
+  auto maybe_module =
+      llvm::getOwningLazyBitcodeModule(std::move(buff), *context);
+  if (!maybe_module) {
+    LOG(ERROR) << "Unable to parse module file " << file_name << ": "
+               << llvm::toString(maybe_module.takeError());
+    return {};
+  }
+
+  auto module = std::move(*maybe_module);
+  if (!VerifyModule(module.get())) {
+    LOG(ERROR) << "Error verifying module read from file " << file_name;
+    return {};
+  }
+
+  return module;
+}
+
 // Store an LLVM module into a file.
 bool StoreModuleToFile(llvm::Module *module, std::string_view file_name,
                        bool allow_failure) {
@@ -753,6 +925,44 @@ static llvm::Constant *CloneConstant(llvm::Constant *val) {
 
 #endif
 
+// Returns a copy of `attrs` in `context`. Attribute lists are uniqued per
+// context, so they can't be shared across contexts like they can be across
+// modules of the same context.
+static llvm::AttributeList
+RecontextualizeAttributes(llvm::AttributeList attrs,
+                          llvm::LLVMContext &context) {
+  if (attrs.isEmpty() || attrs.hasParentContext(context)) {
+    return attrs;
+  }
+
+  auto convert = [&context](llvm::AttributeSet set) {
+    llvm::AttrBuilder builder(context);
+    for (auto attr : set) {
+      if (attr.isStringAttribute()) {
+        builder.addAttribute(attr.getKindAsString(), attr.getValueAsString());
+      } else if (attr.isTypeAttribute()) {
+        builder.addTypeAttr(
+            attr.getKindAsEnum(),
+            RecontextualizeType(attr.getValueAsType(), context));
+      } else if (attr.isIntAttribute()) {
+        builder.addRawIntAttr(attr.getKindAsEnum(), attr.getValueAsInt());
+      } else {
+        builder.addAttribute(attr.getKindAsEnum());
+      }
+    }
+    return llvm::AttributeSet::get(context, builder);
+  };
+
+  // The first two sets are those of the function and of its return value.
+  llvm::SmallVector<llvm::AttributeSet, 8> param_attrs;
+  for (auto i = 2u; i < attrs.getNumAttrSets(); ++i) {
+    param_attrs.push_back(convert(attrs.getParamAttrs(i - 2u)));
+  }
+
+  return llvm::AttributeList::get(context, convert(attrs.getFnAttrs()),
+                                  convert(attrs.getRetAttrs()), param_attrs);
+}
+
 static llvm::Function *DeclareFunctionInModule(llvm::Function *func,
                                                llvm::Module *dest_module,
                                                ValueMap &value_map) {
@@ -783,6 +993,8 @@ static llvm::Function *DeclareFunctionInModule(llvm::Function *func,
                                      func->getName(), dest_module);
 
   dest_func->copyAttributesFrom(func);
+  dest_func->setAttributes(RecontextualizeAttributes(
+      func->getAttributes(), dest_module->getContext()));
   dest_func->setVisibility(func->getVisibility());
   dest_func->setCallingConv(func->getCallingConv());
   if (func->hasSection()) {
@@ -1509,6 +1721,8 @@ static void MoveInstructionIntoModule(llvm::Instruction *inst,
 
     // Substitute the called function.
   } else if (auto call = llvm::dyn_cast<llvm::CallInst>(inst)) {
+    call->setAttributes(RecontextualizeAttributes(call->getAttributes(),
+                                                  dest_module->getContext()));
     if (auto callee_func = call->getCalledFunction()) {
       if (callee_func->getParent() != dest_module) {
         call->setCalledFunction(
@@ -1619,7 +1833,8 @@ void CloneFunctionInto(llvm::Function *source_func, llvm::Function *dest_func,
   // throw away register names and such.
   dest_func->getContext().setDiscardValueNames(false);
 
-  dest_func->setAttributes(source_func->getAttributes());
+  dest_func->setAttributes(
+      RecontextualizeAttributes(source_func->getAttributes(), dest_context));
   dest_func->setLinkage(source_func->getLinkage());
   dest_func->setVisibility(source_func->getVisibility());
   dest_func->setCallingConv(source_func->getCallingConv());
@@ -1778,6 +1993,182 @@ unsigned ReplaceAllUsesOfConstant(llvm::Constant *old_c, llvm::Constant *new_c,
   return num_const_uses;
 }
 
+// Clone `funcs`, along with every function and variable that they
+// transitively reference, into a new module in the same context. Everything
+// else in the source module is left out, so the clone stays small even when
+// the source is a whole semantics module. All of `funcs` must belong to the
+// same module.
+std::unique_ptr<llvm::Module>
+CloneFunctionsWithDependencies(const std::vector<llvm::Function *> &funcs) {
+  CHECK(!funcs.empty());
+  const auto module = funcs.front()->getParent();
+
+  // Find everything reachable from `funcs`, looking through constant
+  // expressions and the initializers of variables.
+  llvm::SmallPtrSet<const llvm::GlobalValue *, 32> live;
+  llvm::SmallPtrSet<const llvm::Constant *, 32> seen_consts;
+  std::vector<const llvm::GlobalValue *> work_list;
+  std::vector<const llvm::Constant *> const_work_list;
+
+  auto visit_value = [&](const llvm::Value *val) {
+    if (auto gv = llvm::dyn_cast<llvm::GlobalValue>(val)) {
+      if (live.insert(gv).second) {
+        work_list.push_back(gv);
+      }
+    } else if (auto c = llvm::dyn_cast<llvm::Constant>(val)) {
+      if (seen_consts.insert(c).second) {
+        const_work_list.push_back(c);
+      }
+    }
+  };
+
+  for (auto func : funcs) {
+    CHECK_EQ(func->getParent(), module);
+    visit_value(func);
+  }
+
+  while (!work_list.empty() || !const_work_list.empty()) {
+    if (!const_work_list.empty()) {
+      auto c = const_work_list.back();
+      const_work_list.pop_back();
+      for (auto &op : c->operands()) {
+        visit_value(op.get());
+      }
+      continue;
+    }
+
+    auto gv = work_list.back();
+    work_list.pop_back();
+    if (auto func = llvm::dyn_cast<llvm::Function>(gv)) {
+      if (func->hasPersonalityFn()) {
+        visit_value(func->getPersonalityFn());
+      }
+      for (auto &inst : llvm::instructions(func)) {
+        for (auto &op : inst.operands()) {
+          visit_value(op.get());
+        }
+      }
+    } else if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(gv)) {
+      if (var->hasInitializer()) {
+        visit_value(var->getInitializer());
+      }
+    } else if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(gv)) {
+      visit_value(alias->getAliasee());
+    }
+  }
+
+  // Only create what is live. `llvm::CloneModule` would also declare every
+  // other global of `module`, which costs as much as the rest of the clone
+  // when `module` is a semantics module with thousands of functions.
+  auto clone = std::make_unique<llvm::Module>(module->getModuleIdentifier(),
+                                              module->getContext());
+  clone->setSourceFileName(module->getSourceFileName());
+  clone->setDataLayout(module->getDataLayout());
+  clone->setTargetTriple(module->getTargetTriple());
+  clone->setModuleInlineAsm(module->getModuleInlineAsm());
+
+  llvm::ValueToValueMapTy value_map;
+  auto copy_comdat = [&clone](llvm::GlobalObject *dest,
+                              const llvm::GlobalObject *source) {
+    if (auto comdat = source->getComdat()) {
+      auto dest_comdat = clone->getOrInsertComdat(comdat->getName());
+      dest_comdat->setSelectionKind(comdat->getSelectionKind());
+      dest->setComdat(dest_comdat);
+    }
+  };
+
+  // Declare everything first, so that definitions can refer to each other.
+  for (auto &var : module->globals()) {
+    if (live.count(&var)) {
+      auto dest_var = new llvm::GlobalVariable(
+          *clone, var.getValueType(), var.isConstant(), var.getLinkage(),
+          nullptr, var.getName(), nullptr, var.getThreadLocalMode(),
+          var.getType()->getAddressSpace());
+      dest_var->copyAttributesFrom(&var);
+      value_map[&var] = dest_var;
+    }
+  }
+
+  for (auto &func : module->functions()) {
+    if (live.count(&func)) {
+      auto dest_func = llvm::Function::Create(
+          func.getFunctionType(), func.getLinkage(), func.getAddressSpace(),
+          func.getName(), clone.get());
+      dest_func->copyAttributesFrom(&func);
+      value_map[&func] = dest_func;
+    }
+  }
+
+  for (auto &alias : module->aliases()) {
+    if (live.count(&alias)) {
+      auto dest_alias = llvm::GlobalAlias::create(
+          alias.getValueType(), alias.getType()->getPointerAddressSpace(),
+          alias.getLinkage(), alias.getName(), clone.get());
+      dest_alias->copyAttributesFrom(&alias);
+      value_map[&alias] = dest_alias;
+    }
+  }
+
+  // Then define them.
+  for (auto &var : module->globals()) {
+    if (!live.count(&var)) {
+      continue;
+    }
+    auto dest_var = llvm::cast<llvm::GlobalVariable>(value_map[&var]);
+    llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 1> mds;
+    var.getAllMetadata(mds);
+    for (auto [md_id, md] : mds) {
+      dest_var->addMetadata(md_id, *llvm::MapMetadata(md, value_map));
+    }
+    if (var.hasInitializer()) {
+      dest_var->setInitializer(llvm::MapValue(var.getInitializer(), value_map));
+    }
+    copy_comdat(dest_var, &var);
+  }
+
+  for (auto &func : module->functions()) {
+    if (!live.count(&func)) {
+      continue;
+    }
+    auto dest_func = llvm::cast<llvm::Function>(value_map[&func]);
+    if (func.isDeclaration()) {
+      continue;
+    }
+
+    auto dest_arg = dest_func->arg_begin();
+    for (auto &arg : func.args()) {
+      dest_arg->setName(arg.getName());
+      value_map[&arg] = &*dest_arg++;
+    }
+
+    llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+    llvm::CloneFunctionInto(dest_func, &func, value_map,
+                            llvm::CloneFunctionChangeType::ClonedModule,
+                            returns);
+    if (func.hasPersonalityFn()) {
+      dest_func->setPersonalityFn(
+          llvm::MapValue(func.getPersonalityFn(), value_map));
+    }
+    copy_comdat(dest_func, &func);
+  }
+
+  for (auto &alias : module->aliases()) {
+    if (live.count(&alias)) {
+      llvm::cast<llvm::GlobalAlias>(value_map[&alias])
+          ->setAliasee(llvm::MapValue(alias.getAliasee(), value_map));
+    }
+  }
+
+  for (auto &named_md : module->named_metadata()) {
+    auto dest_named_md = clone->getOrInsertNamedMetadata(named_md.getName());
+    for (auto md : named_md.operands()) {
+      dest_named_md->addOperand(llvm::MapMetadata(md, value_map));
+    }
+  }
+
+  return clone;
+}
+
 // Move a function from one module into another module.
 //
 // TODO(pag): Make this work across distinct `llvm::LLVMContext`s.
@@ -1884,6 +2275,144 @@ llvm::Type *RecontextualizeType(llvm::Type *type, llvm::LLVMContext &context) {
   return RecontextualizeType(type, context, cache);
 }
 
+namespace {
+
+// Returns `true` if values of `type` can be moved to and from memory as a
+// sequence of equally-sized integer chunks, and then bitcast to `type`.
+static bool CanAccessInChunks(const llvm::DataLayout &dl, llvm::Type *type) {
+  if (type->isIntegerTy() || type->isFP128Ty() || type->isPPC_FP128Ty()) {
+    return true;
+  }
+
+  // Vectors are tightly packed in memory, so their elements can't be padded,
+  // and must be whole bytes.
+  if (auto vec_type = llvm::dyn_cast<llvm::FixedVectorType>(type)) {
+    const auto elem_type = vec_type->getElementType();
+    const auto elem_bits = dl.getTypeSizeInBits(elem_type);
+    return (elem_type->isIntegerTy() || elem_type->isHalfTy() ||
+            elem_type->isFloatTy() || elem_type->isDoubleTy() ||
+            elem_type->isFP128Ty()) &&
+           elem_bits == dl.getTypeAllocSizeInBits(elem_type) &&
+           !(elem_bits % 8u);
+  }
+
+  return false;
+}
+
+// Returns the chunk type used to access `size` bytes of memory: a vector of
+// the widest integers handled by the memory intrinsics that evenly divide
+// `size`, or just one such integer. A vector of chunks has the same layout in
+// memory as the chunks read one after the other, regardless of endianness,
+// so it can be bitcast to any other type of the same size.
+static llvm::Type *ChunkedType(llvm::LLVMContext &context, uint64_t size) {
+  uint64_t chunk_size = 8u;
+  while (size % chunk_size) {
+    chunk_size /= 2u;
+  }
+  auto chunk_type =
+      llvm::Type::getIntNTy(context, static_cast<unsigned>(chunk_size * 8u));
+  if (size == chunk_size) {
+    return chunk_type;
+  }
+  return llvm::FixedVectorType::get(chunk_type,
+                                    static_cast<unsigned>(size / chunk_size));
+}
+
+// Read `size` bytes of memory at `addr`, as a value of `ChunkedType`.
+static llvm::Value *LoadChunksFromMemory(const IntrinsicTable &intrinsics,
+                                         llvm::IRBuilder<> &ir, uint64_t size,
+                                         llvm::Value *mem_ptr,
+                                         llvm::Value *addr) {
+  const auto type = ChunkedType(ir.getContext(), size);
+  const auto chunk_type = type->getScalarType();
+  const auto chunk_size = chunk_type->getIntegerBitWidth() / 8u;
+
+  llvm::Function *read_func = nullptr;
+  switch (chunk_size) {
+    case 1: read_func = intrinsics.read_memory_8; break;
+    case 2: read_func = intrinsics.read_memory_16; break;
+    case 4: read_func = intrinsics.read_memory_32; break;
+    default: read_func = intrinsics.read_memory_64; break;
+  }
+
+  llvm::Value *val = llvm::UndefValue::get(type);
+  for (uint64_t offset = 0; offset < size; offset += chunk_size) {
+    llvm::Value *args_2[2] = {
+        mem_ptr,
+        ir.CreateAdd(addr, llvm::ConstantInt::get(addr->getType(), offset))};
+    auto chunk = ir.CreateCall(read_func, args_2);
+    if (!type->isVectorTy()) {
+      return chunk;
+    }
+    val = ir.CreateInsertElement(val, chunk, offset / chunk_size);
+  }
+  return val;
+}
+
+// Write `val`, a value of `ChunkedType`, to memory at `addr`. Returns the new
+// value of the memory pointer.
+static llvm::Value *StoreChunksToMemory(const IntrinsicTable &intrinsics,
+                                        llvm::IRBuilder<> &ir, llvm::Value *val,
+                                        llvm::Value *mem_ptr,
+                                        llvm::Value *addr) {
+  const auto type = val->getType();
+  const auto chunk_type = type->getScalarType();
+  const auto chunk_size = chunk_type->getIntegerBitWidth() / 8u;
+  uint64_t num_chunks = 1u;
+  if (auto vec_type = llvm::dyn_cast<llvm::FixedVectorType>(type)) {
+    num_chunks = vec_type->getNumElements();
+  }
+
+  llvm::Function *write_func = nullptr;
+  switch (chunk_size) {
+    case 1: write_func = intrinsics.write_memory_8; break;
+    case 2: write_func = intrinsics.write_memory_16; break;
+    case 4: write_func = intrinsics.write_memory_32; break;
+    default: write_func = intrinsics.write_memory_64; break;
+  }
+
+  for (uint64_t i = 0; i < num_chunks; ++i) {
+    llvm::Value *args_3[3] = {
+        mem_ptr,
+        ir.CreateAdd(addr,
+                     llvm::ConstantInt::get(addr->getType(), i * chunk_size)),
+        type->isVectorTy() ? ir.CreateExtractElement(val, i) : val};
+    mem_ptr = ir.CreateCall(write_func, args_3);
+  }
+  return mem_ptr;
+}
+
+// Load a value of `type` as a sequence of chunks. `CanAccessInChunks` must
+// hold for `type`.
+static llvm::Value *LoadInChunks(const IntrinsicTable &intrinsics,
+                                 const llvm::DataLayout &dl,
+                                 llvm::IRBuilder<> &ir, llvm::Type *type,
+                                 llvm::Value *mem_ptr, llvm::Value *addr) {
+  const auto size = dl.getTypeStoreSize(type);
+  auto val = LoadChunksFromMemory(intrinsics, ir, size, mem_ptr, addr);
+  if (type->isIntegerTy()) {
+    val = ir.CreateBitCast(val, ir.getIntNTy(size * 8u));
+    return ir.CreateTrunc(val, type);
+  }
+  return ir.CreateBitCast(val, type);
+}
+
+// Store `val` as a sequence of chunks. `CanAccessInChunks` must hold for its
+// type. Returns the new value of the memory pointer.
+static llvm::Value *StoreInChunks(const IntrinsicTable &intrinsics,
+                                  const llvm::DataLayout &dl,
+                                  llvm::IRBuilder<> &ir, llvm::Value *val,
+                                  llvm::Value *mem_ptr, llvm::Value *addr) {
+  const auto size = dl.getTypeStoreSize(val->getType());
+  if (val->getType()->isIntegerTy()) {
+    val = ir.CreateZExt(val, ir.getIntNTy(size * 8u));
+  }
+  val = ir.CreateBitCast(val, ChunkedType(ir.getContext(), size));
+  return StoreChunksToMemory(intrinsics, ir, val, mem_ptr, addr);
+}
+
+}  // namespace
+
 // Produce a sequence of instructions that will load values from
 // memory, building up the correct type. This will invoke the various
 // memory read intrinsics in order to match the right type, or
@@ -1895,9 +2424,8 @@ llvm::Value *LoadFromMemory(const IntrinsicTable &intrinsics,
   const auto initial_addr = addr;
   auto module = intrinsics.error->getParent();
   auto &context = module->getContext();
-  llvm::DataLayout dl(module);
+  const auto &dl = module->getDataLayout();
   llvm::Value *args_2[2] = {mem_ptr, addr};
-  auto index_type = llvm::Type::getIntNTy(context, dl.getPointerSizeInBits(0));
 
   llvm::IRBuilder<> ir(block);
 
@@ -1929,43 +2457,20 @@ llvm::Value *LoadFromMemory(const IntrinsicTable &intrinsics,
                               type);
 
     case llvm::Type::IntegerTyID:
-      switch (dl.getTypeAllocSize(type)) {
-        case 1: return ir.CreateCall(intrinsics.read_memory_8, args_2);
-        case 2: return ir.CreateCall(intrinsics.read_memory_16, args_2);
-        case 4: return ir.CreateCall(intrinsics.read_memory_32, args_2);
-        case 8: return ir.CreateCall(intrinsics.read_memory_64, args_2);
+      switch (type->getIntegerBitWidth()) {
+        case 8: return ir.CreateCall(intrinsics.read_memory_8, args_2);
+        case 16: return ir.CreateCall(intrinsics.read_memory_16, args_2);
+        case 32: return ir.CreateCall(intrinsics.read_memory_32, args_2);
+        case 64: return ir.CreateCall(intrinsics.read_memory_64, args_2);
         default: break;
       }
       [[clang::fallthrough]];
 
+    // Large integers and floats are read in chunks that are as wide as
+    // possible, and then bitcast to the right type.
     case llvm::Type::FP128TyID:
-    case llvm::Type::PPC_FP128TyID: {
-      const auto size = dl.getTypeAllocSize(type);
-      auto res = ir.CreateAlloca(type);
-
-      auto i8_array =
-          llvm::ArrayType::get(llvm::Type::getInt8Ty(context), size);
-      auto byte_array =
-          ir.CreateBitCast(res, llvm::PointerType::get(context, 0));
-
-      auto gep_zero = llvm::ConstantInt::get(index_type, 0, false);
-      // Load one byte at a time from memory, and store it into
-      // `res`.
-      for (auto i = 0U; i < size; ++i) {
-        llvm::Value *gep_indices[2] = {
-            gep_zero, llvm::ConstantInt::get(index_type, i, false)};
-        auto call_arg_addr = ir.CreateAdd(
-            addr, llvm::ConstantInt::get(addr->getType(), i, false));
-        llvm::Value *call_args[2] = {mem_ptr, call_arg_addr};
-        auto byte = ir.CreateCall(intrinsics.read_memory_8,
-                                  llvm::makeArrayRef(call_args));
-        auto byte_ptr = ir.CreateInBoundsGEP(i8_array, byte_array,
-                                             llvm::makeArrayRef(gep_indices));
-        ir.CreateStore(byte, byte_ptr);
-      }
-
-      return ir.CreateLoad(type, res);
-    }
+    case llvm::Type::PPC_FP128TyID:
+      return LoadInChunks(intrinsics, dl, ir, type, mem_ptr, addr);
 
     // Building up a structure requires us to start with an undef value,
     // then inject each element value one at a time.
@@ -1996,6 +2501,23 @@ llvm::Value *LoadFromMemory(const IntrinsicTable &intrinsics,
       const auto elem_size = dl.getTypeAllocSize(elem_type);
       llvm::Value *val = llvm::UndefValue::get(type);
 
+      // Arrays of scalars are laid out like vectors of them, so read them as
+      // one vector, and then split it up.
+      if (1u < num_elems && num_elems <= UINT32_MAX &&
+          llvm::FixedVectorType::isValidElementType(elem_type)) {
+        auto vec_type = llvm::FixedVectorType::get(
+            elem_type, static_cast<unsigned>(num_elems));
+        if (CanAccessInChunks(dl, vec_type)) {
+          auto vec = LoadInChunks(intrinsics, dl, ir, vec_type, mem_ptr, addr);
+          for (unsigned index = 0; index < num_elems; ++index) {
+            unsigned indexes[] = {index};
+            val = ir.CreateInsertValue(
+                val, ir.CreateExtractElement(vec, index), indexes);
+          }
+          return val;
+        }
+      }
+
       for (uint64_t index = 0, offset = 0; index < num_elems;
            ++index, offset += elem_size) {
         addr = ir.CreateAdd(initial_addr, llvm::ConstantInt::get(
@@ -2022,8 +2544,13 @@ llvm::Value *LoadFromMemory(const IntrinsicTable &intrinsics,
       return ir.CreateIntToPtr(addr_val, ptr_type);
     }
 
-    // Build up the vector in the nearly the same was as we do with arrays.
+    // Build up the vector in the nearly the same was as we do with arrays,
+    // unless it can be read in wide chunks.
     case llvm::Type::FixedVectorTyID: {
+      if (CanAccessInChunks(dl, type)) {
+        return LoadInChunks(intrinsics, dl, ir, type, mem_ptr, addr);
+      }
+
       auto vec_type = llvm::dyn_cast<llvm::FixedVectorType>(type);
       const auto num_elems = vec_type->getNumElements();
       const auto elem_type = vec_type->getElementType();
@@ -2068,9 +2595,8 @@ llvm::Value *StoreToMemory(const IntrinsicTable &intrinsics,
   const auto initial_addr = addr;
   auto module = intrinsics.error->getParent();
   auto &context = module->getContext();
-  llvm::DataLayout dl(module);
+  const auto &dl = module->getDataLayout();
   llvm::Value *args_3[3] = {mem_ptr, addr, val_to_store};
-  auto index_type = llvm::Type::getInt32Ty(context);
 
   llvm::IRBuilder<> ir(block);
 
@@ -2109,44 +2635,20 @@ llvm::Value *StoreToMemory(const IntrinsicTable &intrinsics,
     }
 
     case llvm::Type::IntegerTyID:
-      switch (dl.getTypeAllocSize(type)) {
-        case 1: return ir.CreateCall(intrinsics.write_memory_8, args_3);
-        case 2: return ir.CreateCall(intrinsics.write_memory_16, args_3);
-        case 4: return ir.CreateCall(intrinsics.write_memory_32, args_3);
-        case 8: return ir.CreateCall(intrinsics.write_memory_64, args_3);
+      switch (type->getIntegerBitWidth()) {
+        case 8: return ir.CreateCall(intrinsics.write_memory_8, args_3);
+        case 16: return ir.CreateCall(intrinsics.write_memory_16, args_3);
+        case 32: return ir.CreateCall(intrinsics.write_memory_32, args_3);
+        case 64: return ir.CreateCall(intrinsics.write_memory_64, args_3);
         default: break;
       }
       [[clang::fallthrough]];
 
+    // Large integers and floats are bitcast into chunks that are as wide as
+    // possible, and then written one chunk at a time.
     case llvm::Type::FP128TyID:
-    case llvm::Type::PPC_FP128TyID: {
-      const auto size = dl.getTypeAllocSize(type);
-
-      // Stack-allocate the value, so we can pull out one byte
-      // at a time from it, and then write it into the target
-      // address space.
-      auto res = ir.CreateAlloca(type);
-      ir.CreateStore(val_to_store, res);
-
-      auto i8 = llvm::Type::getInt8Ty(context);
-      auto i8_array = llvm::ArrayType::get(i8, size);
-      auto byte_array =
-          ir.CreateBitCast(res, llvm::PointerType::get(context, 0));
-      llvm::Value *gep_indices[2] = {
-          llvm::ConstantInt::get(index_type, 0, false), nullptr};
-
-      // Store one byte at a time to memory.
-      for (auto i = 0U; i < size; ++i) {
-        args_3[1] = ir.CreateAdd(
-            addr, llvm::ConstantInt::get(addr->getType(), i, false));
-        gep_indices[1] = llvm::ConstantInt::get(index_type, i, false);
-        auto byte_ptr = ir.CreateInBoundsGEP(i8_array, byte_array, gep_indices);
-        args_3[2] = ir.CreateLoad(i8, byte_ptr);
-        args_3[0] = ir.CreateCall(intrinsics.write_memory_8, args_3);
-      }
-
-      return args_3[0];
-    }
+    case llvm::Type::PPC_FP128TyID:
+      return StoreInChunks(intrinsics, dl, ir, val_to_store, mem_ptr, addr);
 
     // Store a structure by storing the individual elements of the structure.
     case llvm::Type::StructTyID: {
@@ -2174,6 +2676,23 @@ llvm::Value *StoreToMemory(const IntrinsicTable &intrinsics,
       const auto elem_type = arr_type->getElementType();
       const auto elem_size = dl.getTypeAllocSize(elem_type);
 
+      // Arrays of scalars are laid out like vectors of them, so gather them
+      // into one vector, and write that.
+      if (1u < num_elems && num_elems <= UINT32_MAX &&
+          llvm::FixedVectorType::isValidElementType(elem_type)) {
+        auto vec_type = llvm::FixedVectorType::get(
+            elem_type, static_cast<unsigned>(num_elems));
+        if (CanAccessInChunks(dl, vec_type)) {
+          llvm::Value *vec = llvm::UndefValue::get(vec_type);
+          for (unsigned index = 0; index < num_elems; ++index) {
+            unsigned indexes[] = {index};
+            vec = ir.CreateInsertElement(
+                vec, ir.CreateExtractValue(val_to_store, indexes), index);
+          }
+          return StoreInChunks(intrinsics, dl, ir, vec, mem_ptr, addr);
+        }
+      }
+
       for (uint64_t index = 0, offset = 0; index < num_elems;
            ++index, offset += elem_size) {
 
@@ -2185,8 +2704,6 @@ llvm::Value *StoreToMemory(const IntrinsicTable &intrinsics,
         mem_ptr =
             StoreToMemory(intrinsics, block, elem_val, mem_ptr, elem_addr);
         ir.SetInsertPoint(block);
-        offset += elem_size;
-        index += 1;
       }
       return mem_ptr;
     }
@@ -2203,8 +2720,13 @@ llvm::Value *StoreToMemory(const IntrinsicTable &intrinsics,
                            mem_ptr, addr);
     }
 
-    // Build up the vector store in the nearly the same was as we do with arrays.
+    // Build up the vector store in the nearly the same was as we do with arrays,
+    // unless it can be written in wide chunks.
     case llvm::Type::FixedVectorTyID: {
+      if (CanAccessInChunks(dl, type)) {
+        return StoreInChunks(intrinsics, dl, ir, val_to_store, mem_ptr, addr);
+      }
+
       auto vec_type = llvm::dyn_cast<llvm::FixedVectorType>(type);
       const auto num_elems = vec_type->getNumElements();
       const auto elem_type = vec_type->getElementType();
@@ -2221,8 +2743,6 @@ llvm::Value *StoreToMemory(const IntrinsicTable &intrinsics,
         mem_ptr =
             StoreToMemory(intrinsics, block, elem_val, mem_ptr, elem_addr);
         ir.SetInsertPoint(block);
-        offset += elem_size;
-        index += 1;
       }
 
       return mem_ptr;
@@ -16,10 +16,11 @@
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/GenericValue.h>
-#include <llvm/ExecutionEngine/Interpreter.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Passes/PassBuilder.h>
@@ -55,40 +56,124 @@ uint8_t random_boolean_flag(random_bytes_engine &rbe) {
   return gen(rbe);
 }
 
-void *MissingFunctionStub(const std::string &name) {
-  if (auto res = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(name)) {
-    return res;
+bool PagedMemory::Page::IsInitialized(uint64_t offset, size_t size) const {
+  for (auto i = offset; i < offset + size; ++i) {
+    if (!((this->initialized[i / 64u] >> (i % 64u)) & 1u)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void PagedMemory::Page::MarkInitialized(uint64_t offset, size_t size) {
+  for (auto i = offset; i < offset + size; ++i) {
+    this->initialized[i / 64u] |= uint64_t(1) << (i % 64u);
+  }
+}
+
+const PagedMemory::Page *PagedMemory::FindPage(uint64_t addr) const {
+  auto page_it = this->pages.find(addr / kPageSize);
+  if (page_it == this->pages.end()) {
+    return nullptr;
+  }
+  return page_it->second.get();
+}
+
+PagedMemory::Page *PagedMemory::GetPageForWrite(uint64_t addr) {
+  auto &page = this->pages[addr / kPageSize];
+  if (!page) {
+    page = std::make_shared<Page>();
+  } else if (page.use_count() > 1) {
+    page = std::make_shared<Page>(*page);
+  }
+  return page.get();
+}
+
+bool PagedMemory::TryReadByte(uint64_t addr, uint8_t *byte) const {
+  auto page = this->FindPage(addr);
+  const auto offset = addr % kPageSize;
+  if (!page || !page->IsInitialized(offset, 1u)) {
+    return false;
+  }
+  *byte = page->bytes[offset];
+  return true;
+}
+
+const uint8_t *PagedMemory::TryGetBytes(uint64_t addr, size_t size) const {
+  const auto offset = addr % kPageSize;
+  if ((offset + size) > kPageSize) {
+    return nullptr;
+  }
+  auto page = this->FindPage(addr);
+  if (!page || !page->IsInitialized(offset, size)) {
+    return nullptr;
+  }
+  return &(page->bytes[offset]);
+}
+
+uint8_t *PagedMemory::GetBytesForWrite(uint64_t addr, size_t size) {
+  const auto offset = addr % kPageSize;
+  if ((offset + size) > kPageSize) {
+    return nullptr;
+  }
+  auto page = this->GetPageForWrite(addr);
+  page->MarkInitialized(offset, size);
+  return &(page->bytes[offset]);
+}
+
+void PagedMemory::WriteByte(uint64_t addr, uint8_t byte) {
+  *(this->GetBytesForWrite(addr, 1u)) = byte;
+}
+
+void PagedMemory::ForEachByte(
+    const std::function<void(uint64_t addr, uint8_t byte)> &callback) const {
+  for (const auto &[page_num, page] : this->pages) {
+    for (uint64_t offset = 0; offset < kPageSize; ++offset) {
+      if (page->IsInitialized(offset, 1u)) {
+        callback(page_num * kPageSize + offset, page->bytes[offset]);
+      }
+    }
+  }
+}
+
+bool PagedMemory::operator==(const PagedMemory &that) const {
+  if (this->pages.size() != that.pages.size()) {
+    return false;
   }
 
-#ifdef __APPLE__
-  if (name.at(0) == '_') {
-    if (auto res = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
-            name.substr(1, name.length()))) {
-      return res;
+  // Uninitialized bytes are always zero, so pages can be compared wholesale.
+  // Pages still shared with a snapshot are trivially equal.
+  for (const auto &[page_num, page] : this->pages) {
+    auto that_page_it = that.pages.find(page_num);
+    if (that_page_it == that.pages.end()) {
+      return false;
+    }
+    const auto &that_page = that_page_it->second;
+    if (page != that_page && (page->initialized != that_page->initialized ||
+                              page->bytes != that_page->bytes)) {
+      return false;
     }
   }
-#endif
-  LOG(FATAL) << "Missing function: " << name;
-  return nullptr;
+  return true;
 }
 
 MemoryHandler::MemoryHandler(llvm::support::endianness endian_)
     : endian(endian_) {}
 
-MemoryHandler::MemoryHandler(
-    llvm::support::endianness endian_,
-    std::unordered_map<uint64_t, uint8_t> initial_state)
+MemoryHandler::MemoryHandler(llvm::support::endianness endian_,
+                             PagedMemory initial_state)
     : state(std::move(initial_state)),
       endian(endian_) {}
 
 uint8_t MemoryHandler::read_byte(uint64_t addr) {
-  if (state.find(addr) != state.end()) {
-    return state.find(addr)->second;
+  uint8_t byte = 0;
+  if (this->state.TryReadByte(addr, &byte)) {
+    return byte;
   }
 
   auto genned = rbe();
-  uninitialized_reads.insert({addr, genned});
-  state.insert({addr, genned});
+  uninitialized_reads.WriteByte(addr, genned);
+  state.WriteByte(addr, genned);
   return genned;
 }
 
@@ -100,18 +185,18 @@ std::vector<uint8_t> MemoryHandler::readSize(uint64_t addr, size_t num) {
   return bytes;
 }
 
-const std::unordered_map<uint64_t, uint8_t> &MemoryHandler::GetMemory() const {
+const PagedMemory &MemoryHandler::GetMemory() const {
   return this->state;
 }
 
 std::string MemoryHandler::DumpState() const {
 
   llvm::json::Object mapping;
-  for (const auto &kv : this->state) {
+  this->state.ForEachByte([&mapping](uint64_t addr, uint8_t byte) {
     std::stringstream ss;
-    ss << kv.first;
-    mapping[ss.str()] = kv.second;
-  }
+    ss << addr;
+    mapping[ss.str()] = byte;
+  });
 
   std::string res;
   llvm::json::Value v(std::move(mapping));
@@ -121,24 +206,26 @@ std::string MemoryHandler::DumpState() const {
   return ss.str();
 }
 
-template <class T>
-T MemoryHandler::ReadMemory(uint64_t addr) {
-  auto buff = this->readSize(addr, sizeof(T));
-  return llvm::support::endian::read<T>(buff.data(), this->endian);
+const PagedMemory &MemoryHandler::GetUninitializedReads() const {
+  return this->uninitialized_reads;
 }
 
+void MemoryHandler::EnableTracing(bool enable) {
+  this->is_tracing = enable;
+}
 
-template <class T>
-void MemoryHandler::WriteMemory(uint64_t addr, T value) {
-  std::vector<uint8_t> buff(sizeof(T));
-  llvm::support::endian::write<T>(buff.data(), value, this->endian);
-  for (size_t i = 0; i < sizeof(T); i++) {
-    this->state[addr + i] = buff[i];
-  }
+const std::vector<MemoryAccess> &MemoryHandler::GetTrace() const {
+  return this->trace;
 }
 
-std::unordered_map<uint64_t, uint8_t> MemoryHandler::GetUninitializedReads() {
-  return this->uninitialized_reads;
+std::string MemoryHandler::DumpTrace() const {
+  std::stringstream ss;
+  for (const auto &access : this->trace) {
+    ss << (access.is_write ? "Write " : "Read ") << std::dec
+       << (access.size * 8u) << " bits at " << std::hex << access.addr
+       << ": " << access.value << '\n';
+  }
+  return ss.str();
 }
 
 
@@ -148,56 +235,41 @@ uint8_t __remill_undefined_8(void) {
 }
 
 uint8_t __remill_read_memory_8(MemoryHandler *memory, uint64_t addr) {
-  LOG(INFO) << "Reading " << std::hex << addr;
-  auto res = memory->ReadMemory<uint8_t>(addr);
-  LOG(INFO) << "Read memory " << res;
-  return res;
+  return memory->ReadMemory<uint8_t>(addr);
 }
 
 MemoryHandler *__remill_write_memory_8(MemoryHandler *memory, uint64_t addr,
                                        uint8_t value) {
-  LOG(INFO) << "Writing " << std::hex << addr
-            << " value: " << (unsigned int) value;
   memory->WriteMemory<uint8_t>(addr, value);
   return memory;
 }
 
 uint16_t __remill_read_memory_16(MemoryHandler *memory, uint64_t addr) {
-  LOG(INFO) << "Reading " << std::hex << addr;
-  auto res = memory->ReadMemory<uint16_t>(addr);
-  LOG(INFO) << "Read memory " << res;
-  return res;
+  return memory->ReadMemory<uint16_t>(addr);
 }
 
 MemoryHandler *__remill_write_memory_16(MemoryHandler *memory, uint64_t addr,
                                         uint16_t value) {
-  LOG(INFO) << "Writing " << std::hex << addr << " value: " << value;
   memory->WriteMemory<uint16_t>(addr, value);
   return memory;
 }
 
 uint32_t __remill_read_memory_32(MemoryHandler *memory, uint64_t addr) {
-  LOG(INFO) << "Reading " << std::hex << addr;
-  auto res = memory->ReadMemory<uint32_t>(addr);
-  LOG(INFO) << "Read memory " << std::hex << res;
-  return res;
+  return memory->ReadMemory<uint32_t>(addr);
 }
 
 MemoryHandler *__remill_write_memory_32(MemoryHandler *memory, uint64_t addr,
                                         uint32_t value) {
-  LOG(INFO) << "Writing " << std::hex << addr << " value: " << value;
   memory->WriteMemory<uint32_t>(addr, value);
   return memory;
 }
 
 uint64_t __remill_read_memory_64(MemoryHandler *memory, uint64_t addr) {
-  LOG(INFO) << "Reading " << std::hex << addr;
   return memory->ReadMemory<uint64_t>(addr);
 }
 
 MemoryHandler *__remill_write_memory_64(MemoryHandler *memory, uint64_t addr,
                                         uint64_t value) {
-  LOG(INFO) << "Writing " << std::hex << addr << " value: " << value;
   memory->WriteMemory<uint64_t>(addr, value);
   return memory;
 }
@@ -308,16 +380,136 @@ CopyFunctionIntoNewModule(llvm::Module *target, const llvm::Function *old_func,
   return new_f;
 }
 
-void StubOutFlagComputationInstrinsics(llvm::Module *mod,
-                                       llvm::ExecutionEngine &exec_engine) {
-  for (auto &func : mod->getFunctionList()) {
-    if (FuncIsIntrinsicPrefixedBy(&func, kFlagIntrinsicPrefix)) {
-      exec_engine.addGlobalMapping(&func, (void *) &flag_computation_stub);
+JITSession::JITSession(void) {
+  std::string load_error = "";
+  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr, &load_error);
+  if (!load_error.empty()) {
+    LOG(FATAL) << "Failed to load: " << load_error;
+  }
+
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmParser();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  auto maybe_jit = llvm::orc::LLJITBuilder().create();
+  if (!maybe_jit) {
+    LOG(FATAL) << "Failed to create JIT: "
+               << llvm::toString(maybe_jit.takeError());
+  }
+  this->jit = std::move(*maybe_jit);
+
+  // Memory intrinsics, and anything else the modules need, are resolved
+  // against the symbols of this process.
+  auto maybe_gen =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          this->jit->getDataLayout().getGlobalPrefix());
+  if (!maybe_gen) {
+    LOG(FATAL) << "Failed to create symbol generator: "
+               << llvm::toString(maybe_gen.takeError());
+  }
+  this->jit->getMainJITDylib().addGenerator(std::move(*maybe_gen));
+
+  this->test_case_tracker =
+      this->jit->getMainJITDylib().createResourceTracker();
+}
+
+JITSession::~JITSession(void) {}
+
+void JITSession::EndTestCase(void) {
+  if (auto err = this->test_case_tracker->remove()) {
+    LOG(FATAL) << "Failed to remove test case modules from JIT: "
+               << llvm::toString(std::move(err));
+  }
+  this->test_case_tracker =
+      this->jit->getMainJITDylib().createResourceTracker();
+  this->function_names.clear();
+}
+
+void JITSession::AddModule(const llvm::Module &module) {
+
+  // The JIT takes ownership of the modules it compiles, along with their
+  // contexts, so round-trip a copy of `module` through bitcode into a fresh
+  // context.
+  llvm::SmallVector<char, 0> bitcode;
+  llvm::raw_svector_ostream bitcode_os(bitcode);
+  llvm::WriteBitcodeToFile(module, bitcode_os);
+
+  auto context = std::make_unique<llvm::LLVMContext>();
+  auto maybe_mod = llvm::parseBitcodeFile(
+      llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()),
+                            module.getModuleIdentifier()),
+      *context);
+  if (!maybe_mod) {
+    LOG(FATAL) << "Failed to copy module: "
+               << llvm::toString(maybe_mod.takeError());
+  }
+
+  auto tgt_mod = std::move(*maybe_mod);
+  tgt_mod->setTargetTriple(this->jit->getTargetTriple().str());
+  tgt_mod->setDataLayout(this->jit->getDataLayout());
+
+  auto res = remill::VerifyModuleMsg(tgt_mod.get());
+  if (res.has_value()) {
+    LOG(FATAL) << *res;
+  }
+
+  // The flag stubs are shared by all test cases, so only the new ones are
+  // defined, and they are owned by the library rather than the test case.
+  llvm::orc::SymbolMap stubs;
+  auto &lib = this->jit->getMainJITDylib();
+  for (auto &func : tgt_mod->getFunctionList()) {
+    const auto name = func.getName().str();
+    if (func.isDeclaration() && this->stub_names.count(name)) {
+      continue;
+
+    } else if (FuncIsIntrinsicPrefixedBy(&func, kFlagIntrinsicPrefix)) {
+      this->stub_names.insert(name);
+      stubs[this->jit->mangleAndIntern(func.getName())] =
+          llvm::JITEvaluatedSymbol(
+              llvm::pointerToJITTargetAddress(&flag_computation_stub),
+              llvm::JITSymbolFlags::Exported);
+
+    } else if (FuncIsIntrinsicPrefixedBy(&func, kCompareFlagIntrinsicPrefix)) {
+      this->stub_names.insert(name);
+      stubs[this->jit->mangleAndIntern(func.getName())] =
+          llvm::JITEvaluatedSymbol(
+              llvm::pointerToJITTargetAddress(&compare_instrinsic_stub),
+              llvm::JITSymbolFlags::Exported);
+
+    } else if (!func.isDeclaration()) {
+      CHECK(this->function_names.insert(name).second)
+          << "Function " << name << " was already added to the JIT session";
     }
+  }
 
-    if (FuncIsIntrinsicPrefixedBy(&func, kCompareFlagIntrinsicPrefix)) {
-      exec_engine.addGlobalMapping(&func, (void *) &compare_instrinsic_stub);
+  if (!stubs.empty()) {
+    if (auto err = lib.define(llvm::orc::absoluteSymbols(std::move(stubs)))) {
+      LOG(FATAL) << "Failed to define flag stubs: "
+                 << llvm::toString(std::move(err));
     }
   }
+
+  if (auto err = this->jit->addIRModule(
+          this->test_case_tracker,
+          llvm::orc::ThreadSafeModule(std::move(tgt_mod),
+                                      std::move(context)))) {
+    LOG(FATAL) << "Failed to add module to JIT: "
+               << llvm::toString(std::move(err));
+  }
+}
+
+void *JITSession::GetFunctionAddress(std::string_view name) {
+  CHECK(this->function_names.count(std::string(name)))
+      << "Function " << name
+      << " was not added to the JIT session during this test case";
+
+  // The first lookup of a function compiles its whole module.
+  auto maybe_sym =
+      this->jit->lookup(llvm::StringRef(name.data(), name.size()));
+  if (!maybe_sym) {
+    LOG(FATAL) << "Failed to compile " << name << ": "
+               << llvm::toString(maybe_sym.takeError());
+  }
+  return llvm::jitTargetAddressToPointer<void *>(maybe_sym->getAddress());
 }
-}  // namespace test_runner
\ No newline at end of file
+}  // namespace test_runner
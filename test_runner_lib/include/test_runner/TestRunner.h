@@ -17,24 +17,30 @@
 #pragma once
 
 #include <glog/logging.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/GenericValue.h>
-#include <llvm/ExecutionEngine/Interpreter.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
 #include <llvm/IR/Function.h>
-#include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/Endian.h>
 #include <llvm/Support/JSON.h>
-#include <llvm/Support/TargetSelect.h>
-#include <llvm/Transforms/Utils/Cloning.h>
 #include <remill/Arch/Arch.h>
 #include <remill/BC/Util.h>
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <functional>
+#include <memory>
 #include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+namespace llvm::orc {
+class LLJIT;
+class ResourceTracker;
+}  // namespace llvm::orc
 namespace test_runner {
 
 
@@ -42,106 +48,219 @@ using random_bytes_engine =
     std::independent_bits_engine<std::default_random_engine, CHAR_BIT, uint8_t>;
 
 
+// Sparse guest memory, made of lazily allocated 4 KiB pages. Each page
+// tracks which of its bytes are initialized, and uninitialized bytes are
+// always zero. Pages are shared copy-on-write, so copying a `PagedMemory` to
+// snapshot it is cheap, and so is comparing a memory to its snapshot.
+class PagedMemory {
+ public:
+  static constexpr uint64_t kPageSize = 4096u;
+
+  // Returns `true` and sets `*byte` if the byte at `addr` is initialized.
+  bool TryReadByte(uint64_t addr, uint8_t *byte) const;
+
+  // Returns a pointer to the `size` bytes at `addr`, or `nullptr` if the
+  // range crosses a page boundary or isn't fully initialized.
+  const uint8_t *TryGetBytes(uint64_t addr, size_t size) const;
+
+  // Returns a writable pointer to the `size` bytes at `addr`, marking them as
+  // initialized, or `nullptr` if the range crosses a page boundary.
+  uint8_t *GetBytesForWrite(uint64_t addr, size_t size);
+
+  void WriteByte(uint64_t addr, uint8_t byte);
+
+  // Calls `callback` on every initialized byte, in no particular order.
+  void ForEachByte(
+      const std::function<void(uint64_t addr, uint8_t byte)> &callback) const;
+
+  bool operator==(const PagedMemory &that) const;
+
+  bool operator!=(const PagedMemory &that) const {
+    return !(*this == that);
+  }
+
+ private:
+  struct Page {
+    std::array<uint8_t, kPageSize> bytes{};
+    std::array<uint64_t, kPageSize / 64u> initialized{};
+
+    bool IsInitialized(uint64_t offset, size_t size) const;
+    void MarkInitialized(uint64_t offset, size_t size);
+  };
+
+  const Page *FindPage(uint64_t addr) const;
+
+  // Returns the page containing `addr`, allocating it, or un-sharing it from
+  // other memories, first if necessary.
+  Page *GetPageForWrite(uint64_t addr);
+
+  // Maps page numbers to pages. Every page has at least one initialized byte.
+  std::unordered_map<uint64_t, std::shared_ptr<Page>> pages;
+};
+
+// A single memory access made by a lifted function.
+struct MemoryAccess {
+  bool is_write;
+  uint64_t addr;
+  size_t size;
+  uint64_t value;
+};
+
 class MemoryHandler {
  private:
-  std::unordered_map<uint64_t, uint8_t> uninitialized_reads;
-  std::unordered_map<uint64_t, uint8_t> state;
+  PagedMemory uninitialized_reads;
+  PagedMemory state;
 
   random_bytes_engine rbe;
   llvm::support::endianness endian;
 
+  bool is_tracing{false};
+  std::vector<MemoryAccess> trace;
+
+  template <class T>
+  void Trace(bool is_write, uint64_t addr, T value) {
+    if (this->is_tracing) {
+      this->trace.push_back(
+          {is_write, addr, sizeof(T), static_cast<uint64_t>(value)});
+    }
+  }
+
  public:
   MemoryHandler(llvm::support::endianness endian_);
 
-  MemoryHandler(llvm::support::endianness endian_,
-                std::unordered_map<uint64_t, uint8_t> initial_state);
+  MemoryHandler(llvm::support::endianness endian_, PagedMemory initial_state);
 
   uint8_t read_byte(uint64_t addr);
 
 
   std::vector<uint8_t> readSize(uint64_t addr, size_t num);
 
-  const std::unordered_map<uint64_t, uint8_t> &GetMemory() const;
+  const PagedMemory &GetMemory() const;
 
   std::string DumpState() const;
 
   template <class T>
-  T ReadMemory(uint64_t addr);
+  T ReadMemory(uint64_t addr) {
+    T value;
+    if (auto bytes = this->state.TryGetBytes(addr, sizeof(T))) {
+      value = llvm::support::endian::read<T>(bytes, this->endian);
+    } else {
+      uint8_t buff[sizeof(T)];
+      for (size_t i = 0; i < sizeof(T); i++) {
+        buff[i] = this->read_byte(addr + i);
+      }
+      value = llvm::support::endian::read<T>(buff, this->endian);
+    }
+    this->Trace(false, addr, value);
+    return value;
+  }
 
 
   template <class T>
-  void WriteMemory(uint64_t addr, T value);
-
-  std::unordered_map<uint64_t, uint8_t> GetUninitializedReads();
-};
-
-void StubOutFlagComputationInstrinsics(llvm::Module *mod,
-                                       llvm::ExecutionEngine &exec_engine);
-llvm::Function *
-CopyFunctionIntoNewModule(llvm::Module *target, const llvm::Function *old_func,
-                          const std::unique_ptr<llvm::Module> &old_module);
-
-void *MissingFunctionStub(const std::string &name);
-
-template <typename T, typename P>
-void ExecuteLiftedFunction(
-    llvm::Function *func, size_t insn_length, T *state,
-    test_runner::MemoryHandler *handler,
-    const std::function<uint64_t(T *)> &program_counter_fetch) {
-  std::string load_error = "";
-  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr, &load_error);
-  if (!load_error.empty()) {
-    LOG(FATAL) << "Failed to load: " << load_error;
+  void WriteMemory(uint64_t addr, T value) {
+    this->Trace(true, addr, value);
+    if (auto bytes = this->state.GetBytesForWrite(addr, sizeof(T))) {
+      llvm::support::endian::write<T>(bytes, value, this->endian);
+    } else {
+      uint8_t buff[sizeof(T)];
+      llvm::support::endian::write<T>(buff, value, this->endian);
+      for (size_t i = 0; i < sizeof(T); i++) {
+        this->state.WriteByte(addr + i, buff[i]);
+      }
+    }
   }
 
-  auto tgt_mod = llvm::CloneModule(*func->getParent());
-  tgt_mod->setTargetTriple("");
-  tgt_mod->setDataLayout(llvm::DataLayout(""));
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmParser();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeAllTargetMCs();
+  // The random values handed out for reads of uninitialized memory. Seeding
+  // another handler with these makes it observe the same values.
+  const PagedMemory &GetUninitializedReads() const;
 
-  auto res = remill::VerifyModuleMsg(tgt_mod.get());
-  if (res.has_value()) {
+  // Record every access made through `ReadMemory` and `WriteMemory`.
+  void EnableTracing(bool enable = true);
 
-    LOG(FATAL) << *res;
-  }
+  const std::vector<MemoryAccess> &GetTrace() const;
 
-  llvm::EngineBuilder builder(std::move(tgt_mod));
+  std::string DumpTrace() const;
+};
 
+llvm::Function *
+CopyFunctionIntoNewModule(llvm::Module *target, const llvm::Function *old_func,
+                          const std::unique_ptr<llvm::Module> &old_module);
 
-  std::string estr;
-  auto eptr =
-      builder.setEngineKind(llvm::EngineKind::JIT).setErrorStr(&estr).create();
+// Native entry point of a traditional remill lifted instruction function.
+template <typename T>
+using LiftedFunction = void *(*) (T *, uint32_t, void *);
 
-  if (eptr == nullptr) {
-    LOG(FATAL) << estr;
+// A JIT session that compiles modules of lifted functions once, so that they
+// can be executed any number of times on the same machine code.
+class JITSession {
+ public:
+  JITSession(void);
+  ~JITSession(void);
+
+  // Compile a copy of `module`. Function names must be unique across all of
+  // the modules added during one test case.
+  void AddModule(const llvm::Module &module);
+
+  // Free the code of every module added since the last call, so that a
+  // session running many test cases doesn't keep all of their code around.
+  // The functions of those modules can no longer be run afterwards.
+  void EndTestCase(void);
+
+  // Returns the address of the compiled function `name`, from a module that
+  // was previously added with `AddModule`.
+  void *GetFunctionAddress(std::string_view name);
+
+  template <typename T>
+  LiftedFunction<T> GetLiftedFunction(const llvm::Function *func) {
+    // expect traditional remill lifted insn
+    assert(func->arg_size() == 3);
+    return reinterpret_cast<LiftedFunction<T>>(
+        this->GetFunctionAddress(func->getName()));
   }
 
-  std::unique_ptr<llvm::ExecutionEngine> engine(eptr);
+ private:
+  JITSession(const JITSession &) = delete;
+  JITSession &operator=(const JITSession &) = delete;
 
+  std::unique_ptr<llvm::orc::LLJIT> jit;
 
-  auto target = engine->FindFunctionNamed(func->getName());
-  StubOutFlagComputationInstrinsics(target->getParent(), *engine);
+  // Owns the code of the modules added during the current test case.
+  llvm::IntrusiveRefCntPtr<llvm::orc::ResourceTracker> test_case_tracker;
 
-  engine->InstallLazyFunctionCreator(&MissingFunctionStub);
-  engine->DisableSymbolSearching(false);
-  // expect traditional remill lifted insn
-  assert(func->arg_size() == 3);
+  // Names of the functions defined by the modules of the current test case.
+  std::unordered_set<std::string> function_names;
 
-  auto returned =
-      (void *(*) (T *, uint32_t, void *) ) engine->getFunctionAddress(
-          target->getName().str());
+  // Names of the flag computation intrinsics that have been stubbed out. The
+  // stubs outlive test cases.
+  std::unordered_set<std::string> stub_names;
+};
 
-  assert(returned != nullptr);
+template <typename T, typename P>
+void ExecuteLiftedFunction(
+    LiftedFunction<T> func, size_t insn_length, T *state,
+    test_runner::MemoryHandler *handler,
+    const std::function<uint64_t(T *)> &program_counter_fetch) {
+  assert(func != nullptr);
   auto orig_pc = program_counter_fetch(state);
   // run until we terminate and exit pc
   while (program_counter_fetch(state) == orig_pc) {
-    returned(state, program_counter_fetch(state), handler);
+    func(state, program_counter_fetch(state), handler);
   }
 }
 
+// Compiles `func` in a throwaway session before running it. Prefer using a
+// `JITSession` directly when running the same function more than once.
+template <typename T, typename P>
+void ExecuteLiftedFunction(
+    llvm::Function *func, size_t insn_length, T *state,
+    test_runner::MemoryHandler *handler,
+    const std::function<uint64_t(T *)> &program_counter_fetch) {
+  JITSession session;
+  session.AddModule(*func->getParent());
+  ExecuteLiftedFunction<T, P>(session.GetLiftedFunction<T>(func), insn_length,
+                              state, handler, program_counter_fetch);
+}
+
 template <typename T>
 void RandomizeState(T &state, random_bytes_engine &rbe) {
   std::vector<uint8_t> data(sizeof(T));
@@ -150,6 +269,13 @@ void RandomizeState(T &state, random_bytes_engine &rbe) {
   std::memcpy(&state, data.data(), sizeof(T));
 }
 
+// Fill the `num_states` contiguous states at `states` with random bytes.
+template <typename T>
+void RandomizeStates(T *states, size_t num_states, random_bytes_engine &rbe) {
+  std::generate_n(reinterpret_cast<uint8_t *>(states), num_states * sizeof(T),
+                  std::ref(rbe));
+}
+
 uint8_t random_boolean_flag(random_bytes_engine &rbe);
 
 
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <llvm/IR/LLVMContext.h>
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/DecodedInstructionCache.h>
+#include <remill/Arch/Instruction.h>
+#include <remill/Arch/Name.h>
+#include <remill/OS/OS.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// add eax, ebx
+static const std::string kAdd("\x01\xd8", 2);
+
+// mov eax, 1
+static const std::string kMov("\xb8\x01\x00\x00\x00", 5);
+
+// ret
+static const std::string kRet("\xc3", 1);
+
+// int3
+static const std::string kInt3("\xcc", 1);
+
+class DecodedInstructionCacheTest : public ::testing::Test {
+ protected:
+  void SetUp(void) override {
+    context.enableOpaquePointers();
+    arch = remill::Arch::Build(&context, remill::OSName::kOSLinux,
+                               remill::ArchName::kArchAMD64);
+    ASSERT_TRUE(arch);
+  }
+
+  // Decode `bytes` at `address` through `cache`, and return the serialized
+  // instruction, or an empty string if it didn't decode.
+  std::string Decode(remill::DecodedInstructionCache &cache, uint64_t address,
+                     const std::string &bytes, bool is_delayed = false,
+                     remill::DecodingContext decoding_context = {}) {
+    remill::Instruction inst;
+    auto res = is_delayed ? cache.DecodeDelayedInstruction(
+                                arch.get(), address, bytes, inst,
+                                std::move(decoding_context))
+                          : cache.DecodeInstruction(
+                                arch.get(), address, bytes, inst,
+                                std::move(decoding_context));
+    if (!res) {
+      return {};
+    }
+    EXPECT_EQ(inst.pc, address);
+    EXPECT_EQ(inst.bytes, bytes);
+    return inst.Serialize();
+  }
+
+  llvm::LLVMContext context;
+  remill::Arch::ArchPtr arch;
+};
+
+}  // namespace
+
+TEST_F(DecodedInstructionCacheTest, HitsOnlyOnTheSameDecoding) {
+  remill::DecodedInstructionCache cache;
+  const auto add = Decode(cache, 0x1000, kAdd);
+  ASSERT_FALSE(add.empty());
+  EXPECT_EQ(cache.NumMisses(), 1u);
+  EXPECT_EQ(cache.NumHits(), 0u);
+
+  // The same bytes, at the same address, in the same context.
+  EXPECT_EQ(Decode(cache, 0x1000, kAdd), add);
+  EXPECT_EQ(cache.NumMisses(), 1u);
+  EXPECT_EQ(cache.NumHits(), 1u);
+
+  // Each of these differ from the first decoding in one way.
+  EXPECT_FALSE(Decode(cache, 0x1000, kMov).empty());
+  EXPECT_FALSE(Decode(cache, 0x1002, kAdd).empty());
+  EXPECT_FALSE(Decode(cache, 0x1000, kAdd, true /* is_delayed */).empty());
+  EXPECT_FALSE(Decode(cache, 0x1000, kAdd, false,
+                      remill::DecodingContext().PutContextReg("TMReg", 1))
+                   .empty());
+  EXPECT_EQ(cache.NumMisses(), 5u);
+  EXPECT_EQ(cache.NumHits(), 1u);
+  EXPECT_EQ(cache.Size(), 5u);
+
+  // Contexts are compared by value.
+  EXPECT_FALSE(Decode(cache, 0x1000, kAdd, false,
+                      remill::DecodingContext().PutContextReg("TMReg", 1))
+                   .empty());
+  EXPECT_EQ(cache.NumMisses(), 5u);
+  EXPECT_EQ(cache.NumHits(), 2u);
+
+  cache.Clear();
+  EXPECT_EQ(cache.Size(), 0u);
+  EXPECT_EQ(Decode(cache, 0x1000, kAdd), add);
+  EXPECT_EQ(cache.NumMisses(), 6u);
+}
+
+TEST_F(DecodedInstructionCacheTest, EvictsLeastRecentlyUsed) {
+  remill::DecodedInstructionCache cache(2);
+  Decode(cache, 0x1000, kAdd);
+  Decode(cache, 0x2000, kMov);
+  EXPECT_EQ(cache.Size(), 2u);
+
+  // Use `kAdd` again, so that `kMov` is the least recently used, and is
+  // evicted to make room for `kRet`.
+  Decode(cache, 0x1000, kAdd);
+  Decode(cache, 0x3000, kRet);
+  EXPECT_EQ(cache.Size(), 2u);
+  EXPECT_EQ(cache.NumMisses(), 3u);
+  EXPECT_EQ(cache.NumHits(), 1u);
+
+  Decode(cache, 0x1000, kAdd);
+  Decode(cache, 0x3000, kRet);
+  EXPECT_EQ(cache.NumMisses(), 3u);
+  EXPECT_EQ(cache.NumHits(), 3u);
+
+  Decode(cache, 0x2000, kMov);
+  EXPECT_EQ(cache.NumMisses(), 4u);
+  EXPECT_EQ(cache.Size(), 2u);
+}
+
+TEST_F(DecodedInstructionCacheTest, DecodesFromManyThreads) {
+  const std::vector<std::string> codes = {kAdd, kMov, kRet, kInt3};
+
+  // Decode everything once without the cache, so that any state of the arch
+  // that is built on first use is built here.
+  std::vector<std::string> expected;
+  for (auto i = 0u; i < codes.size(); ++i) {
+    remill::Instruction inst;
+    ASSERT_TRUE(arch->DecodeInstruction(0x1000 + i * 0x10, codes[i], inst,
+                                        arch->CreateInitialContext()));
+    expected.push_back(inst.Serialize());
+  }
+
+  // Fewer entries than instructions, so that threads also race on evictions.
+  constexpr auto kNumThreads = 8u;
+  constexpr auto kNumRounds = 200u;
+  remill::DecodedInstructionCache cache(3);
+  std::atomic<unsigned> num_mismatches{0};
+  std::vector<std::thread> threads;
+  for (auto t = 0u; t < kNumThreads; ++t) {
+    threads.emplace_back([&, t](void) {
+      for (auto r = 0u; r < kNumRounds; ++r) {
+        const auto i = (t + r) % codes.size();
+        remill::Instruction inst;
+        auto res = cache.DecodeInstruction(arch.get(), 0x1000 + i * 0x10,
+                                           codes[i], inst,
+                                           arch->CreateInitialContext());
+        if (!res || inst.Serialize() != expected[i]) {
+          ++num_mismatches;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(num_mismatches.load(), 0u);
+  EXPECT_EQ(cache.NumHits() + cache.NumMisses(), kNumThreads * kNumRounds);
+  EXPECT_LE(cache.Size(), 3u);
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/BinaryFormat/ELF.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FileUtilities.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/BC/ImageTraceManager.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct LoadSegment {
+  uint64_t vaddr;
+  std::string data;
+  bool is_executable;
+};
+
+// Build a little-endian 64-bit ELF file with one `PT_LOAD` program header per
+// entry of `load_segments`, preceded by a `PT_NOTE` header that must be
+// ignored.
+static std::string BuildELF(const std::vector<LoadSegment> &load_segments) {
+  llvm::ELF::Elf64_Ehdr ehdr = {};
+  std::memcpy(ehdr.e_ident, llvm::ELF::ElfMagic, 4);
+  ehdr.e_ident[llvm::ELF::EI_CLASS] = llvm::ELF::ELFCLASS64;
+  ehdr.e_ident[llvm::ELF::EI_DATA] = llvm::ELF::ELFDATA2LSB;
+  ehdr.e_ident[llvm::ELF::EI_VERSION] = llvm::ELF::EV_CURRENT;
+  ehdr.e_type = llvm::ELF::ET_EXEC;
+  ehdr.e_machine = llvm::ELF::EM_X86_64;
+  ehdr.e_version = llvm::ELF::EV_CURRENT;
+  ehdr.e_phoff = sizeof(ehdr);
+  ehdr.e_ehsize = sizeof(ehdr);
+  ehdr.e_phentsize = sizeof(llvm::ELF::Elf64_Phdr);
+  ehdr.e_phnum = static_cast<uint16_t>(load_segments.size() + 1u);
+
+  std::vector<llvm::ELF::Elf64_Phdr> phdrs(ehdr.e_phnum);
+  phdrs[0].p_type = llvm::ELF::PT_NOTE;
+
+  uint64_t offset = sizeof(ehdr) + phdrs.size() * sizeof(phdrs[0]);
+  std::string contents;
+  for (auto i = 0u; i < load_segments.size(); ++i) {
+    auto &phdr = phdrs[i + 1u];
+    phdr.p_type = llvm::ELF::PT_LOAD;
+    phdr.p_flags = llvm::ELF::PF_R;
+    if (load_segments[i].is_executable) {
+      phdr.p_flags |= llvm::ELF::PF_X;
+    }
+    phdr.p_offset = offset + contents.size();
+    phdr.p_vaddr = load_segments[i].vaddr;
+    phdr.p_paddr = load_segments[i].vaddr;
+    phdr.p_filesz = load_segments[i].data.size();
+    phdr.p_memsz = load_segments[i].data.size();
+    contents += load_segments[i].data;
+  }
+
+  std::string elf(reinterpret_cast<const char *>(&ehdr), sizeof(ehdr));
+  elf.append(reinterpret_cast<const char *>(phdrs.data()),
+             phdrs.size() * sizeof(phdrs[0]));
+  elf += contents;
+  return elf;
+}
+
+// A temporary file that is deleted when this goes out of scope.
+class TempFile {
+ public:
+  explicit TempFile(const std::string &contents) {
+    int fd = -1;
+    CHECK(!llvm::sys::fs::createTemporaryFile("remill-bc-test", "bin", fd,
+                                              path));
+    llvm::raw_fd_ostream os(fd, true /* shouldClose */);
+    os << contents;
+    remover.setFile(path);
+  }
+
+  std::string Path(void) const {
+    return path.str().str();
+  }
+
+ private:
+  llvm::SmallString<128> path;
+  llvm::FileRemover remover;
+};
+
+}  // namespace
+
+TEST(ImageTraceManager, RejectsOverlappingSegments) {
+  remill::ImageTraceManager manager;
+  ASSERT_TRUE(manager.AddMemorySegment("abcd", 0x1000));
+
+  EXPECT_FALSE(manager.AddMemorySegment("xy", 0x1003));
+  EXPECT_FALSE(manager.AddMemorySegment("xyz", 0xffe));
+  EXPECT_FALSE(manager.AddMemorySegment("0123456789abcdef", 0xff8));
+  EXPECT_FALSE(manager.AddMemorySegment("ab", ~0ull));
+
+  // Adjacent segments are fine.
+  EXPECT_TRUE(manager.AddMemorySegment("xy", 0x1004));
+  EXPECT_TRUE(manager.AddMemorySegment("vw", 0xffe));
+
+  // The rejected segments left nothing behind.
+  uint8_t byte = 0;
+  EXPECT_TRUE(manager.TryReadExecutableByte(0x1003, &byte));
+  EXPECT_EQ(byte, 'd');
+  EXPECT_FALSE(manager.TryReadExecutableByte(0xff8, &byte));
+}
+
+TEST(ImageTraceManager, ReadsAtSegmentEdges) {
+  remill::ImageTraceManager manager;
+  ASSERT_TRUE(manager.AddMemorySegment("abcd", 0x1000));
+  ASSERT_TRUE(manager.AddMemorySegment("efgh", 0x1004));
+  ASSERT_TRUE(manager.AddMemorySegment("data", 0x2000, false));
+
+  uint8_t byte = 0;
+  EXPECT_FALSE(manager.TryReadExecutableByte(0xfff, &byte));
+  EXPECT_TRUE(manager.TryReadExecutableByte(0x1000, &byte));
+  EXPECT_EQ(byte, 'a');
+  EXPECT_TRUE(manager.TryReadExecutableByte(0x1003, &byte));
+  EXPECT_EQ(byte, 'd');
+  EXPECT_TRUE(manager.TryReadExecutableByte(0x1004, &byte));
+  EXPECT_EQ(byte, 'e');
+  EXPECT_TRUE(manager.TryReadExecutableByte(0x1007, &byte));
+  EXPECT_EQ(byte, 'h');
+  EXPECT_FALSE(manager.TryReadExecutableByte(0x1008, &byte));
+
+  // Views stop at the end of the containing segment.
+  EXPECT_EQ(manager.TryReadExecutableBytes(0x1002, 15), "cd");
+  EXPECT_EQ(manager.TryReadExecutableBytes(0x1004, 2), "ef");
+  EXPECT_EQ(manager.TryReadExecutableBytes(0x1007, 15), "h");
+  EXPECT_TRUE(manager.TryReadExecutableBytes(0x1008, 15).empty());
+
+  // Non-executable segments can't be read as code.
+  EXPECT_FALSE(manager.TryReadExecutableByte(0x2000, &byte));
+  EXPECT_TRUE(manager.TryReadExecutableBytes(0x2000, 4).empty());
+}
+
+TEST(ImageTraceManager, MapsFileSegments) {
+  TempFile file("0123456789");
+
+  remill::ImageTraceManager manager;
+  EXPECT_FALSE(manager.AddFileSegment(file.Path(), 0x1000, 11));
+  EXPECT_FALSE(manager.AddFileSegment(file.Path(), 0x1000, 8, 3));
+  ASSERT_TRUE(manager.AddFileSegment(file.Path(), 0x1000, 2, 4));
+  ASSERT_TRUE(manager.AddFileSegment(file.Path(), 0x2000, 6));
+
+  EXPECT_EQ(manager.TryReadExecutableBytes(0x1000, 15), "2345");
+  EXPECT_EQ(manager.TryReadExecutableBytes(0x2000, 15), "6789");
+}
+
+TEST(ImageTraceManager, MapsELFLoadSegments) {
+  TempFile elf(BuildELF({{0x400000, "\x90\x90\xc3", true},
+                         {0x600000, "data", false}}));
+  ASSERT_TRUE(remill::ImageTraceManager::IsELFFile(elf.Path()));
+
+  remill::ImageTraceManager manager;
+  ASSERT_TRUE(manager.AddELFSegments(elf.Path()));
+
+  EXPECT_EQ(manager.TryReadExecutableBytes(0x400000, 15),
+            std::string_view("\x90\x90\xc3", 3));
+  uint8_t byte = 0;
+  EXPECT_TRUE(manager.TryReadExecutableByte(0x400002, &byte));
+  EXPECT_EQ(byte, 0xc3);
+  EXPECT_FALSE(manager.TryReadExecutableByte(0x400003, &byte));
+  EXPECT_FALSE(manager.TryReadExecutableByte(0x600000, &byte));
+}
+
+TEST(ImageTraceManager, RollsBackFailedELFFiles) {
+  TempFile not_elf("not an ELF file");
+  EXPECT_FALSE(remill::ImageTraceManager::IsELFFile(not_elf.Path()));
+
+  // The second segment overlaps the first.
+  TempFile elf(
+      BuildELF({{0x400000, "\x90\x90\xc3", true}, {0x400002, "xy", true}}));
+
+  remill::ImageTraceManager manager;
+  EXPECT_FALSE(manager.AddELFSegments(not_elf.Path()));
+  EXPECT_FALSE(manager.AddELFSegments(elf.Path()));
+
+  uint8_t byte = 0;
+  EXPECT_FALSE(manager.TryReadExecutableByte(0x400000, &byte));
+
+  // The address range is free again.
+  EXPECT_TRUE(manager.AddMemorySegment("abc", 0x400000));
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Name.h>
+#include <remill/BC/IntrinsicTable.h>
+#include <remill/BC/Util.h>
+#include <remill/OS/OS.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// A call to a memory intrinsic, and the offset from the base address that it
+// accesses.
+using MemoryAccess = std::pair<llvm::Function *, uint64_t>;
+
+// Lifts loads and stores of various types with `LoadFromMemory` and
+// `StoreToMemory`, and checks which memory intrinsics they call.
+class MemoryAccessTest : public ::testing::Test {
+ protected:
+  void SetUp(void) override {
+    context.enableOpaquePointers();
+    arch = remill::Arch::Build(&context, remill::OSName::kOSLinux,
+                               remill::ArchName::kArchAMD64);
+    ASSERT_TRUE(arch);
+    module = remill::LoadArchSemantics(arch.get());
+    ASSERT_TRUE(module);
+    intrinsics = arch->GetInstrinsicTable();
+    ASSERT_NE(intrinsics, nullptr);
+  }
+
+  // Create a function taking a memory pointer, an address, and a value of
+  // `type`, that returns the memory pointer.
+  llvm::Function *CreateFunction(llvm::Type *type) {
+    auto read_type = intrinsics->read_memory_8->getFunctionType();
+    auto mem_ptr_type = read_type->getParamType(0);
+    auto addr_type = read_type->getParamType(1);
+    auto func_type = llvm::FunctionType::get(
+        mem_ptr_type, {mem_ptr_type, addr_type, type}, false);
+    auto func = llvm::Function::Create(
+        func_type, llvm::GlobalValue::ExternalLinkage, "test", module.get());
+    llvm::BasicBlock::Create(context, "", func);
+    return func;
+  }
+
+  // Lift a load of `type`, and return the memory accesses that it makes.
+  std::vector<MemoryAccess> Load(llvm::Type *type) {
+    auto func = CreateFunction(type);
+    auto block = &func->getEntryBlock();
+    auto val = remill::LoadFromMemory(*intrinsics, block, type, func->getArg(0),
+                                      func->getArg(1));
+    EXPECT_EQ(val->getType(), type);
+
+    llvm::IRBuilder<> ir(block);
+    ir.CreateRet(func->getArg(0));
+    return Finish(func, false);
+  }
+
+  // Lift a store of a value of `type`, and return the memory accesses that it
+  // makes.
+  std::vector<MemoryAccess> Store(llvm::Type *type) {
+    auto func = CreateFunction(type);
+    auto block = &func->getEntryBlock();
+    auto mem_ptr = remill::StoreToMemory(*intrinsics, block, func->getArg(2),
+                                         func->getArg(0), func->getArg(1));
+
+    llvm::IRBuilder<> ir(block);
+    ir.CreateRet(mem_ptr);
+    return Finish(func, true);
+  }
+
+  // Returns the calls to memory intrinsics made by `func`, in order, and then
+  // deletes `func`. Writes must be chained through their memory pointers.
+  std::vector<MemoryAccess> Finish(llvm::Function *func, bool is_write) {
+    EXPECT_FALSE(llvm::verifyFunction(*func, &llvm::errs()));
+
+    std::vector<MemoryAccess> accesses;
+    llvm::Value *mem_ptr = func->getArg(0);
+    for (auto &inst : func->getEntryBlock()) {
+      auto call = llvm::dyn_cast<llvm::CallInst>(&inst);
+      if (!call) {
+        continue;
+      }
+
+      auto callee = call->getCalledFunction();
+      EXPECT_TRUE(IsMemoryIntrinsic(callee, is_write))
+          << remill::LLVMThingToString(call);
+      if (is_write) {
+        EXPECT_EQ(call->getArgOperand(0), mem_ptr);
+        mem_ptr = call;
+      }
+      accesses.emplace_back(callee,
+                            Offset(call->getArgOperand(1), func->getArg(1)));
+    }
+
+    func->eraseFromParent();
+    return accesses;
+  }
+
+  bool IsMemoryIntrinsic(llvm::Function *func, bool is_write) const {
+    if (is_write) {
+      return func == intrinsics->write_memory_8 ||
+             func == intrinsics->write_memory_16 ||
+             func == intrinsics->write_memory_32 ||
+             func == intrinsics->write_memory_64;
+    } else {
+      return func == intrinsics->read_memory_8 ||
+             func == intrinsics->read_memory_16 ||
+             func == intrinsics->read_memory_32 ||
+             func == intrinsics->read_memory_64;
+    }
+  }
+
+  // Returns the constant offset of `addr` from `base_addr`.
+  static uint64_t Offset(llvm::Value *addr, llvm::Value *base_addr) {
+    if (addr == base_addr) {
+      return 0u;
+    }
+    auto add = llvm::dyn_cast<llvm::BinaryOperator>(addr);
+    if (!add || add->getOpcode() != llvm::Instruction::Add ||
+        add->getOperand(0) != base_addr) {
+      ADD_FAILURE() << "Unexpected address " << remill::LLVMThingToString(addr);
+      return ~0ull;
+    }
+    auto offset = llvm::dyn_cast<llvm::ConstantInt>(add->getOperand(1));
+    if (!offset) {
+      ADD_FAILURE() << "Unexpected address " << remill::LLVMThingToString(addr);
+      return ~0ull;
+    }
+    return offset->getZExtValue();
+  }
+
+  llvm::LLVMContext context;
+  remill::Arch::ArchPtr arch;
+  std::unique_ptr<llvm::Module> module;
+  const remill::IntrinsicTable *intrinsics{nullptr};
+};
+
+}  // namespace
+
+TEST_F(MemoryAccessTest, VectorOfFloatsUsesWideChunks) {
+  auto type = llvm::FixedVectorType::get(llvm::Type::getFloatTy(context), 4);
+  const std::vector<MemoryAccess> reads = {{intrinsics->read_memory_64, 0},
+                                           {intrinsics->read_memory_64, 8}};
+  const std::vector<MemoryAccess> writes = {{intrinsics->write_memory_64, 0},
+                                            {intrinsics->write_memory_64, 8}};
+  EXPECT_EQ(Load(type), reads);
+  EXPECT_EQ(Store(type), writes);
+}
+
+TEST_F(MemoryAccessTest, ArrayOfIntsUsesWideChunks) {
+  auto type = llvm::ArrayType::get(llvm::Type::getInt32Ty(context), 3);
+  const std::vector<MemoryAccess> reads = {{intrinsics->read_memory_32, 0},
+                                           {intrinsics->read_memory_32, 4},
+                                           {intrinsics->read_memory_32, 8}};
+  const std::vector<MemoryAccess> writes = {{intrinsics->write_memory_32, 0},
+                                            {intrinsics->write_memory_32, 4},
+                                            {intrinsics->write_memory_32, 8}};
+  EXPECT_EQ(Load(type), reads);
+  EXPECT_EQ(Store(type), writes);
+
+  // Four elements fit evenly into 64-bit chunks.
+  auto wider_type = llvm::ArrayType::get(llvm::Type::getInt32Ty(context), 4);
+  const std::vector<MemoryAccess> wider_reads = {
+      {intrinsics->read_memory_64, 0}, {intrinsics->read_memory_64, 8}};
+  const std::vector<MemoryAccess> wider_writes = {
+      {intrinsics->write_memory_64, 0}, {intrinsics->write_memory_64, 8}};
+  EXPECT_EQ(Load(wider_type), wider_reads);
+  EXPECT_EQ(Store(wider_type), wider_writes);
+}
+
+TEST_F(MemoryAccessTest, OddSizedIntsUseByteChunks) {
+  auto i24_type = llvm::Type::getIntNTy(context, 24);
+  const std::vector<MemoryAccess> i24_reads = {{intrinsics->read_memory_8, 0},
+                                               {intrinsics->read_memory_8, 1},
+                                               {intrinsics->read_memory_8, 2}};
+  const std::vector<MemoryAccess> i24_writes = {
+      {intrinsics->write_memory_8, 0},
+      {intrinsics->write_memory_8, 1},
+      {intrinsics->write_memory_8, 2}};
+  EXPECT_EQ(Load(i24_type), i24_reads);
+  EXPECT_EQ(Store(i24_type), i24_writes);
+
+  auto i1_type = llvm::Type::getInt1Ty(context);
+  const std::vector<MemoryAccess> i1_reads = {{intrinsics->read_memory_8, 0}};
+  const std::vector<MemoryAccess> i1_writes = {
+      {intrinsics->write_memory_8, 0}};
+  EXPECT_EQ(Load(i1_type), i1_reads);
+  EXPECT_EQ(Store(i1_type), i1_writes);
+}
+
+TEST_F(MemoryAccessTest, WideIntsUseWideChunks) {
+  auto type = llvm::Type::getInt128Ty(context);
+  const std::vector<MemoryAccess> reads = {{intrinsics->read_memory_64, 0},
+                                           {intrinsics->read_memory_64, 8}};
+  const std::vector<MemoryAccess> writes = {{intrinsics->write_memory_64, 0},
+                                            {intrinsics->write_memory_64, 8}};
+  EXPECT_EQ(Load(type), reads);
+  EXPECT_EQ(Store(type), writes);
+
+  // A 12-byte integer isn't a multiple of 8 bytes.
+  auto i96_type = llvm::Type::getIntNTy(context, 96);
+  const std::vector<MemoryAccess> i96_reads = {{intrinsics->read_memory_32, 0},
+                                               {intrinsics->read_memory_32, 4},
+                                               {intrinsics->read_memory_32, 8}};
+  const std::vector<MemoryAccess> i96_writes = {
+      {intrinsics->write_memory_32, 0},
+      {intrinsics->write_memory_32, 4},
+      {intrinsics->write_memory_32, 8}};
+  EXPECT_EQ(Load(i96_type), i96_reads);
+  EXPECT_EQ(Store(i96_type), i96_writes);
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <llvm/AsmParser/Parser.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/BC/Optimizer.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Runs `MemoryIntrinsicDSEPass` over the function `@test` of small modules
+// that access memory through the memory intrinsics.
+class MemoryIntrinsicDSETest : public ::testing::Test {
+ protected:
+  MemoryIntrinsicDSETest(void) {
+    context.enableOpaquePointers();
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+  }
+
+  // Parse `body` as the body of `@test`, and run the pass over it. Returns
+  // `true` if the pass changed anything.
+  bool Eliminate(const std::string &body) {
+    const std::string ir =
+        "declare ptr @__remill_write_memory_32(ptr, i64, i32)\n"
+        "declare ptr @__remill_write_memory_64(ptr, i64, i64)\n"
+        "declare i32 @__remill_read_memory_32(ptr, i64)\n"
+        "declare i64 @__remill_read_memory_64(ptr, i64)\n"
+        "declare ptr @__remill_barrier_store_load(ptr)\n"
+        "define ptr @test(ptr %state, i64 %pc, ptr %mem) {\n" +
+        body + "}\n";
+
+    llvm::SMDiagnostic err;
+    module = llvm::parseAssemblyString(ir, err, context);
+    if (!module) {
+      std::string message;
+      llvm::raw_string_ostream os(message);
+      err.print("test", os);
+      ADD_FAILURE() << os.str();
+      return false;
+    }
+
+    func = module->getFunction("test");
+    remill::MemoryIntrinsicDSEPass pass;
+    auto pa = pass.run(*func, fam);
+    fam.clear();
+
+    EXPECT_FALSE(llvm::verifyModule(*module, &llvm::errs()));
+    return !pa.areAllPreserved();
+  }
+
+  // Returns the calls to `callee`, in order.
+  std::vector<llvm::CallInst *> CallsTo(const std::string &callee) const {
+    std::vector<llvm::CallInst *> calls;
+    for (auto &block : *func) {
+      for (auto &inst : block) {
+        auto call = llvm::dyn_cast<llvm::CallInst>(&inst);
+        if (call && call->getCalledFunction() &&
+            call->getCalledFunction()->getName() == callee) {
+          calls.push_back(call);
+        }
+      }
+    }
+    return calls;
+  }
+
+  // Returns the instruction named `name`, or `nullptr`.
+  llvm::Instruction *Named(const std::string &name) const {
+    for (auto &block : *func) {
+      for (auto &inst : block) {
+        if (inst.getName() == name) {
+          return &inst;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  llvm::LLVMContext context;
+  llvm::PassBuilder pb;
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  std::unique_ptr<llvm::Module> module;
+  llvm::Function *func{nullptr};
+};
+
+}  // namespace
+
+TEST_F(MemoryIntrinsicDSETest, ForwardsWritesToReads) {
+  ASSERT_TRUE(Eliminate(R"(
+  %m1 = call ptr @__remill_write_memory_64(ptr %mem, i64 %pc, i64 42)
+  %v = call i64 @__remill_read_memory_64(ptr %m1, i64 %pc)
+  %w = add i64 %v, 1
+  %m2 = call ptr @__remill_write_memory_64(ptr %m1, i64 16, i64 %w)
+  ret ptr %m2
+)"));
+
+  // The read is replaced by the value that was written.
+  EXPECT_EQ(Named("v"), nullptr);
+  EXPECT_TRUE(CallsTo("__remill_read_memory_64").empty());
+  auto w = llvm::cast<llvm::BinaryOperator>(Named("w"));
+  auto forwarded = llvm::dyn_cast<llvm::ConstantInt>(w->getOperand(0));
+  ASSERT_NE(forwarded, nullptr);
+  EXPECT_EQ(forwarded->getZExtValue(), 42u);
+
+  // Both writes are still needed, as they are to different addresses.
+  EXPECT_EQ(CallsTo("__remill_write_memory_64").size(), 2u);
+}
+
+TEST_F(MemoryIntrinsicDSETest, KillsOverwrittenWrites) {
+  ASSERT_TRUE(Eliminate(R"(
+  %m1 = call ptr @__remill_write_memory_64(ptr %mem, i64 %pc, i64 1)
+  %m2 = call ptr @__remill_write_memory_64(ptr %m1, i64 %pc, i64 2)
+  %m3 = call ptr @__remill_write_memory_64(ptr %m2, i64 %pc, i64 3)
+  ret ptr %m3
+)"));
+
+  // Only the last write remains, and it is chained to the incoming memory.
+  auto writes = CallsTo("__remill_write_memory_64");
+  ASSERT_EQ(writes.size(), 1u);
+  EXPECT_EQ(writes[0], Named("m3"));
+  EXPECT_EQ(writes[0]->getArgOperand(0), func->getArg(2));
+  auto value = llvm::dyn_cast<llvm::ConstantInt>(writes[0]->getArgOperand(2));
+  ASSERT_NE(value, nullptr);
+  EXPECT_EQ(value->getZExtValue(), 3u);
+}
+
+TEST_F(MemoryIntrinsicDSETest, KeepsWritesReadThroughAliases) {
+  EXPECT_FALSE(Eliminate(R"(
+  %other = xor i64 %pc, 4
+  %m1 = call ptr @__remill_write_memory_64(ptr %mem, i64 %pc, i64 1)
+  %v = call i64 @__remill_read_memory_64(ptr %m1, i64 %other)
+  %m2 = call ptr @__remill_write_memory_64(ptr %m1, i64 %pc, i64 %v)
+  ret ptr %m2
+)"));
+
+  // `%other` may overlap `%pc`, so the read sees the first write, which must
+  // stay, and can't be forwarded to.
+  EXPECT_NE(Named("v"), nullptr);
+  EXPECT_EQ(CallsTo("__remill_write_memory_64").size(), 2u);
+}
+
+TEST_F(MemoryIntrinsicDSETest, KeepsWritesOverwrittenAfterOtherWrites) {
+  EXPECT_FALSE(Eliminate(R"(
+  %other = add i64 %pc, 4
+  %m1 = call ptr @__remill_write_memory_64(ptr %mem, i64 %pc, i64 1)
+  %m2 = call ptr @__remill_write_memory_32(ptr %m1, i64 %other, i32 2)
+  %m3 = call ptr @__remill_write_memory_64(ptr %m2, i64 %pc, i64 3)
+  %v = call i32 @__remill_read_memory_32(ptr %m3, i64 %pc)
+  %m4 = call ptr @__remill_write_memory_32(ptr %m3, i64 16, i32 %v)
+  ret ptr %m4
+)"));
+
+  // The 32-bit write lands in the middle of the first one, so that first
+  // write isn't entirely overwritten. The 32-bit read is of a 64-bit write.
+  EXPECT_EQ(CallsTo("__remill_write_memory_64").size(), 2u);
+  EXPECT_EQ(CallsTo("__remill_write_memory_32").size(), 2u);
+  EXPECT_NE(Named("v"), nullptr);
+}
+
+TEST_F(MemoryIntrinsicDSETest, KeepsWritesAroundBarriers) {
+  EXPECT_FALSE(Eliminate(R"(
+  %m1 = call ptr @__remill_write_memory_64(ptr %mem, i64 %pc, i64 1)
+  %m2 = call ptr @__remill_barrier_store_load(ptr %m1)
+  %v = call i64 @__remill_read_memory_64(ptr %m2, i64 %pc)
+  %m3 = call ptr @__remill_write_memory_64(ptr %m2, i64 %pc, i64 %v)
+  ret ptr %m3
+)"));
+
+  // Another thread may have written to `%pc` across the barrier.
+  EXPECT_NE(Named("v"), nullptr);
+  auto writes = CallsTo("__remill_write_memory_64");
+  ASSERT_EQ(writes.size(), 2u);
+  EXPECT_EQ(writes[1]->getArgOperand(0), Named("m2"));
+}
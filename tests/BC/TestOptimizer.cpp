@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <llvm/AsmParser/Parser.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/BC/Optimizer.h>
+
+#include <memory>
+#include <string>
+
+namespace {
+
+// A bare module of functions that call each other, and an internal helper
+// that is inlined everywhere.
+static const char *const kBareModule = R"(
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+define internal i64 @helper(i64 %x) {
+  %y = mul i64 %x, 3
+  %z = add i64 %y, 1
+  ret i64 %z
+}
+
+define i64 @f1(i64 %a) {
+  %b = call i64 @helper(i64 %a)
+  %c = add i64 %b, %a
+  ret i64 %c
+}
+
+define i64 @f2(i64 %a, i64 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i64 [ %a, %entry ], [ %acc.next, %loop ]
+  %h = call i64 @helper(i64 %acc)
+  %acc.next = add i64 %h, %i
+  %i.next = add i64 %i, 1
+  %done = icmp uge i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret i64 %acc.next
+}
+
+define i64 @f3(i64 %a) {
+  %b = call i64 @f1(i64 %a)
+  %c = call i64 @f1(i64 %b)
+  ret i64 %c
+}
+
+define void @f4(ptr %p, i64 %a) {
+  store i64 1, ptr %p
+  %b = call i64 @helper(i64 %a)
+  store i64 %b, ptr %p
+  ret void
+}
+
+define i64 @f5(i64 %a) {
+  %b = call i64 @f3(i64 %a)
+  %c = call i64 @f2(i64 %b, i64 4)
+  ret i64 %c
+}
+)";
+
+// Optimize a fresh copy of `kBareModule` on `num_threads` threads, and return
+// the resulting IR.
+static std::string Optimize(remill::OptimizationPipeline pipeline,
+                            unsigned num_threads) {
+  llvm::LLVMContext context;
+  context.enableOpaquePointers();
+  llvm::SMDiagnostic err;
+  auto module = llvm::parseAssemblyString(kBareModule, err, context);
+  if (!module) {
+    std::string message;
+    llvm::raw_string_ostream os(message);
+    err.print("test", os);
+    ADD_FAILURE() << os.str();
+    return {};
+  }
+
+  remill::OptimizationGuide guide = {};
+  guide.pipeline = pipeline;
+  guide.num_threads = num_threads;
+  remill::OptimizeBareModule(module.get(), guide);
+  EXPECT_FALSE(llvm::verifyModule(*module, &llvm::errs()));
+
+  std::string ir;
+  llvm::raw_string_ostream os(ir);
+  module->print(os, nullptr);
+  return os.str();
+}
+
+}  // namespace
+
+TEST(Optimizer, ParallelMatchesSerial) {
+  for (auto pipeline : {remill::OptimizationPipeline::kInlineOnly,
+                        remill::OptimizationPipeline::kO2,
+                        remill::OptimizationPipeline::kRemill}) {
+    const auto serial = Optimize(pipeline, 1);
+    ASSERT_FALSE(serial.empty());
+
+    // The helper was inlined everywhere, and then deleted.
+    EXPECT_EQ(serial.find("@helper"), std::string::npos) << serial;
+
+    for (auto num_threads : {2u, 3u, 8u}) {
+      EXPECT_EQ(Optimize(pipeline, num_threads), serial)
+          << "with " << num_threads << " threads";
+    }
+  }
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <llvm/Support/Endian.h>
+#include <test_runner/TestRunner.h>
+
+#include <cstdint>
+#include <map>
+
+namespace {
+
+using test_runner::MemoryHandler;
+using test_runner::PagedMemory;
+
+static constexpr auto kPageSize = PagedMemory::kPageSize;
+
+// Returns the initialized bytes of `mem`.
+static std::map<uint64_t, uint8_t> Bytes(const PagedMemory &mem) {
+  std::map<uint64_t, uint8_t> bytes;
+  mem.ForEachByte(
+      [&bytes](uint64_t addr, uint8_t byte) { bytes[addr] = byte; });
+  return bytes;
+}
+
+}  // namespace
+
+TEST(PagedMemory, AccessesAcrossPages) {
+  MemoryHandler little(llvm::support::endianness::little);
+  const auto addr = kPageSize - 2u;
+  little.WriteMemory<uint32_t>(addr, 0x11223344u);
+
+  // The access can't be done in place, so it is done a byte at a time.
+  EXPECT_EQ(little.GetMemory().TryGetBytes(addr, 4u), nullptr);
+  const std::map<uint64_t, uint8_t> expected = {{addr, 0x44u},
+                                                {addr + 1u, 0x33u},
+                                                {addr + 2u, 0x22u},
+                                                {addr + 3u, 0x11u}};
+  EXPECT_EQ(Bytes(little.GetMemory()), expected);
+  EXPECT_EQ(little.ReadMemory<uint32_t>(addr), 0x11223344u);
+  EXPECT_TRUE(Bytes(little.GetUninitializedReads()).empty());
+
+  MemoryHandler big(llvm::support::endianness::big);
+  big.WriteMemory<uint32_t>(addr, 0x11223344u);
+  uint8_t byte = 0;
+  ASSERT_TRUE(big.GetMemory().TryReadByte(addr, &byte));
+  EXPECT_EQ(byte, 0x11u);
+  ASSERT_TRUE(big.GetMemory().TryReadByte(addr + 3u, &byte));
+  EXPECT_EQ(byte, 0x44u);
+  EXPECT_EQ(big.ReadMemory<uint32_t>(addr), 0x11223344u);
+
+  // Only the half of a read on the second page is uninitialized.
+  little.WriteMemory<uint16_t>(2u * kPageSize - 2u, 0x5566u);
+  const auto value = little.ReadMemory<uint32_t>(2u * kPageSize - 2u);
+  EXPECT_EQ(value & 0xffffu, 0x5566u);
+  const auto reads = Bytes(little.GetUninitializedReads());
+  ASSERT_EQ(reads.size(), 2u);
+  EXPECT_EQ(reads.begin()->first, 2u * kPageSize);
+  EXPECT_EQ(value >> 16u,
+            reads.begin()->second | (reads.rbegin()->second << 8u));
+}
+
+TEST(PagedMemory, SnapshotsAreCopyOnWrite) {
+  PagedMemory mem;
+  mem.WriteByte(0x1000u, 1u);
+  mem.WriteByte(0x5000u, 2u);
+
+  const auto snapshot = mem;
+  mem.WriteByte(0x1000u, 9u);
+  mem.WriteByte(0x1001u, 3u);
+  mem.WriteByte(0x9000u, 4u);
+
+  // Writes to the memory, whether to shared pages or to new pages, don't
+  // show up in the snapshot.
+  const std::map<uint64_t, uint8_t> before = {{0x1000u, 1u}, {0x5000u, 2u}};
+  const std::map<uint64_t, uint8_t> after = {
+      {0x1000u, 9u}, {0x1001u, 3u}, {0x5000u, 2u}, {0x9000u, 4u}};
+  EXPECT_EQ(Bytes(snapshot), before);
+  EXPECT_EQ(Bytes(mem), after);
+
+  uint8_t byte = 0;
+  EXPECT_FALSE(snapshot.TryReadByte(0x1001u, &byte));
+  EXPECT_EQ(snapshot.TryGetBytes(0x1000u, 2u), nullptr);
+  ASSERT_NE(mem.TryGetBytes(0x1000u, 2u), nullptr);
+  EXPECT_EQ(mem.TryGetBytes(0x1000u, 2u)[1], 3u);
+}
+
+TEST(PagedMemory, ComparesSharedAndCopiedPages) {
+  PagedMemory mem;
+  mem.WriteByte(0x1000u, 1u);
+  mem.WriteByte(0x5000u, 2u);
+
+  // Shares all pages.
+  auto shared = mem;
+  EXPECT_EQ(shared, mem);
+
+  // Has its own pages with the same contents.
+  PagedMemory copied;
+  copied.WriteByte(0x5000u, 2u);
+  copied.WriteByte(0x1000u, 1u);
+  EXPECT_EQ(copied, mem);
+
+  // Un-shares the page, but leaves it the same.
+  shared.WriteByte(0x1000u, 1u);
+  EXPECT_EQ(shared, mem);
+
+  shared.WriteByte(0x1000u, 7u);
+  EXPECT_NE(shared, mem);
+
+  // An initialized zero byte differs from an uninitialized byte.
+  copied.WriteByte(0x1001u, 0u);
+  EXPECT_NE(copied, mem);
+  EXPECT_NE(mem, copied);
+
+  // So does a page more.
+  auto more = mem;
+  more.WriteByte(0x9000u, 0u);
+  EXPECT_NE(more, mem);
+  EXPECT_NE(mem, more);
+}
+
+TEST(PagedMemory, SeedsHandlersWithUninitializedReads) {
+  MemoryHandler first(llvm::support::endianness::little);
+  first.WriteMemory<uint8_t>(0x10u, 7u);
+  const auto value = first.ReadMemory<uint64_t>(0x2000u);
+  const auto &reads = first.GetUninitializedReads();
+  EXPECT_EQ(Bytes(reads).size(), 8u);
+  EXPECT_EQ(Bytes(reads).count(0x10u), 0u);
+
+  // Read something else first, so that the second handler would make up
+  // different values if it had to.
+  MemoryHandler second(llvm::support::endianness::little, reads);
+  (void) second.ReadMemory<uint64_t>(0x3000u);
+  EXPECT_EQ(second.ReadMemory<uint64_t>(0x2000u), value);
+  EXPECT_EQ(Bytes(second.GetUninitializedReads()).size(), 8u);
+  EXPECT_EQ(Bytes(second.GetUninitializedReads()).count(0x2000u), 0u);
+}
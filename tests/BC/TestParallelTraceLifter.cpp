@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Name.h>
+#include <remill/BC/ImageTraceManager.h>
+#include <remill/BC/TraceLifter.h>
+#include <remill/BC/Util.h>
+#include <remill/OS/OS.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// 0x1000: call 0x1010
+// 0x1005: call 0x1020
+// 0x100a: ret
+// 0x1010: mov eax, 1
+// 0x1015: call 0x1020
+// 0x101a: ret
+// 0x1020: add eax, ebx
+// 0x1022: ret
+static const std::string kCode(
+    "\xe8\x0b\x00\x00\x00"
+    "\xe8\x16\x00\x00\x00"
+    "\xc3\xcc\xcc\xcc\xcc\xcc"
+    "\xb8\x01\x00\x00\x00"
+    "\xe8\x06\x00\x00\x00"
+    "\xc3\xcc\xcc\xcc\xcc\xcc"
+    "\x01\xd8"
+    "\xc3\xcc\xcc\xcc\xcc\xcc",
+    40);
+
+static constexpr uint64_t kCodeAddr = 0x1000;
+
+// Summarize the instructions of `func`, and the functions that they call, in
+// order. Names of values local to `func`, and metadata, are left out, so that
+// functions from different modules can be compared.
+static std::string Summarize(llvm::Function *func) {
+  std::string summary;
+  llvm::raw_string_ostream os(summary);
+  for (auto &block : *func) {
+    os << "block:\n";
+    for (auto &inst : block) {
+      os << "  " << inst.getOpcodeName();
+      if (auto call = llvm::dyn_cast<llvm::CallBase>(&inst)) {
+        if (auto callee = call->getCalledFunction()) {
+          os << " " << callee->getName();
+        }
+      }
+      os << "\n";
+    }
+  }
+  return os.str();
+}
+
+static std::map<uint64_t, std::string>
+Summarize(const remill::TraceMap &traces) {
+  std::map<uint64_t, std::string> summaries;
+  for (auto [addr, func] : traces) {
+    summaries[addr] = Summarize(func);
+  }
+  return summaries;
+}
+
+}  // namespace
+
+TEST(ParallelTraceLifter, MatchesSerialLifter) {
+  llvm::LLVMContext context;
+  context.enableOpaquePointers();
+  auto arch = remill::Arch::Build(&context, remill::OSName::kOSLinux,
+                                  remill::ArchName::kArchAMD64);
+  ASSERT_TRUE(arch);
+  auto semantics = remill::LoadArchSemantics(arch.get());
+  ASSERT_TRUE(semantics);
+
+  remill::ImageTraceManager serial_manager;
+  ASSERT_TRUE(serial_manager.AddMemorySegment(kCode, kCodeAddr));
+  remill::TraceLifter serial_lifter(arch.get(), serial_manager);
+  ASSERT_TRUE(serial_lifter.Lift(kCodeAddr));
+
+  const auto expected = Summarize(serial_manager.traces);
+  ASSERT_EQ(expected.size(), 3u);
+  EXPECT_EQ(expected.count(0x1000), 1u);
+  EXPECT_EQ(expected.count(0x1010), 1u);
+  EXPECT_EQ(expected.count(0x1020), 1u);
+
+  // Lift the same image a few times, so that different workers get to lift
+  // different traces.
+  for (auto i = 0; i < 4; ++i) {
+    remill::ImageTraceManager manager;
+    ASSERT_TRUE(manager.AddMemorySegment(kCode, kCodeAddr));
+
+    llvm::Module dest_module("parallel", context);
+    dest_module.setDataLayout(semantics->getDataLayout());
+    dest_module.setTargetTriple(semantics->getTargetTriple());
+
+    remill::ParallelTraceLifter lifter(remill::OSName::kOSLinux,
+                                       remill::ArchName::kArchAMD64, manager,
+                                       4);
+    ASSERT_TRUE(lifter.Lift({kCodeAddr}, &dest_module));
+    EXPECT_FALSE(llvm::verifyModule(dest_module, &llvm::errs()));
+    EXPECT_EQ(Summarize(manager.traces), expected);
+
+    // The traces are defined in address order.
+    std::vector<std::string> defined;
+    for (auto &func : dest_module) {
+      if (!func.isDeclaration()) {
+        defined.push_back(func.getName().str());
+      }
+    }
+    const std::vector<std::string> expected_order = {
+        manager.TraceName(0x1000), manager.TraceName(0x1010),
+        manager.TraceName(0x1020)};
+    EXPECT_EQ(defined, expected_order);
+  }
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2022-present Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <llvm/ADT/APInt.h>
+#include <llvm/AsmParser/Parser.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/BC/Optimizer.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Runs `StatePromotionPass` over the function `@test` of small modules of
+// lifted code. `State` is accessed through byte offsets, so that the tests
+// don't depend on the layout of any architecture's `State` structure.
+class StatePromotionTest : public ::testing::Test {
+ protected:
+  StatePromotionTest(void) {
+    context.enableOpaquePointers();
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+  }
+
+  // Parse `body` as the body of `@test`, and run the pass over it. Returns
+  // `true` if the pass changed anything.
+  bool Promote(const std::string &body) {
+    const std::string ir =
+        "target datalayout = \"e-m:e-i64:64-f80:128-n8:16:32:64-S128\"\n"
+        "@saved = global ptr null\n"
+        "declare ptr @__remill_function_call(ptr, i64, ptr)\n"
+        "declare ptr @__remill_jump(ptr, i64, ptr)\n"
+        "declare ptr @sub_2000(ptr, i64, ptr)\n"
+        "define ptr @test(ptr %state, i64 %pc, ptr %mem) {\n" +
+        body + "}\n";
+
+    llvm::SMDiagnostic err;
+    module = llvm::parseAssemblyString(ir, err, context);
+    if (!module) {
+      std::string message;
+      llvm::raw_string_ostream os(message);
+      err.print("test", os);
+      ADD_FAILURE() << os.str();
+      return false;
+    }
+
+    func = module->getFunction("test");
+    remill::StatePromotionPass pass;
+    auto pa = pass.run(*func, fam);
+    fam.clear();
+
+    EXPECT_FALSE(llvm::verifyModule(*module, &llvm::errs()));
+    return !pa.areAllPreserved();
+  }
+
+  // Returns the offset into `State` accessed by `inst`, or `-1` if `inst`
+  // doesn't load from or store to `State`.
+  int64_t StateOffset(llvm::Instruction *inst) const {
+    llvm::Value *ptr = nullptr;
+    if (auto load = llvm::dyn_cast_or_null<llvm::LoadInst>(inst)) {
+      ptr = load->getPointerOperand();
+    } else if (auto store = llvm::dyn_cast_or_null<llvm::StoreInst>(inst)) {
+      ptr = store->getPointerOperand();
+    } else {
+      return -1;
+    }
+
+    llvm::APInt offset(64, 0);
+    auto base = ptr->stripAndAccumulateConstantOffsets(
+        module->getDataLayout(), offset, true);
+    if (base != func->getArg(0)) {
+      return -1;
+    }
+    return offset.getSExtValue();
+  }
+
+  // Returns the loads or stores of the `State` bytes at `offset`, in order.
+  std::vector<llvm::Instruction *> Accesses(unsigned opcode, int64_t offset) {
+    std::vector<llvm::Instruction *> accesses;
+    for (auto &block : *func) {
+      for (auto &inst : block) {
+        if (inst.getOpcode() == opcode && StateOffset(&inst) == offset) {
+          accesses.push_back(&inst);
+        }
+      }
+    }
+    return accesses;
+  }
+
+  // Returns the instruction named `name`, or `nullptr`.
+  llvm::Instruction *Named(const std::string &name) const {
+    for (auto &block : *func) {
+      for (auto &inst : block) {
+        if (inst.getName() == name) {
+          return &inst;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  llvm::LLVMContext context;
+  llvm::PassBuilder pb;
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  std::unique_ptr<llvm::Module> module;
+  llvm::Function *func{nullptr};
+};
+
+}  // namespace
+
+TEST_F(StatePromotionTest, SpillsAndReloadsAroundStateCalls) {
+  ASSERT_TRUE(Promote(R"(
+  %rax = getelementptr inbounds i8, ptr %state, i64 16
+  %rbx = getelementptr inbounds i8, ptr %state, i64 24
+  %a = load i64, ptr %rax
+  %b = add i64 %a, 1
+  store i64 %b, ptr %rax
+  %m = call ptr @__remill_function_call(ptr %state, i64 %pc, ptr %mem)
+  %c = load i64, ptr %rax
+  %d = load i64, ptr %rbx
+  %e = add i64 %c, %d
+  store i64 %e, ptr %rbx
+  ret ptr %m
+)"));
+
+  auto call = llvm::cast<llvm::CallInst>(Named("m"));
+  auto b = Named("b");
+  auto e = llvm::cast<llvm::BinaryOperator>(Named("e"));
+  auto ret = func->getEntryBlock().getTerminator();
+
+  // `State` is read once on entry, and again after the call.
+  auto rax_loads = Accesses(llvm::Instruction::Load, 16);
+  ASSERT_EQ(rax_loads.size(), 2u);
+  EXPECT_TRUE(rax_loads[0]->comesBefore(b));
+  EXPECT_TRUE(call->comesBefore(rax_loads[1]));
+  EXPECT_EQ(e->getOperand(0), rax_loads[1]);
+
+  // The value of `%rax` is written back to `State` before the call can see
+  // it, and then again before the return.
+  auto rax_stores = Accesses(llvm::Instruction::Store, 16);
+  ASSERT_EQ(rax_stores.size(), 2u);
+  EXPECT_EQ(rax_stores[0]->getOperand(0), b);
+  EXPECT_TRUE(rax_stores[0]->comesBefore(call));
+  EXPECT_EQ(rax_stores[1]->getOperand(0), rax_loads[1]);
+  EXPECT_TRUE(call->comesBefore(rax_stores[1]));
+
+  // The final value of `%rbx` is only written back before the return.
+  auto rbx_stores = Accesses(llvm::Instruction::Store, 24);
+  ASSERT_FALSE(rbx_stores.empty());
+  EXPECT_EQ(rbx_stores.back()->getOperand(0), e);
+  EXPECT_TRUE(rbx_stores.back()->comesBefore(ret));
+  for (auto store : rbx_stores) {
+    EXPECT_TRUE(store == rbx_stores.back() || store->comesBefore(call));
+  }
+}
+
+TEST_F(StatePromotionTest, SpillsBeforeMustTailCalls) {
+  ASSERT_TRUE(Promote(R"(
+  %rax = getelementptr inbounds i8, ptr %state, i64 16
+  %a = load i64, ptr %rax
+  %b = add i64 %a, 1
+  store i64 %b, ptr %rax
+  %m = musttail call ptr @__remill_jump(ptr %state, i64 %b, ptr %mem)
+  ret ptr %m
+)"));
+
+  auto call = Named("m");
+  auto stores = Accesses(llvm::Instruction::Store, 16);
+  ASSERT_EQ(stores.size(), 1u);
+  EXPECT_EQ(stores[0]->getOperand(0), Named("b"));
+  EXPECT_EQ(stores[0]->getNextNode(), call);
+
+  // Nothing may come between a `musttail` call and its return.
+  EXPECT_TRUE(llvm::isa<llvm::ReturnInst>(call->getNextNode()));
+  EXPECT_EQ(Accesses(llvm::Instruction::Load, 16).size(), 1u);
+}
+
+TEST_F(StatePromotionTest, SpillsBeforeMustTailCallsWithoutState) {
+  ASSERT_TRUE(Promote(R"(
+  %rax = getelementptr inbounds i8, ptr %state, i64 16
+  %a = load i64, ptr %rax
+  %b = add i64 %a, 1
+  store i64 %b, ptr %rax
+  %m = musttail call ptr @sub_2000(ptr null, i64 %pc, ptr %mem)
+  ret ptr %m
+)"));
+
+  // The call doesn't see `State`, but the write back must still happen before
+  // it, as it can't go between the call and the return.
+  auto call = Named("m");
+  auto stores = Accesses(llvm::Instruction::Store, 16);
+  ASSERT_EQ(stores.size(), 1u);
+  EXPECT_EQ(stores[0]->getOperand(0), Named("b"));
+  EXPECT_EQ(stores[0]->getNextNode(), call);
+  EXPECT_TRUE(llvm::isa<llvm::ReturnInst>(call->getNextNode()));
+}
+
+TEST_F(StatePromotionTest, LeavesOverlappingAccessesAlone) {
+  ASSERT_TRUE(Promote(R"(
+  %rax = getelementptr inbounds i8, ptr %state, i64 16
+  %rcx = getelementptr inbounds i8, ptr %state, i64 32
+  %a = load i64, ptr %rax
+  store i32 7, ptr %rax
+  %c = load i32, ptr %rcx
+  %c2 = add i32 %c, 1
+  store i32 %c2, ptr %rcx
+  %m = call ptr @__remill_function_call(ptr %state, i64 %a, ptr %mem)
+  ret ptr %m
+)"));
+
+  // The 64- and 32-bit accesses of `%rax` overlap, so they stay as they were.
+  auto a = Named("a");
+  ASSERT_NE(a, nullptr);
+  EXPECT_EQ(StateOffset(a), 16);
+  auto rax_stores = Accesses(llvm::Instruction::Store, 16);
+  ASSERT_EQ(rax_stores.size(), 1u);
+  EXPECT_TRUE(a->comesBefore(rax_stores[0]));
+
+  // `%rcx` is only accessed as an `i32`, so it is promoted, and read on entry.
+  EXPECT_EQ(Named("c"), nullptr);
+  auto c2 = llvm::cast<llvm::BinaryOperator>(Named("c2"));
+  auto rcx_load = llvm::dyn_cast<llvm::Instruction>(c2->getOperand(0));
+  ASSERT_NE(rcx_load, nullptr);
+  EXPECT_EQ(StateOffset(rcx_load), 32);
+}
+
+TEST_F(StatePromotionTest, DoesNothingIfStateEscapes) {
+  const std::string body = R"(
+  %rax = getelementptr inbounds i8, ptr %state, i64 16
+  %a = load i64, ptr %rax
+  %b = add i64 %a, 1
+  store i64 %b, ptr %rax
+  store ptr %state, ptr @saved
+  %m = call ptr @__remill_function_call(ptr %state, i64 %pc, ptr %mem)
+  %c = load i64, ptr %rax
+  store i64 %c, ptr %rax
+  ret ptr %m
+)";
+  EXPECT_FALSE(Promote(body));
+
+  // The call could read or write `%rax` through `@saved`.
+  auto c = Named("c");
+  ASSERT_NE(c, nullptr);
+  EXPECT_EQ(StateOffset(c), 16);
+  EXPECT_EQ(Accesses(llvm::Instruction::Load, 16).size(), 2u);
+  EXPECT_EQ(Accesses(llvm::Instruction::Store, 16).size(), 2u);
+}
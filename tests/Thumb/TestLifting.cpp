@@ -21,6 +21,7 @@
 #include <llvm/ExecutionEngine/Interpreter.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Verifier.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/TargetSelect.h>
@@ -29,14 +30,20 @@
 #include <remill/Arch/Arch.h>
 #include <remill/Arch/Name.h>
 #include <remill/BC/ABI.h>
+#include <remill/BC/ImageTraceManager.h>
 #include <remill/BC/IntrinsicTable.h>
 #include <remill/BC/Optimizer.h>
+#include <remill/BC/SleighLifter.h>
+#include <remill/BC/TraceLifter.h>
 #include <remill/BC/Util.h>
 #include <remill/OS/OS.h>
 #include <test_runner/TestRunner.h>
 
+#include <algorithm>
 #include <functional>
+#include <map>
 #include <random>
+#include <set>
 #include <sstream>
 
 #include "gtest/gtest.h"
@@ -131,6 +138,7 @@ class TestOutputSpec {
 class TestSpecRunner {
  private:
   test_runner::LiftingTester lifter;
+  test_runner::JITSession session;
   uint64_t tst_ctr;
   test_runner::random_bytes_engine rbe;
   llvm::support::endianness endian;
@@ -183,12 +191,15 @@ class TestSpecRunner {
       prec(*mem_hand);
     }
 
+    this->session.AddModule(*justFuncMod);
     test_runner::ExecuteLiftedFunction<AArch32State, uint32_t>(
-        new_func, test.target_bytes.length(), &st, mem_hand.get(),
+        this->session.GetLiftedFunction<AArch32State>(new_func),
+        test.target_bytes.length(), &st, mem_hand.get(),
         [](AArch32State *st) { return st->gpr.r15.dword; });
 
     LOG(INFO) << "Pc after execute " << st.gpr.r15.dword;
     test.CheckResultingState(st);
+    this->session.EndTestCase();
   }
 };
 
@@ -254,3 +265,282 @@ TEST(RegressionTests, AARCH64RegSize) {
 
   CHECK_EQ(lifted2->getType()->getIntegerBitWidth(), 32);
 }
+
+namespace {
+
+// Lift the straight-line Thumb code `code` at `addr` into a new function
+// `name` of `module`, one instruction after another in its entry block.
+static llvm::Function *LiftStraightLineCode(const remill::Arch *arch,
+                                            llvm::Module *module,
+                                            std::string_view name,
+                                            std::string_view code,
+                                            uint64_t addr, bool directly) {
+  auto func = arch->DefineLiftedFunction(name, module);
+  auto block = &func->getEntryBlock();
+  llvm::IRBuilder<> ir(block);
+
+  for (size_t offset = 0; offset < code.size(); offset += 2u) {
+    remill::Instruction inst;
+    CHECK(arch->DecodeInstruction(addr + offset, code.substr(offset, 2u), inst,
+                                  arch->CreateInitialContext()));
+
+    auto lifter = inst.GetLifter();
+    auto status = directly ? lifter->LiftIntoBlockDirectly(inst, block)
+                           : lifter->LiftIntoBlock(inst, block);
+    CHECK_EQ(status, remill::LiftStatus::kLiftedInstruction);
+
+    // Fall through to the next instruction.
+    ir.SetInsertPoint(block);
+    ir.CreateStore(ir.CreateLoad(llvm::Type::getInt32Ty(module->getContext()),
+                                 remill::LoadNextProgramCounterRef(block)),
+                   remill::LoadProgramCounterRef(block));
+  }
+
+  ir.CreateRet(ir.CreateLoad(arch->MemoryPointerType(),
+                             remill::LoadMemoryPointerRef(block)));
+  return func;
+}
+
+static size_t NumInstructionFunctions(llvm::Module *module) {
+  return std::count_if(module->begin(), module->end(), [](llvm::Function &f) {
+    return f.getName().startswith(
+        remill::SleighLifter::kInstructionFunctionPrefix);
+  });
+}
+
+}  // namespace
+
+TEST(ThumbEmitIntoBlock, MatchesInstructionFunctions) {
+  llvm::LLVMContext context;
+  context.enableOpaquePointers();
+  auto arch = remill::Arch::Build(&context, remill::OSName::kOSLinux,
+                                  remill::ArchName::kArchThumb2LittleEndian);
+  auto module = remill::LoadArchSemantics(arch.get());
+
+  // adds r0, r1, r2
+  // lsls r3, r0, #2
+  // subs r1, r3, r0
+  // eors r0, r1
+  const std::string code("\x88\x18\x83\x00\x19\x1a\x48\x40", 8);
+  const uint64_t addr = 0x1000;
+
+  auto via_funcs = LiftStraightLineCode(arch.get(), module.get(), "via_funcs",
+                                        code, addr, false);
+  const auto num_inst_funcs = NumInstructionFunctions(module.get());
+  EXPECT_EQ(num_inst_funcs, 4u);
+
+  // Lifting directly doesn't create any instruction functions.
+  auto directly = LiftStraightLineCode(arch.get(), module.get(), "directly",
+                                       code, addr, true);
+  EXPECT_EQ(NumInstructionFunctions(module.get()), num_inst_funcs);
+
+  auto lifted = remill::CloneFunctionsWithDependencies({via_funcs, directly});
+  remill::OptimizeBareModule(lifted);
+
+  test_runner::JITSession session;
+  session.AddModule(*lifted);
+  auto run_via_funcs = session.GetLiftedFunction<AArch32State>(via_funcs);
+  auto run_directly = session.GetLiftedFunction<AArch32State>(directly);
+
+  test_runner::random_bytes_engine rbe;
+  test_runner::MemoryHandler memory(llvm::support::endianness::little);
+  for (auto i = 0; i < 16; ++i) {
+    AArch32State st1 = {};
+    test_runner::RandomizeState(st1, rbe);
+    st1.gpr.r15.dword = addr;
+    st1.sr.n = test_runner::random_boolean_flag(rbe);
+    st1.sr.z = test_runner::random_boolean_flag(rbe);
+    st1.sr.c = test_runner::random_boolean_flag(rbe);
+    st1.sr.v = test_runner::random_boolean_flag(rbe);
+    auto st2 = st1;
+
+    run_via_funcs(&st1, addr, &memory);
+    run_directly(&st2, addr, &memory);
+
+    EXPECT_EQ(st1.gpr.r0.dword, st2.gpr.r0.dword);
+    EXPECT_EQ(st1.gpr.r1.dword, st2.gpr.r1.dword);
+    EXPECT_EQ(st1.gpr.r2.dword, st2.gpr.r2.dword);
+    EXPECT_EQ(st1.gpr.r3.dword, st2.gpr.r3.dword);
+    EXPECT_EQ(st1.gpr.r15.dword, st2.gpr.r15.dword);
+    EXPECT_EQ(st1.gpr.r15.dword, addr + code.size());
+    EXPECT_EQ(st1.sr.n, st2.sr.n);
+    EXPECT_EQ(st1.sr.z, st2.sr.z);
+    EXPECT_EQ(st1.sr.c, st2.sr.c);
+    EXPECT_EQ(st1.sr.v, st2.sr.v);
+  }
+}
+
+namespace {
+
+// Serves code out of memory, and prefixes the names of traces with `prefix`,
+// so that the same code can be lifted more than once into one module.
+class PrefixedTraceManager : public remill::ImageTraceManager {
+ public:
+  explicit PrefixedTraceManager(std::string prefix_)
+      : prefix(std::move(prefix_)) {}
+
+  std::string TraceName(uint64_t addr) override {
+    return prefix + this->ImageTraceManager::TraceName(addr);
+  }
+
+  const std::string prefix;
+};
+
+}  // namespace
+
+TEST(ThumbEmitIntoBlock, TraceLifterLiftsDirectly) {
+  llvm::LLVMContext context;
+  context.enableOpaquePointers();
+  auto arch = remill::Arch::Build(&context, remill::OSName::kOSLinux,
+                                  remill::ArchName::kArchThumb2LittleEndian);
+  auto module = remill::LoadArchSemantics(arch.get());
+
+  // 0x1000: adds r0, r1, r2
+  // 0x1002: lsls r3, r0, #2
+  // 0x1004: subs r1, r3, r0
+  // 0x1006: eors r0, r1
+  // 0x1008: bx lr
+  //
+  // The code is padded with an unreachable `bx lr`, so that reading the last
+  // instruction doesn't run off the end of the segment.
+  const std::string code("\x88\x18\x83\x00\x19\x1a\x48\x40\x70\x47\x70\x47",
+                         12);
+
+  PrefixedTraceManager via_funcs("via_funcs_");
+  ASSERT_TRUE(via_funcs.AddMemorySegment(code, 0x1000));
+  remill::TraceLifter via_funcs_lifter(arch.get(), via_funcs);
+  ASSERT_TRUE(via_funcs_lifter.Lift(0x1000));
+  const auto num_inst_funcs = NumInstructionFunctions(module.get());
+  EXPECT_GE(num_inst_funcs, 5u);
+
+  // All of the instructions have straight-line p-code, so lifting them
+  // directly doesn't create any instruction functions.
+  PrefixedTraceManager directly("directly_");
+  ASSERT_TRUE(directly.AddMemorySegment(code, 0x1000));
+  remill::TraceLifter directly_lifter(arch.get(), directly);
+  directly_lifter.SetLiftDirectly(true);
+  ASSERT_TRUE(directly_lifter.Lift(0x1000));
+  EXPECT_EQ(NumInstructionFunctions(module.get()), num_inst_funcs);
+
+  auto via_funcs_trace = via_funcs.GetLiftedTraceDefinition(0x1000);
+  auto directly_trace = directly.GetLiftedTraceDefinition(0x1000);
+  ASSERT_NE(via_funcs_trace, nullptr);
+  ASSERT_NE(directly_trace, nullptr);
+  EXPECT_NE(via_funcs_trace, directly_trace);
+  EXPECT_FALSE(llvm::verifyFunction(*directly_trace, &llvm::errs()));
+}
+
+namespace {
+
+// Serves code out of memory, reports devirtualized targets that can be added
+// to between lifts, and records the addresses that the lifter reads.
+class RecordingTraceManager : public remill::ImageTraceManager {
+ public:
+  void ForEachDevirtualizedTarget(
+      const remill::Instruction &inst,
+      std::function<void(uint64_t, remill::DevirtualizedTargetKind)> func)
+      override {
+    auto it = this->targets.find(inst.pc);
+    if (it != this->targets.end()) {
+      for (auto target : it->second) {
+        func(target, remill::DevirtualizedTargetKind::kTraceLocal);
+      }
+    }
+  }
+
+  bool TryReadExecutableByte(uint64_t addr, uint8_t *byte) override {
+    this->read_addrs.insert(addr);
+    return this->ImageTraceManager::TryReadExecutableByte(addr, byte);
+  }
+
+  std::string_view TryReadExecutableBytes(uint64_t addr,
+                                          size_t max_size) override {
+    this->read_addrs.insert(addr);
+    return this->ImageTraceManager::TryReadExecutableBytes(addr, max_size);
+  }
+
+  // Maps the address of an indirect jump to its known targets.
+  std::map<uint64_t, std::vector<uint64_t>> targets;
+
+  std::set<uint64_t> read_addrs;
+};
+
+static llvm::SwitchInst *FindSwitch(llvm::Function *func) {
+  for (auto &block : *func) {
+    if (auto sw = llvm::dyn_cast<llvm::SwitchInst>(block.getTerminator())) {
+      return sw;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+TEST(ThumbRelift, LiftsOnlyNewJumpTargets) {
+  llvm::LLVMContext context;
+  context.enableOpaquePointers();
+  auto arch = remill::Arch::Build(&context, remill::OSName::kOSLinux,
+                                  remill::ArchName::kArchThumb2LittleEndian);
+  auto module = remill::LoadArchSemantics(arch.get());
+
+  // 0x1000: movs r1, #1
+  // 0x1002: mov pc, r0
+  // 0x1004: movs r1, #2
+  // 0x1006: bx lr
+  // 0x1008: movs r1, #3
+  // 0x100a: bx lr
+  //
+  // The code is padded with unreachable `bx lr`s, so that reading the last
+  // instruction doesn't run off the end of the segment.
+  const std::string code(
+      "\x01\x21\x87\x46\x02\x21\x70\x47\x03\x21\x70\x47\x70\x47", 14);
+  RecordingTraceManager manager;
+  ASSERT_TRUE(manager.AddMemorySegment(code, 0x1000));
+  manager.targets[0x1002] = {0x1004};
+
+  remill::TraceLifter lifter(arch.get(), manager);
+  lifter.SetIncremental(true);
+  ASSERT_TRUE(lifter.Lift(0x1000));
+
+  auto func = manager.GetLiftedTraceDefinition(0x1000);
+  ASSERT_NE(func, nullptr);
+  EXPECT_EQ(manager.read_addrs,
+            (std::set<uint64_t>{0x1000, 0x1002, 0x1004, 0x1006}));
+
+  auto jump_table = FindSwitch(func);
+  ASSERT_NE(jump_table, nullptr);
+  EXPECT_EQ(jump_table->getNumCases(), 1u);
+
+  std::set<llvm::BasicBlock *> old_blocks;
+  for (auto &block : *func) {
+    old_blocks.insert(&block);
+  }
+
+  // Learn of a second target of the jump, and extend the trace with it.
+  manager.targets[0x1002].push_back(0x1008);
+  manager.read_addrs.clear();
+
+  std::vector<uint64_t> relifted;
+  ASSERT_TRUE(lifter.Relift(0x1000, [&](uint64_t addr, llvm::Function *f) {
+    relifted.push_back(addr);
+    EXPECT_EQ(f, func);
+  }));
+  EXPECT_EQ(relifted, std::vector<uint64_t>{0x1000});
+  EXPECT_EQ(manager.GetLiftedTraceDefinition(0x1000), func);
+
+  // Only the newly reachable instructions were decoded again.
+  EXPECT_EQ(manager.read_addrs, (std::set<uint64_t>{0x1008, 0x100a}));
+
+  // The jump gained a case for the new target, and the existing blocks were
+  // kept as they were.
+  EXPECT_EQ(FindSwitch(func), jump_table);
+  EXPECT_EQ(jump_table->getNumCases(), 2u);
+
+  size_t num_kept_blocks = 0;
+  for (auto &block : *func) {
+    num_kept_blocks += old_blocks.count(&block);
+  }
+  EXPECT_EQ(num_kept_blocks, old_blocks.size());
+  EXPECT_GT(func->size(), old_blocks.size());
+  EXPECT_FALSE(llvm::verifyFunction(*func, &llvm::errs()));
+}